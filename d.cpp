@@ -1,770 +1,11962 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <queue>
+#include <algorithm>
+#include <iterator>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <random>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 
 using namespace std;
 
-class UserProfile
+class UserDirectory
 {
 private:
-    string username;
-    vector<string> friendRequests;
-    vector<string> pendingRequests;
-    vector<string> friends;
-    vector<string> posts;
-    vector<int> postLikes;
-
-public:
-    UserProfile(const string &name)
-    {
-        username = name;
-    }
-
-    string getUsername() const
+    struct Slot
     {
-        return username;
-    }
-
-    void addFriendRequest(const string &username)
-    {
-        friendRequests.push_back(username);
-    }
+        uint32_t id;
+        uint32_t hash;
+    };
 
-    void addPendingRequest(const string &username)
-    {
-        pendingRequests.push_back(username);
-    }
+    static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+    static const uint32_t DELETED_SLOT = 0xFFFFFFFE;
 
-    const vector<string> &getPendingRequests() const
-    {
-        return pendingRequests;
-    }
+    deque<string> names;
+    vector<Slot> slots;
+    size_t liveCount;
+    size_t usedSlots;
 
-    void removeFriendRequest(const string &username)
+    size_t findSlot(const char *name, size_t length, uint32_t hash) const
     {
-        for (auto it = friendRequests.begin(); it != friendRequests.end(); ++it)
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask)
         {
-            if (*it == username)
+            const Slot &slot = slots[i];
+            if (slot.id == EMPTY_SLOT)
             {
-                friendRequests.erase(it);
-                break;
+                return i;
             }
-        }
-    }
-
-    void removePendingRequest(const string &username)
-    {
-        for (auto it = pendingRequests.begin(); it != pendingRequests.end(); ++it)
-        {
-            if (*it == username)
+            if (slot.id != DELETED_SLOT && slot.hash == hash && names[slot.id].size() == length &&
+                memcmp(names[slot.id].data(), name, length) == 0)
             {
-                pendingRequests.erase(it);
-                break;
+                return i;
             }
         }
     }
 
-    bool isFriend(const string &username) const
+    void rehash(size_t capacity)
     {
-        for (const string &friendUsername : friends)
+        vector<Slot> old;
+        old.swap(slots);
+        slots.assign(capacity, Slot{EMPTY_SLOT, 0});
+        usedSlots = liveCount;
+
+        size_t mask = capacity - 1;
+        for (const Slot &slot : old)
         {
-            if (friendUsername == username)
+            if (slot.id == EMPTY_SLOT || slot.id == DELETED_SLOT)
             {
-                return true;
+                continue;
+            }
+            size_t i = slot.hash & mask;
+            while (slots[i].id != EMPTY_SLOT)
+            {
+                i = (i + 1) & mask;
             }
+            slots[i] = slot;
         }
-        return false;
     }
 
-    bool hasFriendRequestFrom(const string &username) const
+public:
+    static const uint32_t INVALID_ID = 0xFFFFFFFF;
+
+    static uint32_t hashName(const char *name, size_t length)
     {
-        for (const string &requestUsername : friendRequests)
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; i++)
         {
-            if (requestUsername == username)
-            {
-                return true;
-            }
+            h ^= static_cast<unsigned char>(name[i]);
+            h *= 1099511628211ULL;
         }
-        return false;
+        return static_cast<uint32_t>(h ^ (h >> 32));
     }
 
-    bool hasPendingRequestFrom(const string &username) const
+    UserDirectory()
     {
-        for (const string &requestUsername : pendingRequests)
-        {
-            if (requestUsername == username)
-            {
-                return true;
-            }
-        }
-        return false;
+        liveCount = 0;
+        usedSlots = 0;
+        slots.assign(16, Slot{EMPTY_SLOT, 0});
     }
 
-    void showPendingRequests() const
+    void reserve(size_t count)
     {
-        if (pendingRequests.empty())
+        size_t capacity = slots.size();
+        while (capacity * 7 < count * 10)
         {
-            cout << "\t\tNo pending friend requests." << endl;
+            capacity *= 2;
         }
-        else
+        if (capacity != slots.size())
         {
-            cout << "\t\tPending Friend Requests:" << endl;
-            for (const string &requestUsername : pendingRequests)
-            {
-                cout << "\t\t- " << requestUsername << endl;
-            }
+            rehash(capacity);
         }
     }
 
-    void showFriendList() const
+    uint32_t find(const char *name, size_t length, uint32_t hash) const
     {
-        if (friends.empty())
+        const Slot &slot = slots[findSlot(name, length, hash)];
+        return slot.id == EMPTY_SLOT ? INVALID_ID : slot.id;
+    }
+
+    uint32_t find(const string &name) const
+    {
+        return find(name.data(), name.size(), hashName(name.data(), name.size()));
+    }
+
+    uint32_t insert(const string &name)
+    {
+        return insert(name, hashName(name.data(), name.size()));
+    }
+
+    uint32_t insert(const string &name, uint32_t hash)
+    {
+        if ((usedSlots + 1) * 10 > slots.size() * 7)
         {
-            cout << "\t\tNo friends in the friend list." << endl;
+            rehash(liveCount * 2 + 2 > slots.size() ? slots.size() * 2 : slots.size());
         }
-        else
+
+        size_t index = findSlot(name.data(), name.size(), hash);
+        if (slots[index].id != EMPTY_SLOT)
         {
-            cout << "\t\tFriend List:" << endl;
-            for (const string &friendUsername : friends)
-            {
-                cout << "\t\t- " << friendUsername << endl;
-            }
+            return INVALID_ID;
         }
+
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(name);
+        slots[index] = Slot{id, hash};
+        liveCount++;
+        usedSlots++;
+        return id;
     }
 
-    vector<string> getFriendList() const
+    bool erase(const string &name)
     {
-        return friends;
+        size_t index = findSlot(name.data(), name.size(), hashName(name.data(), name.size()));
+        uint32_t id = slots[index].id;
+        if (id == EMPTY_SLOT)
+        {
+            return false;
+        }
+
+        slots[index].id = DELETED_SLOT;
+        string().swap(names[id]);
+        liveCount--;
+        return true;
     }
 
-    void addFriend(const string &username)
+    size_t tableSize() const
     {
-        friends.push_back(username);
-        removeFriendRequest(username);
-        removePendingRequest(username);
+        return slots.size();
     }
 
-    void removeFriend(const string &username)
+    const char *tableBytes() const
     {
-        for (auto it = friends.begin(); it != friends.end(); ++it)
-        {
-            if (*it == username)
-            {
-                friends.erase(it);
-                return;
-            }
-        }
+        return reinterpret_cast<const char *>(slots.data());
     }
 
-    void addPost(const string &post)
+    static size_t slotSize()
     {
-        posts.push_back(post);
-        postLikes.push_back(0);
+        return sizeof(Slot);
     }
 
-    void deletePost(int index)
+    void appendName(const char *data, size_t length)
     {
-        if (index >= 0 && index < posts.size())
+        names.emplace_back(data, length);
+        if (length > 0)
         {
-            posts.erase(posts.begin() + index);
-            postLikes.erase(postLikes.begin() + index);
+            liveCount++;
         }
     }
 
-    const vector<string> &getPosts() const
+    bool restoreTable(const char *data, size_t capacity)
     {
-        return posts;
+        if (capacity < 16 || (capacity & (capacity - 1)) != 0 || capacity * 7 < liveCount * 10)
+        {
+            return false;
+        }
+
+        slots.resize(capacity);
+        memcpy(&slots[0], data, capacity * sizeof(Slot));
+        usedSlots = 0;
+        for (const Slot &slot : slots)
+        {
+            if (slot.id == EMPTY_SLOT)
+            {
+                continue;
+            }
+            if (slot.id != DELETED_SLOT && (slot.id >= names.size() || names[slot.id].empty()))
+            {
+                return false;
+            }
+            usedSlots++;
+        }
+        return usedSlots < capacity;
     }
 
-    void showPosts() const
+    void rebuildTable()
     {
-        if (posts.empty())
+        size_t capacity = 16;
+        while (capacity * 7 < (liveCount + 1) * 10)
         {
-            cout << "\t\tNo posts available." << endl;
+            capacity *= 2;
         }
-        else
+        slots.assign(capacity, Slot{EMPTY_SLOT, 0});
+        usedSlots = 0;
+
+        size_t mask = capacity - 1;
+        for (size_t id = 0; id < names.size(); id++)
         {
-            cout << "\t\tPosts:" << endl;
-            for (size_t i = 0; i < posts.size(); ++i)
+            if (names[id].empty())
+            {
+                continue;
+            }
+            uint32_t hash = hashName(names[id].data(), names[id].size());
+            size_t i = hash & mask;
+            while (slots[i].id != EMPTY_SLOT)
             {
-                cout << "\t\t- [" << i << "] " << posts[i] << " (Likes: " << postLikes[i] << ")" << endl;
+                i = (i + 1) & mask;
             }
+            slots[i] = Slot{static_cast<uint32_t>(id), hash};
+            usedSlots++;
         }
     }
 
-    void likePost(int index)
+    void reserveIds(uint32_t limit)
     {
-        if (index >= 0 && index < postLikes.size())
+        while (names.size() < limit)
         {
-            postLikes[index]++;
+            names.emplace_back();
         }
     }
 
-    bool canSeePosts(const string &username) const
+    const string &nameOf(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    size_t size() const
     {
-        return isFriend(username) || username == this->username;
+        return liveCount;
     }
 
-    bool canLikePosts(const string &username) const
+    uint32_t idLimit() const
     {
-        return isFriend(username);
+        return static_cast<uint32_t>(names.size());
     }
 };
 
-class User
+const uint32_t UserDirectory::EMPTY_SLOT;
+const uint32_t UserDirectory::DELETED_SLOT;
+const uint32_t UserDirectory::INVALID_ID;
+
+// User IDs in name order, which is all a trie over the names would store: every prefix is a contiguous run, and the
+// runs one character longer are found by searching inside it. The names themselves stay in the directory, so the
+// index costs four bytes per user. New users go into a small sorted side list and deleted ones are remembered until
+// both are merged into the main list; bulk loads defer everything to a single sort.
+class UsernameIndex
 {
 private:
-    string username;
-    string password;
-    UserProfile *profile;
-
-public:
-    User(const string &name, const string &pass)
-    {
-        username = name;
-        password = pass;
-        profile = nullptr;
-    }
+    static const size_t SIDE_LIMIT = 1 << 14;
+    static const size_t MAX_FUZZY_QUERY = 64;
 
-    string getUsername() const
-    {
-        return username;
-    }
+    const UserDirectory &directory;
+    vector<uint32_t> sorted;
+    vector<uint32_t> recent;
+    vector<uint32_t> pending;
+    vector<pair<uint32_t, string>> removed;
+    bool deferring;
 
-    string getPassword() const
+    const string &keyOf(uint32_t id) const
     {
-        return password;
+        const string &name = directory.nameOf(id);
+        if (!name.empty() || removed.empty())
+        {
+            return name;
+        }
+        auto it = lower_bound(removed.begin(), removed.end(), make_pair(id, string()));
+        return it != removed.end() && it->first == id ? it->second : name;
     }
 
-    UserProfile *getProfile() const
+    bool isRemoved(uint32_t id) const
     {
-        return profile;
+        if (removed.empty())
+        {
+            return false;
+        }
+        auto it = lower_bound(removed.begin(), removed.end(), make_pair(id, string()));
+        return it != removed.end() && it->first == id;
     }
 
-    void createProfile()
+    vector<uint32_t>::const_iterator firstAtLeast(const vector<uint32_t> &ids, const string &name, bool inclusive) const
     {
-        profile = new UserProfile(username);
+        if (inclusive)
+        {
+            return lower_bound(ids.begin(), ids.end(), name, [this](uint32_t id, const string &value)
+                               { return keyOf(id) < value; });
+        }
+        return upper_bound(ids.begin(), ids.end(), name, [this](const string &value, uint32_t id)
+                           { return value < keyOf(id); });
     }
-};
-
-class UserManager
-{
-private:
-    vector<User> users;
-    string filename;
-    UserProfile *currentUser;
 
-public:
-    UserManager(const string &file)
+    void rebuild()
     {
-        filename = file;
-        currentUser = nullptr;
-        loadUsers();
-    }
+        auto byName = [this](uint32_t a, uint32_t b)
+        { return keyOf(a) < keyOf(b); };
+        sort(pending.begin(), pending.end(), byName);
 
-    ~UserManager()
-    {
-        saveUsers();
-        for (User &user : users)
+        vector<uint32_t> side, merged;
+        side.reserve(recent.size() + pending.size());
+        std::merge(recent.begin(), recent.end(), pending.begin(), pending.end(), back_inserter(side), byName);
+        merged.reserve(sorted.size() + side.size());
+        std::merge(sorted.begin(), sorted.end(), side.begin(), side.end(), back_inserter(merged), byName);
+        if (!removed.empty())
         {
-            delete user.getProfile();
+            merged.erase(remove_if(merged.begin(), merged.end(), [this](uint32_t id)
+                                   { return isRemoved(id); }),
+                         merged.end());
         }
+
+        sorted.swap(merged);
+        vector<uint32_t>().swap(recent);
+        vector<uint32_t>().swap(pending);
+        vector<pair<uint32_t, string>>().swap(removed);
     }
 
-    void saveUsers()
+    // Visits the run ids[begin, end) of names sharing their first depth characters, with rows holding the edit
+    // distance table of the query against that prefix. Names ending at this depth sort first in the run.
+    void walk(const vector<uint32_t> &ids, size_t begin, size_t end, size_t depth, const string &query, unsigned maxEdits,
+              vector<uint8_t> &rows, vector<pair<unsigned, uint32_t>> &found) const
     {
-        ofstream file(filename);
-
-        if (file.is_open())
+        size_t width = query.size() + 1;
+        const uint8_t *row = &rows[depth * width];
+        while (begin < end && keyOf(ids[begin]).size() == depth)
         {
-            for (const User &user : users)
+            if (row[query.size()] <= maxEdits && !isRemoved(ids[begin]))
             {
-                file << user.getUsername() << " " << user.getPassword() << endl;
+                found.push_back(make_pair(row[query.size()], ids[begin]));
             }
-
-            file.close();
+            begin++;
         }
-        else
+        if (depth >= query.size() + maxEdits)
         {
-            cout << "\t\tUnable to save users. File not found." << endl;
+            return;
         }
-    }
-
-    void loadUsers()
-    {
-        ifstream file(filename);
-        users.clear();
 
-        if (file.is_open())
+        uint8_t *next = &rows[(depth + 1) * width];
+        while (begin < end)
         {
-            string username, password;
+            char c = keyOf(ids[begin])[depth];
+            auto sameChild = [&](size_t i)
+            { return keyOf(ids[i])[depth] == c; };
 
-            while (file >> username >> password)
+            // Gallop, then bisect, to the end of this child's run.
+            size_t low = begin + 1, step = 1;
+            while (low + step < end && sameChild(low + step))
             {
-                User newUser(username, password);
-                newUser.createProfile();
-
-                users.push_back(newUser);
+                low += step;
+                step *= 2;
+            }
+            size_t high = min(end, low + step);
+            while (low < high)
+            {
+                size_t middle = low + (high - low) / 2;
+                if (sameChild(middle))
+                {
+                    low = middle + 1;
+                }
+                else
+                {
+                    high = middle;
+                }
             }
 
-            file.close();
+            next[0] = static_cast<uint8_t>(row[0] + 1);
+            uint8_t best = next[0];
+            for (size_t k = 1; k < width; k++)
+            {
+                unsigned cost = min(min(row[k] + 1, next[k - 1] + 1), row[k - 1] + (query[k - 1] != c ? 1 : 0));
+                next[k] = static_cast<uint8_t>(cost);
+                best = min(best, next[k]);
+            }
+            if (best <= maxEdits)
+            {
+                walk(ids, begin, low, depth + 1, query, maxEdits, rows, found);
+            }
+            begin = low;
         }
     }
 
-    void registerUser()
+public:
+    UsernameIndex(const UserDirectory &names) : directory(names)
     {
-        string username, password;
-        cout << "\t\tEnter User Name: ";
-        cin >> username;
-        cout << "\t\tEnter Password: ";
-        cin >> password;
-
-        User newUser(username, password);
-        newUser.createProfile();
+        deferring = false;
+    }
 
-        users.push_back(newUser);
-        saveUsers();
+    // Until applyDeferred, inserts are only collected; searches must wait for it.
+    void deferUpdates()
+    {
+        deferring = true;
+    }
 
-        cout << "\t\tUser Registered Successfully." << endl;
+    void applyDeferred()
+    {
+        deferring = false;
+        rebuild();
     }
 
-    void loginUser(const string &name, const string &pass)
+    void clear()
     {
-        for (User &user : users)
-        {
-            if (user.getUsername() == name && user.getPassword() == pass)
-            {
-                cout << "\t\tLogin Successful." << endl;
-                UserProfile *profile = user.getProfile();
-                if (profile != nullptr)
-                {
-                    currentUser = profile;
-                    profile->showPendingRequests();
-                    profileMenu(currentUser);
-                }
-                else
-                {
-                    cout << "\t\tUser profile not found." << endl;
-                }
-                return;
-            }
-        }
-        cout << "\t\tInvalid User Name or Password." << endl;
+        vector<uint32_t>().swap(sorted);
+        vector<uint32_t>().swap(recent);
+        vector<uint32_t>().swap(pending);
+        vector<pair<uint32_t, string>>().swap(removed);
     }
 
-    User *findUserByUsername(const string &username) const
+    void insert(uint32_t id)
     {
-        for (const User &user : users)
+        if (deferring)
         {
-            if (user.getUsername() == username)
-            {
-                return const_cast<User *>(&user);
-                ;
-            }
+            pending.push_back(id);
+            return;
+        }
+        recent.insert(firstAtLeast(recent, directory.nameOf(id), false), id);
+        if (recent.size() > SIDE_LIMIT)
+        {
+            rebuild();
         }
-        return nullptr;
     }
 
-    void showUsers() const
+    // Must be called while the name is still in the directory.
+    void erase(uint32_t id)
     {
-        cout << "\t\t--- Users List ---" << endl;
-        for (const User &user : users)
+        auto it = lower_bound(removed.begin(), removed.end(), make_pair(id, string()));
+        removed.insert(it, make_pair(id, directory.nameOf(id)));
+        if (!deferring && removed.size() > SIDE_LIMIT)
         {
-            cout << "\t\t" << user.getUsername() << endl;
+            rebuild();
         }
     }
 
-    void searchUser(const string &username) const
+    // Adopts a saved order if it still lists exactly the given live users by strictly ascending name.
+    bool assignOrder(const uint32_t *ids, size_t count, size_t liveCount)
     {
-        User *user = findUserByUsername(username);
-        if (user != nullptr)
+        if (count != liveCount)
         {
-            cout << "\t\tUser Found" << endl;
+            return false;
         }
-        else
+        for (size_t i = 0; i < count; i++)
         {
-            cout << "\t\tUser Not Found" << endl;
+            if (ids[i] >= directory.idLimit() || directory.nameOf(ids[i]).empty() ||
+                (i > 0 && !(directory.nameOf(ids[i - 1]) < directory.nameOf(ids[i]))))
+            {
+                return false;
+            }
         }
+        sorted.assign(ids, ids + count);
+        return true;
     }
 
-    void deleteUser(const string &username)
+    vector<uint32_t> exportOrder() const
     {
-        for (User &user : users)
+        vector<uint32_t> order;
+        order.reserve(sorted.size() + recent.size());
+        std::merge(sorted.begin(), sorted.end(), recent.begin(), recent.end(), back_inserter(order),
+                   [this](uint32_t a, uint32_t b)
+                   { return keyOf(a) < keyOf(b); });
+        order.erase(remove_if(order.begin(), order.end(), [this](uint32_t id)
+                              { return isRemoved(id); }),
+                    order.end());
+        return order;
+    }
+
+    // Users whose name starts with prefix, in name order, starting after the name given as after.
+    vector<uint32_t> withPrefix(const string &prefix, const string &after, size_t limit) const
+    {
+        bool fromPrefix = after < prefix;
+        const string &start = fromPrefix ? prefix : after;
+        auto mainIt = firstAtLeast(sorted, start, fromPrefix);
+        auto sideIt = firstAtLeast(recent, start, fromPrefix);
+        vector<uint32_t> matches;
+        while (matches.size() < limit)
         {
-            UserProfile *profile = user.getProfile();
-            if (profile != nullptr)
+            bool mainLeft = mainIt != sorted.end() && keyOf(*mainIt).compare(0, prefix.size(), prefix) == 0;
+            bool sideLeft = sideIt != recent.end() && keyOf(*sideIt).compare(0, prefix.size(), prefix) == 0;
+            if (!mainLeft && !sideLeft)
             {
-                profile->removeFriend(username);
-                profile->removeFriendRequest(username);
-                profile->removePendingRequest(username);
+                break;
             }
-        }
-
-        for (auto it = users.begin(); it != users.end(); ++it)
-        {
-            if (it->getUsername() == username)
+            uint32_t id = (!sideLeft || (mainLeft && keyOf(*mainIt) < keyOf(*sideIt))) ? *mainIt++ : *sideIt++;
+            if (!isRemoved(id))
             {
-                delete it->getProfile();
-                users.erase(it);
-                saveUsers();
-                cout << "\t\tUser Removed Successfully." << endl;
-                return;
+                matches.push_back(id);
             }
         }
-        cout << "\t\tUser Not Found." << endl;
+        return matches;
     }
 
-    void sendFriendRequest(const string &sender, const string &receiver)
+    // Users whose whole name is within maxEdits insertions, deletions or substitutions of query, closest first.
+    vector<pair<unsigned, uint32_t>> similarTo(const string &query, unsigned maxEdits, size_t limit) const
     {
-        User *senderUser = findUserByUsername(sender);
-        User *receiverUser = findUserByUsername(receiver);
-
-        if (senderUser != nullptr && receiverUser != nullptr)
+        vector<pair<unsigned, uint32_t>> found;
+        if (query.size() > MAX_FUZZY_QUERY)
         {
-            UserProfile *senderProfile = senderUser->getProfile();
-            UserProfile *receiverProfile = receiverUser->getProfile();
-
-            senderProfile->addFriendRequest(receiver);
-            receiverProfile->addPendingRequest(sender);
+            return found;
+        }
 
-            cout << "\t\tFriend Request Sent Successfully." << endl;
+        size_t width = query.size() + 1;
+        vector<uint8_t> rows((query.size() + maxEdits + 2) * width);
+        for (size_t k = 0; k < width; k++)
+        {
+            rows[k] = static_cast<uint8_t>(k);
         }
-        else
+        walk(sorted, 0, sorted.size(), 0, query, maxEdits, rows, found);
+        walk(recent, 0, recent.size(), 0, query, maxEdits, rows, found);
+
+        sort(found.begin(), found.end(), [this](const pair<unsigned, uint32_t> &a, const pair<unsigned, uint32_t> &b)
+             { return a.first != b.first ? a.first < b.first : keyOf(a.second) < keyOf(b.second); });
+        if (found.size() > limit)
         {
-            cout << "\t\tInvalid Usernames. Please Try Again." << endl;
+            found.resize(limit);
         }
+        return found;
     }
+};
 
-    void acceptFriendRequest(const string &username, const string &friendUsername)
+const size_t UsernameIndex::SIDE_LIMIT;
+const size_t UsernameIndex::MAX_FUZZY_QUERY;
+
+// Any single word, as the interactive prompt and users.txt have always read them.
+static bool isValidUsername(const char *name, size_t length)
+{
+    if (length == 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++)
     {
-        User *user = findUserByUsername(username);
-        User *friendUser = findUserByUsername(friendUsername);
+        if (isspace(static_cast<unsigned char>(name[i])))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-        if (user != nullptr && friendUser != nullptr)
+// Checks one 'username password' row of a user list. Names in lists are stored lowercase, so a capitalised first
+// word is taken for a person's name written as 'First last' rather than an account. Returns the reason, or
+// nullptr for a good row.
+static const char *userRowProblem(const char *const *tokens, const size_t *lengths, size_t count)
+{
+    if (count != 2)
+    {
+        return "expected 'username password'";
+    }
+    if (!isValidUsername(tokens[0], lengths[0]))
+    {
+        return "invalid user name";
+    }
+    for (size_t i = 0; i < lengths[0]; i++)
+    {
+        if (isupper(static_cast<unsigned char>(tokens[0][i])))
         {
-            UserProfile *profile = user->getProfile();
-            UserProfile *friendProfile = friendUser->getProfile();
+            return "user name is not lowercase; expected 'username password'";
+        }
+    }
+    return nullptr;
+}
 
-            if (friendProfile->hasFriendRequestFrom(username))
-            {
-                profile->addFriend(friendUsername);
-                friendProfile->addFriend(username);
+class IdSet
+{
+private:
+    static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+    static const size_t PROMOTE_SIZE = 128;
+    static const size_t DEMOTE_SIZE = 32;
 
-                profile->removePendingRequest(friendUsername);
-                friendProfile->removeFriendRequest(username);
+    vector<uint32_t> items;
+    size_t count;
+    bool hashed;
 
-                cout << "\t\tFriend Request Accepted Successfully." << endl;
-            }
-            else
+    static size_t slotOf(uint32_t id, size_t mask)
+    {
+        return (id * 2654435761U) & mask;
+    }
+
+    void buildTable(const vector<uint32_t> &ids, size_t capacity)
+    {
+        items.assign(capacity, EMPTY_SLOT);
+        size_t mask = capacity - 1;
+        for (uint32_t id : ids)
+        {
+            size_t i = slotOf(id, mask);
+            while (items[i] != EMPTY_SLOT)
             {
-                cout << "\t\tNo pending request from that particular user." << endl;
+                i = (i + 1) & mask;
             }
+            items[i] = id;
         }
-        else
-        {
-            cout << "\t\tInvalid Usernames. Please Try Again." << endl;
-        }
+        hashed = true;
     }
 
-    void manageFriendRequests()
+public:
+    IdSet()
     {
-        int option;
-        char choice;
+        count = 0;
+        hashed = false;
+    }
 
-        do
-        {
-            system("cls");
-            cout << "\n\n\t\t--- Friend Requests Menu ---" << endl;
-            cout << "\t\t1. Show Pending Requests" << endl;
-            cout << "\t\t2. Accept Friend Request" << endl;
-            cout << "\t\t3. Go Back" << endl;
-            cout << "\t\tEnter Your Choice: ";
-            cin >> option;
-
-            switch (option)
-            {
-            case 1:
-            {
-                currentUser->showPendingRequests();
-                break;
-            }
-            case 2:
-            {
-                string friendUsername;
-                cout << "\t\tEnter Friend's Username: ";
-                cin >> friendUsername;
-                acceptFriendRequest(currentUser->getUsername(), friendUsername);
-                break;
-            }
-            case 3:
-                return;
-            default:
-                cout << "\t\tInvalid Option. Please Try Again." << endl;
-                break;
-            }
-
-            cout << "\t\tDo You Want to Continue [Yes/No]? ";
-            cin >> choice;
-        } while (choice == 'y' || choice == 'Y');
+    size_t size() const
+    {
+        return count;
     }
 
-    void profileMenu(UserProfile *profile)
+    bool empty() const
     {
-        int option;
-        char choice;
+        return count == 0;
+    }
 
-        do
+    bool contains(uint32_t id) const
+    {
+        if (!hashed)
         {
-            system("cls");
-            string username = profile->getUsername();
-            cout << "\t\tThis is " << username << "'s profile." << endl;
-            cout << "\n\n\t\t--- Profile Menu ---" << endl;
-            cout << "\t\t1. Manage Friend Requests" << endl;
-            cout << "\t\t2. Send Friend Request" << endl;
-            cout << "\t\t3. View Friend List" << endl;
-            cout << "\t\t4. Add Post" << endl;
-            cout << "\t\t5. Delete Post" << endl;
-            cout << "\t\t6. Show Posts" << endl;
-            cout << "\t\t7. Like Post" << endl;
-            cout << "\t\t8. Show Posts of your friends" << endl;
-            cout << "\t\t9. Like Posts of your friends" << endl;
-            cout << "\t\t10. Logout" << endl;
-            cout << "\t\tEnter Your Choice: ";
-            cin >> option;
+            return binary_search(items.begin(), items.end(), id);
+        }
 
-            switch (option)
+        size_t mask = items.size() - 1;
+        for (size_t i = slotOf(id, mask); items[i] != EMPTY_SLOT; i = (i + 1) & mask)
+        {
+            if (items[i] == id)
             {
-            case 1:
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool insert(uint32_t id)
+    {
+        if (!hashed)
+        {
+            auto it = lower_bound(items.begin(), items.end(), id);
+            if (it != items.end() && *it == id)
             {
-                manageFriendRequests();
-                break;
+                return false;
             }
-            case 2:
+            items.insert(it, id);
+            count++;
+            if (count > PROMOTE_SIZE)
             {
-                string friendUsername;
-                cout << "\t\tEnter Friend's Username: ";
-                cin >> friendUsername;
-                sendFriendRequest(currentUser->getUsername(), friendUsername);
-                break;
+                vector<uint32_t> ids;
+                ids.swap(items);
+                buildTable(ids, PROMOTE_SIZE * 4);
             }
-            case 3:
+            return true;
+        }
+
+        if (contains(id))
+        {
+            return false;
+        }
+        if ((count + 1) * 2 > items.size())
+        {
+            buildTable(toSortedVector(), items.size() * 2);
+        }
+
+        size_t mask = items.size() - 1;
+        size_t i = slotOf(id, mask);
+        while (items[i] != EMPTY_SLOT)
+        {
+            i = (i + 1) & mask;
+        }
+        items[i] = id;
+        count++;
+        return true;
+    }
+
+    bool erase(uint32_t id)
+    {
+        if (!hashed)
+        {
+            auto it = lower_bound(items.begin(), items.end(), id);
+            if (it == items.end() || *it != id)
             {
-                currentUser->showFriendList();
-                break;
+                return false;
             }
-            case 4:
+            items.erase(it);
+            count--;
+            return true;
+        }
+
+        size_t mask = items.size() - 1;
+        size_t i = slotOf(id, mask);
+        while (items[i] != id)
+        {
+            if (items[i] == EMPTY_SLOT)
             {
-                string post;
-                cout << "\t\tEnter your post: ";
-                cin.ignore();
-                getline(cin, post);
-                profile->addPost(post);
-                cout << "\t\tPost added successfully!" << endl;
-                break;
+                return false;
             }
-            case 5:
+            i = (i + 1) & mask;
+        }
+
+        // Backward-shift deletion keeps probe chains intact without tombstones.
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; items[j] != EMPTY_SLOT; j = (j + 1) & mask)
+        {
+            size_t home = slotOf(items[j], mask);
+            if (((j - home) & mask) >= ((j - hole) & mask))
             {
-                profile->showPosts();
-                if (profile->getPosts().empty())
-                {
-                    cout << "\t\tNo posts available to delete." << endl;
-                    break;
-                }
-                int postIndex;
-                cout << "\t\tEnter the index of the post you want to delete: ";
-                cin >> postIndex;
-                profile->deletePost(postIndex);
-                cout << "\t\tPost deleted successfully!" << endl;
-                break;
+                items[hole] = items[j];
+                hole = j;
             }
-            case 6:
+        }
+        items[hole] = EMPTY_SLOT;
+        count--;
+
+        if (count < DEMOTE_SIZE)
+        {
+            items = toSortedVector();
+            hashed = false;
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        vector<uint32_t>().swap(items);
+        count = 0;
+        hashed = false;
+    }
+
+    void assignSorted(const uint32_t *ids, size_t length)
+    {
+        vector<uint32_t> sorted(ids, ids + length);
+        count = length;
+        if (length > PROMOTE_SIZE)
+        {
+            size_t capacity = PROMOTE_SIZE * 4;
+            while (capacity < length * 2)
             {
-                profile->showPosts();
-                break;
+                capacity *= 2;
             }
-            case 7:
+            buildTable(sorted, capacity);
+        }
+        else
+        {
+            items.swap(sorted);
+            hashed = false;
+        }
+    }
+
+    template <typename Visitor>
+    void forEach(Visitor visit) const
+    {
+        for (uint32_t id : items)
+        {
+            if (id != EMPTY_SLOT)
             {
-                profile->showPosts();
-                if (profile->getPosts().empty())
-                {
-                    cout << "\t\tNo posts available to like." << endl;
-                    break;
-                }
-                int postIndex;
-                cout << "\t\tEnter the index of the post you want to like: ";
-                cin >> postIndex;
-                profile->likePost(postIndex);
-                cout << "\t\tPost liked successfully!" << endl;
-                break;
+                visit(id);
             }
-            case 8:
+        }
+    }
+
+    // Stops at the first ID the predicate accepts.
+    template <typename Predicate>
+    bool any(Predicate accept) const
+    {
+        for (uint32_t id : items)
+        {
+            if (id != EMPTY_SLOT && accept(id))
             {
-                showPostsOfFriends(profile->getFriendList());
-                break;
+                return true;
             }
-            case 9:
+        }
+        return false;
+    }
+
+    vector<uint32_t> toSortedVector() const
+    {
+        if (!hashed)
+        {
+            return items;
+        }
+
+        vector<uint32_t> ids;
+        ids.reserve(count);
+        forEach([&ids](uint32_t id)
+                { ids.push_back(id); });
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+};
+
+const uint32_t IdSet::EMPTY_SLOT;
+const size_t IdSet::PROMOTE_SIZE;
+const size_t IdSet::DEMOTE_SIZE;
+
+// The friend requests one user has sent or received, in arrival order. Every request carries a stamp from a global
+// counter, so the arrival list is sorted by stamp and a page can resume from the last stamp it returned. Removing a
+// request leaves a hole that is compacted away once half the list is holes. Small boxes find a request by scanning;
+// larger ones keep an open-addressed index from user to stamp, so membership checks stay O(1) for popular accounts.
+class RequestBox
+{
+public:
+    struct Request
+    {
+        uint64_t stamp;
+        uint32_t id;
+    };
+
+private:
+    static const uint32_t HOLE = 0xFFFFFFFF;
+    static const size_t INDEX_SIZE = 64;
+
+    vector<Request> arrivals;
+    vector<Request> index;
+    size_t live;
+
+    static bool stampBefore(const Request &request, uint64_t stamp)
+    {
+        return request.stamp < stamp;
+    }
+
+    static size_t slotOf(uint32_t id, size_t mask)
+    {
+        return (id * 2654435761U) & mask;
+    }
+
+    long find(uint32_t id) const
+    {
+        if (index.empty())
+        {
+            for (size_t i = 0; i < arrivals.size(); i++)
             {
-                if (profile->getFriendList().empty())
+                if (arrivals[i].id == id)
                 {
-                    cout << "\t\tYou have no friends to like their posts." << endl;
-                    break;
+                    return static_cast<long>(i);
                 }
-                int friendIndex;
-                cout << "\t\tEnter the index of the friend whose posts you want to like: ";
-                cin >> friendIndex;
-                likePostsOfFriend(profile->getFriendList(), friendIndex);
-                break;
             }
-            case 10:
+            return -1;
+        }
+
+        size_t mask = index.size() - 1;
+        for (size_t i = slotOf(id, mask); index[i].id != HOLE; i = (i + 1) & mask)
+        {
+            if (index[i].id == id)
             {
-                cout << "\t\tLogging out..." << endl;
-                currentUser = nullptr;
-                return;
-            }
-            default:
-                cout << "\t\tInvalid Option. Please Try Again." << endl;
-                break;
+                return lower_bound(arrivals.begin(), arrivals.end(), index[i].stamp, stampBefore) - arrivals.begin();
             }
+        }
+        return -1;
+    }
 
-            cout << "\t\tDo You Want to Continue [Yes/No]? ";
-            cin >> choice;
-        } while (choice == 'y' || choice == 'Y');
+    void indexInsert(const Request &request)
+    {
+        size_t mask = index.size() - 1;
+        size_t i = slotOf(request.id, mask);
+        while (index[i].id != HOLE)
+        {
+            i = (i + 1) & mask;
+        }
+        index[i] = request;
     }
 
-    void showPostsOfFriends(const vector<string> &friendList) const
+    // Backward-shift deletion, as in IdSet, keeps probe chains intact without tombstones.
+    void indexErase(uint32_t id)
     {
-        if (friendList.empty())
+        size_t mask = index.size() - 1;
+        size_t i = slotOf(id, mask);
+        while (index[i].id != id)
         {
-            cout << "\t\tYou have no friends to see their posts." << endl;
+            i = (i + 1) & mask;
         }
-        else
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; index[j].id != HOLE; j = (j + 1) & mask)
         {
-            cout << "\t\t--- Posts of your friends ---" << endl;
-            for (const string &friendUsername : friendList)
+            size_t home = slotOf(index[j].id, mask);
+            if (((j - home) & mask) >= ((j - hole) & mask))
             {
-                User *friendUser = findUserByUsername(friendUsername);
-                if (friendUser != nullptr)
-                {
-                    UserProfile *friendProfile = friendUser->getProfile();
-                    if (friendProfile != nullptr && friendProfile->canSeePosts(currentUser->getUsername()))
-                    {
-                        cout << "\n\t\t--- " << friendUsername << "'s Posts ---" << endl;
-                        friendProfile->showPosts();
-                    }
-                }
+                index[hole] = index[j];
+                hole = j;
             }
         }
+        index[hole].id = HOLE;
     }
 
-    void likePostsOfFriend(const vector<string> &friendList, int friendIndex)
+    void buildIndex()
     {
-        if (friendIndex >= 0 && friendIndex < friendList.size())
+        size_t capacity = INDEX_SIZE * 2;
+        while (capacity < live * 2)
+        {
+            capacity *= 2;
+        }
+        index.assign(capacity, Request{0, HOLE});
+        for (const Request &request : arrivals)
         {
-            const string &friendUsername = friendList[friendIndex];
-            User *friendUser = findUserByUsername(friendUsername);
-            if (friendUser != nullptr)
+            if (request.id != HOLE)
             {
-                UserProfile *friendProfile = friendUser->getProfile();
-                if (friendProfile != nullptr && friendProfile->canLikePosts(currentUser->getUsername()))
-                {
-                    friendProfile->showPosts();
-                    if (friendProfile->getPosts().empty())
-                    {
-                        cout << "\t\tNo posts available to like." << endl;
-                    }
-                    else
-                    {
-                        int postIndex;
-                        cout << "\t\tEnter the index of the post you want to like: ";
-                        cin >> postIndex;
-                        friendProfile->likePost(postIndex);
-                        cout << "\t\tPost liked successfully!" << endl;
-                    }
-                }
-                else
-                {
-                    cout << "\t\tYou are not allowed to like posts of that friend." << endl;
-                }
+                indexInsert(request);
             }
         }
-        else
+    }
+
+    void compact()
+    {
+        arrivals.erase(remove_if(arrivals.begin(), arrivals.end(), [](const Request &request)
+                                 { return request.id == HOLE; }),
+                       arrivals.end());
+        if (!index.empty() && live <= INDEX_SIZE / 2)
         {
-            cout << "\t\tInvalid friend index." << endl;
+            vector<Request>().swap(index);
+        }
+        if (arrivals.capacity() > 4 * arrivals.size() + INDEX_SIZE)
+        {
+            vector<Request>(arrivals).swap(arrivals);
         }
     }
 
-    void start()
+public:
+    RequestBox()
     {
-        int option;
-        char choice;
+        live = 0;
+    }
 
-        do
+    size_t size() const
+    {
+        return live;
+    }
+
+    bool empty() const
+    {
+        return live == 0;
+    }
+
+    bool contains(uint32_t id) const
+    {
+        return find(id) >= 0;
+    }
+
+    bool add(uint32_t id, uint64_t stamp)
+    {
+        if (contains(id))
         {
-            system("cls");
-            cout << "\n\n\t\t--- Welcome to social network connecter app ---" << endl;
-            cout << "\t\t1. Register new User" << endl;
-            cout << "\t\t2. Login existing User" << endl;
-            cout << "\t\t3. Search User" << endl;
-            cout << "\t\t4. Show All Users" << endl;
-            cout << "\t\t5. Delete User" << endl;
-            cout << "\t\t6. Exit" << endl;
-            cout << "\t\tEnter Your Choice: ";
-            cin >> option;
+            return false;
+        }
+        if (arrivals.empty() || arrivals.back().stamp < stamp)
+        {
+            arrivals.push_back(Request{stamp, id});
+        }
+        else
+        {
+            arrivals.insert(lower_bound(arrivals.begin(), arrivals.end(), stamp, stampBefore), Request{stamp, id});
+        }
+        live++;
+        if (!index.empty() && live * 2 <= index.size())
+        {
+            indexInsert(Request{stamp, id});
+        }
+        else if (!index.empty() || arrivals.size() > INDEX_SIZE)
+        {
+            buildIndex();
+        }
+        return true;
+    }
 
-            switch (option)
-            {
-            case 1:
-                registerUser();
+    bool remove(uint32_t id)
+    {
+        long position = find(id);
+        if (position < 0)
+        {
+            return false;
+        }
+        arrivals[position].id = HOLE;
+        live--;
+        if (!index.empty())
+        {
+            indexErase(id);
+        }
+        if ((arrivals.size() - live) * 2 >= arrivals.size())
+        {
+            compact();
+        }
+        return true;
+    }
+
+    // Replaces the contents.
+    void load(const uint32_t *ids, const uint64_t *stamps, size_t length)
+    {
+        arrivals.clear();
+        arrivals.reserve(length);
+        for (size_t i = 0; i < length; i++)
+        {
+            arrivals.push_back(Request{stamps[i], ids[i]});
+        }
+        sort(arrivals.begin(), arrivals.end(), [](const Request &a, const Request &b)
+             { return a.stamp < b.stamp; });
+        live = length;
+        vector<Request>().swap(index);
+        if (arrivals.size() > INDEX_SIZE)
+        {
+            buildIndex();
+        }
+    }
+
+    // Visits the requests oldest first.
+    template <typename Visitor>
+    void forEach(Visitor visit) const
+    {
+        for (const Request &request : arrivals)
+        {
+            if (request.id != HOLE)
+            {
+                visit(request.id);
+            }
+        }
+    }
+
+    vector<uint32_t> toVector() const
+    {
+        vector<uint32_t> ids;
+        ids.reserve(live);
+        forEach([&ids](uint32_t id)
+                { ids.push_back(id); });
+        return ids;
+    }
+
+    // Appends in id order, as snapshots store their request lists; load puts them back in arrival order.
+    void appendTo(vector<uint32_t> &ids, vector<uint64_t> &stamps) const
+    {
+        vector<Request> byId;
+        byId.reserve(live);
+        for (const Request &request : arrivals)
+        {
+            if (request.id != HOLE)
+            {
+                byId.push_back(request);
+            }
+        }
+        sort(byId.begin(), byId.end(), [](const Request &a, const Request &b)
+             { return a.id < b.id; });
+        for (const Request &request : byId)
+        {
+            ids.push_back(request.id);
+            stamps.push_back(request.stamp);
+        }
+    }
+
+    // Newest first, starting below cursor (0 starts at the newest). nextCursor is 0 once nothing older is left.
+    vector<uint32_t> page(size_t limit, uint64_t cursor, uint64_t &nextCursor) const
+    {
+        vector<uint32_t> ids;
+        nextCursor = 0;
+        size_t end = cursor == 0 ? arrivals.size() : lower_bound(arrivals.begin(), arrivals.end(), cursor, stampBefore) - arrivals.begin();
+        while (end > 0 && ids.size() < limit)
+        {
+            const Request &request = arrivals[--end];
+            if (request.id != HOLE)
+            {
+                ids.push_back(request.id);
+                nextCursor = request.stamp;
+            }
+        }
+        while (end > 0 && arrivals[end - 1].id == HOLE)
+        {
+            end--;
+        }
+        if (end == 0)
+        {
+            nextCursor = 0;
+        }
+        return ids;
+    }
+};
+
+const uint32_t RequestBox::HOLE;
+const size_t RequestBox::INDEX_SIZE;
+
+class FriendGraph
+{
+private:
+    vector<IdSet> adjacency;
+    atomic<size_t> edgeCount;
+
+public:
+    FriendGraph()
+    {
+        edgeCount = 0;
+    }
+
+    void addNode(uint32_t id)
+    {
+        if (id >= adjacency.size())
+        {
+            adjacency.resize(id + 1);
+        }
+    }
+
+    void removeNode(uint32_t id)
+    {
+        if (id < adjacency.size())
+        {
+            edgeCount -= adjacency[id].size();
+            adjacency[id].clear();
+        }
+    }
+
+    bool addFriend(uint32_t a, uint32_t b)
+    {
+        if (a == b || !adjacency[a].insert(b))
+        {
+            return false;
+        }
+        adjacency[b].insert(a);
+        edgeCount++;
+        return true;
+    }
+
+    bool removeFriend(uint32_t a, uint32_t b)
+    {
+        if (!adjacency[a].erase(b))
+        {
+            return false;
+        }
+        adjacency[b].erase(a);
+        edgeCount--;
+        return true;
+    }
+
+    bool isFriend(uint32_t a, uint32_t b) const
+    {
+        return adjacency[a].contains(b);
+    }
+
+    const IdSet &friendsOf(uint32_t id) const
+    {
+        return adjacency[id];
+    }
+
+    vector<uint32_t> getFriendList(uint32_t id) const
+    {
+        return adjacency[id].toSortedVector();
+    }
+
+    bool canSeePosts(uint32_t owner, uint32_t viewer) const
+    {
+        return owner == viewer || isFriend(owner, viewer);
+    }
+
+    bool canLikePosts(uint32_t owner, uint32_t viewer) const
+    {
+        return isFriend(owner, viewer);
+    }
+
+    size_t getEdgeCount() const
+    {
+        return edgeCount;
+    }
+
+    size_t addFriendsInBulk(const vector<vector<pair<uint32_t, uint32_t>>> &batches, unsigned threadCount)
+    {
+        uint32_t nodeCount = static_cast<uint32_t>(adjacency.size());
+        vector<size_t> added(threadCount, 0);
+        vector<thread> workers;
+
+        for (unsigned t = 0; t < threadCount; t++)
+        {
+            workers.emplace_back([&, t]()
+                                 {
+                                     uint32_t first = static_cast<uint32_t>(uint64_t(nodeCount) * t / threadCount);
+                                     uint32_t last = static_cast<uint32_t>(uint64_t(nodeCount) * (t + 1) / threadCount);
+                                     vector<pair<uint32_t, uint32_t>> owned;
+                                     for (const vector<pair<uint32_t, uint32_t>> &batch : batches)
+                                     {
+                                         for (const pair<uint32_t, uint32_t> &edge : batch)
+                                         {
+                                             if (edge.first >= first && edge.first < last)
+                                             {
+                                                 owned.push_back(edge);
+                                             }
+                                             if (edge.second >= first && edge.second < last)
+                                             {
+                                                 owned.push_back(make_pair(edge.second, edge.first));
+                                             }
+                                         }
+                                     }
+                                     sort(owned.begin(), owned.end());
+                                     owned.erase(unique(owned.begin(), owned.end()), owned.end());
+
+                                     vector<uint32_t> merged;
+                                     for (size_t i = 0; i < owned.size();)
+                                     {
+                                         uint32_t node = owned[i].first;
+                                         vector<uint32_t> existing = adjacency[node].toSortedVector();
+                                         merged.clear();
+                                         size_t j = 0;
+                                         for (; i < owned.size() && owned[i].first == node; i++)
+                                         {
+                                             uint32_t target = owned[i].second;
+                                             while (j < existing.size() && existing[j] < target)
+                                             {
+                                                 merged.push_back(existing[j++]);
+                                             }
+                                             if (j < existing.size() && existing[j] == target)
+                                             {
+                                                 continue;
+                                             }
+                                             merged.push_back(target);
+                                             added[t]++;
+                                         }
+                                         merged.insert(merged.end(), existing.begin() + j, existing.end());
+                                         adjacency[node].assignSorted(merged.data(), merged.size());
+                                     }
+                                 });
+        }
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        size_t halfEdges = 0;
+        for (size_t count : added)
+        {
+            halfEdges += count;
+        }
+        edgeCount += halfEdges / 2;
+        return halfEdges / 2;
+    }
+
+    void exportCsr(vector<uint64_t> &offsets, vector<uint32_t> &targets, uint32_t nodeCount) const
+    {
+        offsets.assign(1, 0);
+        targets.clear();
+        targets.reserve(edgeCount * 2);
+        for (uint32_t id = 0; id < nodeCount; id++)
+        {
+            if (id < adjacency.size())
+            {
+                vector<uint32_t> sorted = adjacency[id].toSortedVector();
+                targets.insert(targets.end(), sorted.begin(), sorted.end());
+            }
+            offsets.push_back(targets.size());
+        }
+    }
+
+    void importCsr(const uint64_t *offsets, const uint32_t *targets, uint32_t nodeCount)
+    {
+        adjacency.clear();
+        adjacency.resize(nodeCount);
+        for (uint32_t id = 0; id < nodeCount; id++)
+        {
+            adjacency[id].assignSorted(targets + offsets[id], offsets[id + 1] - offsets[id]);
+        }
+        edgeCount = static_cast<size_t>(offsets[nodeCount] / 2);
+    }
+};
+
+// Likes are counted under a shared lock on the owner, so each counter is atomic. Copies only happen while the
+// owner is locked exclusively, when the post list itself changes.
+class LikeCounter
+{
+private:
+    atomic<int> value;
+
+public:
+    LikeCounter(int likes = 0) : value(likes)
+    {
+    }
+
+    LikeCounter(const LikeCounter &other) : value(other.get())
+    {
+    }
+
+    LikeCounter &operator=(const LikeCounter &other)
+    {
+        value.store(other.get(), memory_order_relaxed);
+        return *this;
+    }
+
+    int get() const
+    {
+        return value.load(memory_order_relaxed);
+    }
+
+    void set(int likes)
+    {
+        value.store(likes, memory_order_relaxed);
+    }
+
+    void increment()
+    {
+        value.fetch_add(1, memory_order_relaxed);
+    }
+
+    void decrement()
+    {
+        value.fetch_sub(1, memory_order_relaxed);
+    }
+};
+
+// The index of the lowest and of the highest set bit; bits must not be zero.
+static inline unsigned lowestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(bits));
+#endif
+}
+
+static inline unsigned highestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, bits);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(63 - __builtin_clzll(bits));
+#endif
+}
+
+// A set of user IDs split by their high 16 bits, Roaring style. Each container holds the low halves as a sorted
+// array while it is small and switches to a 65536-bit bitmap once the array would outgrow it, so a container never
+// takes more than 8 KiB and a few likes take a few bytes.
+class RoaringBitmap
+{
+private:
+    static const uint32_t ARRAY_LIMIT = 4096;
+    static const uint32_t BITMAP_WORDS = 1024;
+
+    struct Container
+    {
+        uint32_t key;
+        uint32_t count;
+        vector<uint16_t> values;
+        vector<uint64_t> bits;
+    };
+
+    vector<Container> containers;
+    uint64_t total;
+
+    vector<Container>::iterator findContainer(uint32_t key)
+    {
+        return lower_bound(containers.begin(), containers.end(), key, [](const Container &container, uint32_t value)
+                           { return container.key < value; });
+    }
+
+    vector<Container>::const_iterator findContainer(uint32_t key) const
+    {
+        return lower_bound(containers.begin(), containers.end(), key, [](const Container &container, uint32_t value)
+                           { return container.key < value; });
+    }
+
+    static void toBitmap(Container &container)
+    {
+        container.bits.assign(BITMAP_WORDS, 0);
+        for (uint16_t value : container.values)
+        {
+            container.bits[value >> 6] |= 1ULL << (value & 63);
+        }
+        vector<uint16_t>().swap(container.values);
+    }
+
+    static void toArray(Container &container)
+    {
+        container.values.reserve(container.count);
+        for (uint32_t word = 0; word < BITMAP_WORDS; word++)
+        {
+            for (uint64_t bits = container.bits[word]; bits != 0; bits &= bits - 1)
+            {
+                container.values.push_back(static_cast<uint16_t>(word * 64 + lowestBit(bits)));
+            }
+        }
+        vector<uint64_t>().swap(container.bits);
+    }
+
+public:
+    RoaringBitmap()
+    {
+        total = 0;
+    }
+
+    uint64_t cardinality() const
+    {
+        return total;
+    }
+
+    bool empty() const
+    {
+        return total == 0;
+    }
+
+    bool contains(uint32_t id) const
+    {
+        vector<Container>::const_iterator it = findContainer(id >> 16);
+        if (it == containers.end() || it->key != id >> 16)
+        {
+            return false;
+        }
+        uint16_t low = static_cast<uint16_t>(id);
+        if (!it->bits.empty())
+        {
+            return (it->bits[low >> 6] >> (low & 63)) & 1;
+        }
+        return binary_search(it->values.begin(), it->values.end(), low);
+    }
+
+    // Returns false when the ID was already present.
+    bool insert(uint32_t id)
+    {
+        vector<Container>::iterator it = findContainer(id >> 16);
+        if (it == containers.end() || it->key != id >> 16)
+        {
+            it = containers.insert(it, Container{id >> 16, 0, vector<uint16_t>(), vector<uint64_t>()});
+        }
+        uint16_t low = static_cast<uint16_t>(id);
+        if (!it->bits.empty())
+        {
+            uint64_t &word = it->bits[low >> 6];
+            uint64_t bit = 1ULL << (low & 63);
+            if (word & bit)
+            {
+                return false;
+            }
+            word |= bit;
+        }
+        else
+        {
+            vector<uint16_t>::iterator position = lower_bound(it->values.begin(), it->values.end(), low);
+            if (position != it->values.end() && *position == low)
+            {
+                return false;
+            }
+            it->values.insert(position, low);
+            if (it->values.size() > ARRAY_LIMIT)
+            {
+                toBitmap(*it);
+            }
+        }
+        it->count++;
+        total++;
+        return true;
+    }
+
+    // Returns false when the ID was not present. Bitmaps fall back to arrays at half the limit, so a count that
+    // hovers around the limit does not convert back and forth.
+    bool erase(uint32_t id)
+    {
+        vector<Container>::iterator it = findContainer(id >> 16);
+        if (it == containers.end() || it->key != id >> 16)
+        {
+            return false;
+        }
+        uint16_t low = static_cast<uint16_t>(id);
+        if (!it->bits.empty())
+        {
+            uint64_t &word = it->bits[low >> 6];
+            uint64_t bit = 1ULL << (low & 63);
+            if (!(word & bit))
+            {
+                return false;
+            }
+            word &= ~bit;
+            total--;
+            if (--it->count <= ARRAY_LIMIT / 2)
+            {
+                toArray(*it);
+            }
+            return true;
+        }
+        else
+        {
+            vector<uint16_t>::iterator position = lower_bound(it->values.begin(), it->values.end(), low);
+            if (position == it->values.end() || *position != low)
+            {
+                return false;
+            }
+            it->values.erase(position);
+        }
+        total--;
+        if (--it->count == 0)
+        {
+            containers.erase(it);
+        }
+        return true;
+    }
+
+    void assignSorted(const uint32_t *ids, size_t length)
+    {
+        containers.clear();
+        total = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            if (containers.empty() || containers.back().key != ids[i] >> 16)
+            {
+                containers.push_back(Container{ids[i] >> 16, 0, vector<uint16_t>(), vector<uint64_t>()});
+            }
+            Container &container = containers.back();
+            uint16_t low = static_cast<uint16_t>(ids[i]);
+            if (!container.bits.empty())
+            {
+                container.bits[low >> 6] |= 1ULL << (low & 63);
+            }
+            else
+            {
+                container.values.push_back(low);
+                if (container.values.size() > ARRAY_LIMIT)
+                {
+                    toBitmap(container);
+                }
+            }
+            container.count++;
+            total++;
+        }
+    }
+
+    void appendTo(vector<uint32_t> &ids) const
+    {
+        for (const Container &container : containers)
+        {
+            uint32_t high = container.key << 16;
+            if (container.bits.empty())
+            {
+                for (uint16_t value : container.values)
+                {
+                    ids.push_back(high | value);
+                }
+                continue;
+            }
+            for (uint32_t word = 0; word < BITMAP_WORDS; word++)
+            {
+                for (uint64_t bits = container.bits[word]; bits != 0; bits &= bits - 1)
+                {
+                    ids.push_back(high | (word * 64 + lowestBit(bits)));
+                }
+            }
+        }
+    }
+};
+
+const uint32_t RoaringBitmap::ARRAY_LIMIT;
+const uint32_t RoaringBitmap::BITMAP_WORDS;
+
+// Who liked which post, for the posts of one lock stripe; posts nobody liked take no space. Likes run with the
+// stripe shared, so the index has a mutex of its own.
+class LikeIndex
+{
+private:
+    unordered_map<uint64_t, RoaringBitmap> likers;
+    mutable mutex lock;
+
+public:
+    // Calls onChange under the index lock when the like or unlike changed anything, so that the changes to one
+    // post are logged in the order they were made.
+    template <typename Callback>
+    bool change(uint64_t post, uint32_t user, bool liked, Callback onChange)
+    {
+        lock_guard<mutex> guard(lock);
+        if (liked)
+        {
+            if (!likers[post].insert(user))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            unordered_map<uint64_t, RoaringBitmap>::iterator it = likers.find(post);
+            if (it == likers.end() || !it->second.erase(user))
+            {
+                return false;
+            }
+            if (it->second.empty())
+            {
+                likers.erase(it);
+            }
+        }
+        onChange();
+        return true;
+    }
+
+    bool contains(uint64_t post, uint32_t user) const
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, RoaringBitmap>::const_iterator it = likers.find(post);
+        return it != likers.end() && it->second.contains(user);
+    }
+
+    void appendLikers(uint64_t post, vector<uint32_t> &ids) const
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, RoaringBitmap>::const_iterator it = likers.find(post);
+        if (it != likers.end())
+        {
+            it->second.appendTo(ids);
+        }
+    }
+
+    void erasePost(uint64_t post)
+    {
+        lock_guard<mutex> guard(lock);
+        likers.erase(post);
+    }
+
+    void load(uint64_t post, const uint32_t *ids, size_t count)
+    {
+        if (count > 0)
+        {
+            lock_guard<mutex> guard(lock);
+            likers[post].assignSorted(ids, count);
+        }
+    }
+};
+
+// Post bodies are copied into large chunks instead of one heap string each. Chunks never move, so a stored text
+// stays put until the arena is rebuilt; deleted texts are only counted, and the owner compacts the arena once
+// they outweigh the live ones.
+class TextArena
+{
+private:
+    static const size_t CHUNK_SIZE = 64 << 10;
+
+    vector<unique_ptr<char[]>> chunks;
+    size_t chunkUsed;
+    size_t chunkCapacity;
+    size_t liveBytes;
+    size_t garbageBytes;
+
+public:
+    TextArena()
+    {
+        chunkUsed = 0;
+        chunkCapacity = 0;
+        liveBytes = 0;
+        garbageBytes = 0;
+    }
+
+    const char *store(const char *data, size_t length)
+    {
+        if (chunks.empty() || length > chunkCapacity - chunkUsed)
+        {
+            chunkCapacity = max(CHUNK_SIZE, length);
+            chunks.emplace_back(new char[chunkCapacity]);
+            chunkUsed = 0;
+        }
+        char *copy = chunks.back().get() + chunkUsed;
+        memcpy(copy, data, length);
+        chunkUsed += length;
+        liveBytes += length;
+        return copy;
+    }
+
+    void release(size_t length)
+    {
+        liveBytes -= length;
+        garbageBytes += length;
+    }
+
+    bool wantsCompaction() const
+    {
+        return garbageBytes > CHUNK_SIZE && garbageBytes > liveBytes;
+    }
+
+    void swap(TextArena &other)
+    {
+        chunks.swap(other.chunks);
+        std::swap(chunkUsed, other.chunkUsed);
+        std::swap(chunkCapacity, other.chunkCapacity);
+        std::swap(liveBytes, other.liveBytes);
+        std::swap(garbageBytes, other.garbageBytes);
+    }
+};
+
+const size_t TextArena::CHUNK_SIZE;
+
+// A deleted post keeps its slot with a null text until the owner's stripe is compacted.
+struct PostText
+{
+    const char *data;
+    uint32_t length;
+
+    string str() const
+    {
+        return string(data, length);
+    }
+};
+
+class UserProfile
+{
+private:
+    uint32_t id;
+    const string *username;
+    RequestBox friendRequests;
+    RequestBox pendingRequests;
+    // Hot per-post fields, one array each, so scans over sequences or likes never touch the text.
+    vector<uint64_t> postSequences;
+    vector<LikeCounter> postLikes;
+    vector<PostText> postTexts;
+    uint32_t deletedPosts;
+    // Changed since it was loaded or last saved to a snapshot.
+    bool dirty;
+
+public:
+    UserProfile(uint32_t userId, const string &name)
+    {
+        id = userId;
+        username = &name;
+        deletedPosts = 0;
+        dirty = false;
+    }
+
+    uint32_t getId() const
+    {
+        return id;
+    }
+
+    const string &getUsername() const
+    {
+        return *username;
+    }
+
+    bool isDirty() const
+    {
+        return dirty;
+    }
+
+    void markSaved()
+    {
+        dirty = false;
+    }
+
+    bool addFriendRequest(uint32_t userId, uint64_t stamp)
+    {
+        dirty = true;
+        return friendRequests.add(userId, stamp);
+    }
+
+    bool addPendingRequest(uint32_t userId, uint64_t stamp)
+    {
+        dirty = true;
+        return pendingRequests.add(userId, stamp);
+    }
+
+    const RequestBox &getFriendRequests() const
+    {
+        return friendRequests;
+    }
+
+    const RequestBox &getPendingRequests() const
+    {
+        return pendingRequests;
+    }
+
+    void loadRequests(const uint32_t *outgoing, const uint64_t *outgoingStamps, size_t outgoingCount,
+                      const uint32_t *incoming, const uint64_t *incomingStamps, size_t incomingCount)
+    {
+        friendRequests.load(outgoing, outgoingStamps, outgoingCount);
+        pendingRequests.load(incoming, incomingStamps, incomingCount);
+    }
+
+    void removeFriendRequest(uint32_t userId)
+    {
+        dirty = true;
+        friendRequests.remove(userId);
+    }
+
+    void removePendingRequest(uint32_t userId)
+    {
+        dirty = true;
+        pendingRequests.remove(userId);
+    }
+
+    bool hasFriendRequestFrom(uint32_t userId) const
+    {
+        return friendRequests.contains(userId);
+    }
+
+    bool hasPendingRequestFrom(uint32_t userId) const
+    {
+        return pendingRequests.contains(userId);
+    }
+
+    void addPost(TextArena &arena, const string &post, uint64_t sequence)
+    {
+        dirty = true;
+        loadPost(arena, post.data(), post.size(), 0, sequence);
+    }
+
+    // Deleting only leaves a tombstone, so the slots of later posts stay where they are until compaction.
+    void deletePost(TextArena &arena, int index)
+    {
+        if (index >= 0 && index < (int)postTexts.size() && isLive(index))
+        {
+            arena.release(postTexts[index].length);
+            postTexts[index] = PostText{nullptr, 0};
+            postLikes[index].set(0);
+            deletedPosts++;
+            dirty = true;
+        }
+    }
+
+    bool wantsPurge() const
+    {
+        return deletedPosts > 0 && deletedPosts * 2 >= postTexts.size();
+    }
+
+    bool hasDeletedPosts() const
+    {
+        return deletedPosts > 0;
+    }
+
+    // Drops the tombstones; only stripe compaction calls this, as it moves every later post to a new slot.
+    void purgeDeletedPosts()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < postTexts.size(); i++)
+        {
+            if (isLive(i))
+            {
+                postSequences[kept] = postSequences[i];
+                postLikes[kept] = postLikes[i];
+                postTexts[kept] = postTexts[i];
+                kept++;
+            }
+        }
+        postSequences.resize(kept);
+        postLikes.resize(kept);
+        postTexts.resize(kept);
+        deletedPosts = 0;
+    }
+
+    void releasePosts(TextArena &arena)
+    {
+        for (const PostText &text : postTexts)
+        {
+            arena.release(text.length);
+        }
+    }
+
+    // Copies every text into a fresh arena while the old one is being compacted.
+    void moveTextsTo(TextArena &arena)
+    {
+        for (PostText &text : postTexts)
+        {
+            if (text.data != nullptr)
+            {
+                text.data = arena.store(text.data, text.length);
+            }
+        }
+    }
+
+    // Sequences grow with every post and serve as post IDs, so a profile's posts are already in time order.
+    const vector<uint64_t> &getPostSequences() const
+    {
+        return postSequences;
+    }
+
+    // Returns the slot of a live post, or -1 once the post is deleted.
+    int findPost(uint64_t sequence) const
+    {
+        vector<uint64_t>::const_iterator it = lower_bound(postSequences.begin(), postSequences.end(), sequence);
+        if (it == postSequences.end() || *it != sequence || !isLive(it - postSequences.begin()))
+        {
+            return -1;
+        }
+        return static_cast<int>(it - postSequences.begin());
+    }
+
+    bool isLive(size_t index) const
+    {
+        return postTexts[index].data != nullptr;
+    }
+
+    // Counts slots, tombstones included; use isLive to skip deleted posts.
+    size_t getPostCount() const
+    {
+        return postTexts.size();
+    }
+
+    size_t getLivePostCount() const
+    {
+        return postTexts.size() - deletedPosts;
+    }
+
+    const PostText &getPostText(size_t index) const
+    {
+        return postTexts[index];
+    }
+
+    string getPost(size_t index) const
+    {
+        return postTexts[index].str();
+    }
+
+    int getLikes(size_t index) const
+    {
+        return postLikes[index].get();
+    }
+
+    void loadPost(TextArena &arena, const char *text, size_t length, int likes, uint64_t sequence)
+    {
+        postTexts.push_back(PostText{arena.store(text, length), static_cast<uint32_t>(length)});
+        postLikes.push_back(likes);
+        postSequences.push_back(sequence);
+    }
+
+    void setPostLikes(int index, int likes)
+    {
+        if (index >= 0 && index < (int)postLikes.size() && isLive(index))
+        {
+            postLikes[index].set(likes);
+            dirty = true;
+        }
+    }
+
+    void showPosts() const
+    {
+        if (getLivePostCount() == 0)
+        {
+            cout << "\t\tNo posts available." << endl;
+        }
+        else
+        {
+            cout << "\t\tPosts:" << endl;
+            for (size_t i = 0; i < postTexts.size(); ++i)
+            {
+                if (!isLive(i))
+                {
+                    continue;
+                }
+                cout << "\t\t- [" << postSequences[i] << "] ";
+                cout.write(postTexts[i].data, postTexts[i].length);
+                cout << " (Likes: " << postLikes[i].get() << ")" << endl;
+            }
+        }
+    }
+
+    void likePost(int index)
+    {
+        if (index >= 0 && index < (int)postLikes.size() && isLive(index))
+        {
+            postLikes[index].increment();
+            dirty = true;
+        }
+    }
+
+    void unlikePost(int index)
+    {
+        if (index >= 0 && index < (int)postLikes.size() && isLive(index))
+        {
+            postLikes[index].decrement();
+            dirty = true;
+        }
+    }
+};
+
+struct Crc32Table
+{
+    uint32_t entries[256];
+
+    Crc32Table()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32(const char *data, size_t length)
+{
+    // Built once on first use; the journal writer and readers may get here at the same time.
+    static const Crc32Table table;
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFU;
+}
+
+static bool fileExists(const string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+static bool readWholeFile(const string &path, string &contents)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    contents.clear();
+    char buffer[1 << 16];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.append(buffer, bytes);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool syncFile(FILE *file)
+{
+    if (fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+static bool replaceFile(const string &from, const string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static bool writeFileDurably(const string &path, const string &contents)
+{
+    string tempPath = path + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    written = syncFile(file) && written;
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        remove(tempPath.c_str());
+        return false;
+    }
+    return replaceFile(tempPath, path);
+}
+
+enum class Metric : uint8_t
+{
+    Register,
+    Login,
+    DeleteUser,
+    FriendRequest,
+    AcceptRequest,
+    DeclineRequest,
+    RespondRequests,
+    AddPost,
+    DeletePost,
+    Like,
+    Feed,
+    SearchUsers,
+    SearchPosts,
+    Recommend,
+    Separation,
+    Clusters,
+    Trending,
+    JournalAppend,
+    JournalSync,
+    Snapshot,
+    Recover,
+    Count
+};
+
+static const char *metricName(Metric metric)
+{
+    static const char *const names[] = {"register", "login", "delete_user", "friend_request", "accept_request",
+                                        "decline_request", "respond_requests", "add_post", "delete_post", "like", "feed", "search_users", "search_posts", "recommend", "separation", "clusters",
+                                        "trending", "journal_append", "journal_sync", "snapshot", "recover"};
+    return names[static_cast<size_t>(metric)];
+}
+
+struct LatencySummary
+{
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+// Latencies in HDR-style buckets: every power of two of nanoseconds is split into eight linear sub-buckets, so a
+// reported percentile is at most 12.5% above the true value. Each thread records into one of a few shards, picked
+// once per thread, with relaxed increments; only a dump adds the shards up.
+class Metrics
+{
+private:
+    static const unsigned SUB_BUCKET_BITS = 3;
+    static const unsigned MAX_EXPONENT = 36;
+    static const unsigned BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) << SUB_BUCKET_BITS;
+    static const unsigned SHARDS = 16;
+    static const size_t METRIC_COUNT = static_cast<size_t>(Metric::Count);
+
+    struct Shard
+    {
+        atomic<uint64_t> buckets[METRIC_COUNT][BUCKETS];
+        atomic<uint64_t> totals[METRIC_COUNT];
+        atomic<uint64_t> maxima[METRIC_COUNT];
+    };
+
+    unique_ptr<Shard[]> shards;
+
+    static unsigned threadSlot()
+    {
+        static atomic<unsigned> nextSlot(0);
+        thread_local unsigned slot = nextSlot++ % SHARDS;
+        return slot;
+    }
+
+    // Values past 2^36 ns, about a minute, all land in the last bucket.
+    static unsigned bucketOf(uint64_t nanos)
+    {
+        if (nanos < (1U << SUB_BUCKET_BITS))
+        {
+            return static_cast<unsigned>(nanos);
+        }
+        unsigned exponent = highestBit(nanos);
+        if (exponent > MAX_EXPONENT)
+        {
+            return BUCKETS - 1;
+        }
+        unsigned shift = exponent - SUB_BUCKET_BITS;
+        unsigned sub = static_cast<unsigned>((nanos >> shift) & ((1U << SUB_BUCKET_BITS) - 1));
+        return ((shift + 1) << SUB_BUCKET_BITS) + sub;
+    }
+
+    static uint64_t highestIn(unsigned bucket)
+    {
+        if (bucket < (1U << SUB_BUCKET_BITS))
+        {
+            return bucket;
+        }
+        unsigned shift = (bucket >> SUB_BUCKET_BITS) - 1;
+        uint64_t lowest = static_cast<uint64_t>((1U << SUB_BUCKET_BITS) + (bucket & ((1U << SUB_BUCKET_BITS) - 1))) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+
+    static void appendMicros(string &out, uint64_t nanos)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.3f", nanos / 1000.0);
+        out.append(buffer);
+    }
+
+public:
+    Metrics() : shards(new Shard[SHARDS]())
+    {
+    }
+
+    void record(Metric metric, uint64_t nanos)
+    {
+        size_t index = static_cast<size_t>(metric);
+        Shard &shard = shards[threadSlot()];
+        shard.buckets[index][bucketOf(nanos)].fetch_add(1, memory_order_relaxed);
+        shard.totals[index].fetch_add(nanos, memory_order_relaxed);
+        uint64_t seen = shard.maxima[index].load(memory_order_relaxed);
+        while (nanos > seen && !shard.maxima[index].compare_exchange_weak(seen, nanos, memory_order_relaxed))
+        {
+        }
+    }
+
+    LatencySummary summary(Metric metric) const
+    {
+        size_t index = static_cast<size_t>(metric);
+        vector<uint64_t> counts(BUCKETS, 0);
+        LatencySummary result{0, 0, 0, 0, 0, 0, 0};
+        for (unsigned s = 0; s < SHARDS; s++)
+        {
+            const Shard &shard = shards[s];
+            for (unsigned b = 0; b < BUCKETS; b++)
+            {
+                uint64_t count = shard.buckets[index][b].load(memory_order_relaxed);
+                counts[b] += count;
+                result.count += count;
+            }
+            result.totalNanos += shard.totals[index].load(memory_order_relaxed);
+            result.maxNanos = max(result.maxNanos, shard.maxima[index].load(memory_order_relaxed));
+        }
+
+        uint64_t *targets[] = {&result.p50, &result.p90, &result.p99, &result.p999};
+        const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+        uint64_t seen = 0;
+        size_t next = 0;
+        for (unsigned b = 0; b < BUCKETS && next < 4; b++)
+        {
+            seen += counts[b];
+            while (next < 4 && result.count > 0 && seen >= fractions[next] * result.count)
+            {
+                *targets[next++] = min(highestIn(b), result.maxNanos);
+            }
+        }
+        return result;
+    }
+
+    // Gauges are sampled by the caller; operations that never ran are left out.
+    void writeText(ostream &out, const vector<pair<string, uint64_t>> &gauges) const
+    {
+        ios::fmtflags flags = out.flags();
+        streamsize precision = out.precision(3);
+        out << fixed;
+        for (const pair<string, uint64_t> &gauge : gauges)
+        {
+            out << gauge.first << " " << gauge.second << "\n";
+        }
+        for (size_t m = 0; m < METRIC_COUNT; m++)
+        {
+            LatencySummary latency = summary(static_cast<Metric>(m));
+            if (latency.count > 0)
+            {
+                out << metricName(static_cast<Metric>(m)) << " count=" << latency.count
+                    << " mean_us=" << latency.totalNanos / 1000.0 / latency.count << " p50_us=" << latency.p50 / 1000.0
+                    << " p90_us=" << latency.p90 / 1000.0 << " p99_us=" << latency.p99 / 1000.0
+                    << " p999_us=" << latency.p999 / 1000.0 << " max_us=" << latency.maxNanos / 1000.0 << "\n";
+            }
+        }
+        out.flags(flags);
+        out.precision(precision);
+        out.flush();
+    }
+
+    string toJson(const vector<pair<string, uint64_t>> &gauges) const
+    {
+        string out = "{\"gauges\":{";
+        for (size_t i = 0; i < gauges.size(); i++)
+        {
+            out.append(i == 0 ? "\"" : ",\"");
+            out.append(gauges[i].first);
+            out.append("\":");
+            out.append(to_string(gauges[i].second));
+        }
+        out.append("},\"latency\":{");
+        bool first = true;
+        for (size_t m = 0; m < METRIC_COUNT; m++)
+        {
+            LatencySummary latency = summary(static_cast<Metric>(m));
+            if (latency.count == 0)
+            {
+                continue;
+            }
+            out.append(first ? "\"" : ",\"");
+            out.append(metricName(static_cast<Metric>(m)));
+            out.append("\":{\"count\":");
+            out.append(to_string(latency.count));
+            out.append(",\"mean_us\":");
+            appendMicros(out, latency.totalNanos / latency.count);
+            out.append(",\"p50_us\":");
+            appendMicros(out, latency.p50);
+            out.append(",\"p90_us\":");
+            appendMicros(out, latency.p90);
+            out.append(",\"p99_us\":");
+            appendMicros(out, latency.p99);
+            out.append(",\"p999_us\":");
+            appendMicros(out, latency.p999);
+            out.append(",\"max_us\":");
+            appendMicros(out, latency.maxNanos);
+            out.push_back('}');
+            first = false;
+        }
+        out.append("}}");
+        return out;
+    }
+};
+
+const unsigned Metrics::SUB_BUCKET_BITS;
+const unsigned Metrics::MAX_EXPONENT;
+const unsigned Metrics::BUCKETS;
+const unsigned Metrics::SHARDS;
+const size_t Metrics::METRIC_COUNT;
+
+// Records the time from construction to the end of the scope.
+class LatencyTimer
+{
+private:
+    Metrics &metrics;
+    Metric metric;
+    chrono::steady_clock::time_point started;
+
+public:
+    LatencyTimer(Metrics &owner, Metric measured) : metrics(owner)
+    {
+        metric = measured;
+        started = chrono::steady_clock::now();
+    }
+
+    ~LatencyTimer()
+    {
+        metrics.record(metric, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count()));
+    }
+};
+
+enum class LogType : uint8_t
+{
+    RegisterUser = 1,
+    DeleteUser = 2,
+    FriendRequest = 3,
+    AcceptRequest = 4,
+    AddPost = 5,
+    DeletePostById = 11,
+    LikePostById = 12,
+    UnlikePost = 13,
+    DeleteUsers = 14,
+    DeclineRequest = 15,
+    RespondRequests = 16
+};
+
+class LogRecord
+{
+private:
+    string bytes;
+
+public:
+    LogRecord &put32(uint32_t value)
+    {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        return *this;
+    }
+
+    LogRecord &put64(uint64_t value)
+    {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        return *this;
+    }
+
+    LogRecord &putString(const string &value)
+    {
+        put32(static_cast<uint32_t>(value.size()));
+        bytes.append(value);
+        return *this;
+    }
+
+    const string &data() const
+    {
+        return bytes;
+    }
+};
+
+class LogReader
+{
+private:
+    const char *cursor;
+    const char *end;
+    bool valid;
+
+public:
+    LogReader(const char *data, size_t length)
+    {
+        cursor = data;
+        end = data + length;
+        valid = true;
+    }
+
+    uint32_t get32()
+    {
+        uint32_t value = 0;
+        if (end - cursor < 4)
+        {
+            valid = false;
+            return value;
+        }
+        memcpy(&value, cursor, sizeof(value));
+        cursor += sizeof(value);
+        return value;
+    }
+
+    uint64_t get64()
+    {
+        uint64_t value = 0;
+        if (end - cursor < 8)
+        {
+            valid = false;
+            return value;
+        }
+        memcpy(&value, cursor, sizeof(value));
+        cursor += sizeof(value);
+        return value;
+    }
+
+    string getString()
+    {
+        uint32_t length = get32();
+        if (!valid || static_cast<size_t>(end - cursor) < length)
+        {
+            valid = false;
+            return string();
+        }
+        string value(cursor, length);
+        cursor += length;
+        return value;
+    }
+
+    bool ok() const
+    {
+        return valid;
+    }
+};
+
+// Record layout: payload length, CRC-32 of everything after the CRC, LSN, type, payload.
+//
+// Only one thread writes at a time: the LogWriter while running, or whoever holds it drained and the journal lock.
+// The file size can be read by anyone.
+class Journal
+{
+private:
+    static const size_t HEADER_SIZE = 17;
+
+    FILE *file;
+    uint64_t nextLsn;
+    size_t unsyncedRecords;
+    atomic<size_t> fileBytes;
+    string pending;
+    chrono::steady_clock::time_point firstUnsynced;
+    // Set for good by the first write or sync that fails; the file may end in a torn record from then on.
+    atomic<bool> broken;
+
+public:
+    Metrics *metrics;
+
+    Journal()
+    {
+        metrics = nullptr;
+        file = nullptr;
+        nextLsn = 1;
+        unsyncedRecords = 0;
+        fileBytes = 0;
+        broken = false;
+    }
+
+    ~Journal()
+    {
+        close();
+    }
+
+    static void encode(uint64_t lsn, LogType type, const LogRecord &record, string &out)
+    {
+        const string &payload = record.data();
+        uint32_t length = static_cast<uint32_t>(payload.size());
+        size_t start = out.size();
+
+        out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        out.append(4, '\0');
+        out.append(reinterpret_cast<const char *>(&lsn), sizeof(lsn));
+        out.push_back(static_cast<char>(type));
+        out.append(payload);
+
+        uint32_t crc = crc32(out.data() + start + 8, out.size() - start - 8);
+        memcpy(&out[start + 4], &crc, sizeof(crc));
+    }
+
+    // Returns false when the file ends in a torn or corrupt record; everything before it was replayed.
+    template <typename Visitor>
+    static bool replay(const char *data, size_t size, Visitor visit)
+    {
+        size_t offset = 0;
+        while (offset < size)
+        {
+            if (size - offset < HEADER_SIZE)
+            {
+                return false;
+            }
+
+            uint32_t length, crc;
+            uint64_t lsn;
+            memcpy(&length, data + offset, sizeof(length));
+            memcpy(&crc, data + offset + 4, sizeof(crc));
+            memcpy(&lsn, data + offset + 8, sizeof(lsn));
+            if (size - offset - HEADER_SIZE < length ||
+                crc32(data + offset + 8, HEADER_SIZE - 8 + length) != crc)
+            {
+                return false;
+            }
+
+            LogType type = static_cast<LogType>(data[offset + 16]);
+            LogReader reader(data + offset + HEADER_SIZE, length);
+            visit(lsn, type, reader);
+            offset += HEADER_SIZE + length;
+        }
+        return true;
+    }
+
+    bool open(const string &path)
+    {
+        close();
+        file = fopen(path.c_str(), "ab");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+        fileBytes = static_cast<size_t>(ftell(file));
+        return true;
+    }
+
+    void close()
+    {
+        if (file != nullptr)
+        {
+            sync();
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    // Buffers a record numbered by the caller; records must come in LSN order. Nothing reaches the file before the
+    // next flush, or before the buffer fills up.
+    void append(uint64_t lsn, LogType type, const LogRecord &record)
+    {
+        nextLsn = lsn + 1;
+        if (file == nullptr)
+        {
+            return;
+        }
+
+        size_t before = pending.size();
+        encode(lsn, type, record, pending);
+        fileBytes += pending.size() - before;
+        if (unsyncedRecords++ == 0)
+        {
+            firstUnsynced = chrono::steady_clock::now();
+        }
+        if (pending.size() >= (1 << 16))
+        {
+            flush();
+        }
+    }
+
+    bool flush()
+    {
+        if (file != nullptr && !pending.empty())
+        {
+            if (fwrite(pending.data(), 1, pending.size(), file) != pending.size() || fflush(file) != 0)
+            {
+                broken = true;
+            }
+            pending.clear();
+        }
+        return !broken;
+    }
+
+    // Returns false if any record appended so far may not have reached the disk.
+    bool sync()
+    {
+        flush();
+        if (file != nullptr && unsyncedRecords > 0)
+        {
+            chrono::steady_clock::time_point started = chrono::steady_clock::now();
+            if (!syncFile(file))
+            {
+                broken = true;
+            }
+            unsyncedRecords = 0;
+            if (metrics != nullptr)
+            {
+                metrics->record(Metric::JournalSync, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count()));
+            }
+        }
+        return !broken;
+    }
+
+    bool failed() const
+    {
+        return broken;
+    }
+
+    uint64_t lastLsn() const
+    {
+        return nextLsn - 1;
+    }
+
+    size_t unsynced() const
+    {
+        return unsyncedRecords;
+    }
+
+    // When the oldest record not yet synced was appended; meaningless while unsynced() is 0.
+    chrono::steady_clock::time_point oldestUnsynced() const
+    {
+        return firstUnsynced;
+    }
+
+    void advancePast(uint64_t lsn)
+    {
+        if (lsn >= nextLsn)
+        {
+            nextLsn = lsn + 1;
+        }
+    }
+
+    size_t size() const
+    {
+        return fileBytes;
+    }
+};
+
+const size_t Journal::HEADER_SIZE;
+
+// Takes log records from any number of threads and writes them from a thread of its own, so that no caller waits
+// for the disk unless it asks to. Producers number each record from an atomic counter and push it onto a lock-free
+// queue (Vyukov's intrusive MPSC queue: a producer swaps itself in as the head, then links the old head to itself).
+// The writer drains whatever has arrived and appends it with one write. A producer can be overtaken between taking
+// its number and pushing, so records that arrive early are held back until the gap before them is filled; the file
+// stays in LSN order.
+//
+// Group commit: the writer syncs as soon as anyone waits for durability, and otherwise once groupCommitRecords
+// records or groupCommitMillis have gone unsynced. Records that arrive during a sync are covered together by the
+// next one, so concurrent waiters share their syncs. Between syncs the writer sleeps, and producers only wake it
+// for the first record after a quiet spell or once groupCommitRecords are waiting; everything else is picked up
+// when the sleep runs out, so fire-and-forget records do not cost a thread switch each.
+class LogWriter
+{
+private:
+    enum Sleep
+    {
+        AWAKE,
+        // Until the next sync is due; only a full group or a waiter cuts it short.
+        DOZING,
+        // With nothing unsynced; any record wakes the writer.
+        ASLEEP
+    };
+
+    struct Node
+    {
+        atomic<Node *> next;
+        uint64_t lsn;
+        LogType type;
+        LogRecord record;
+    };
+
+    Journal &journal;
+    mutex &journalLock;
+    atomic<Node *> head;
+    Node *tail;
+    Node stub;
+    atomic<uint64_t> nextLsn;
+    atomic<uint64_t> writtenLsn;
+    atomic<uint64_t> durableLsn;
+    vector<Node *> held;
+    mutex signalLock;
+    condition_variable workReady;
+    condition_variable progress;
+    atomic<int> sleep;
+    atomic<bool> stopping;
+    // Once the journal fails nothing more becomes durable; waiters are released with an error instead.
+    atomic<bool> broken;
+    atomic<size_t> waiters;
+    thread writer;
+
+    void push(Node *node)
+    {
+        node->next.store(nullptr, memory_order_relaxed);
+        Node *previous = head.exchange(node, memory_order_acq_rel);
+        previous->next.store(node, memory_order_release);
+    }
+
+    // Null when the queue is empty, and also while the next producer has swapped itself in but not linked yet.
+    Node *pop()
+    {
+        Node *first = tail;
+        Node *next = first->next.load(memory_order_acquire);
+        if (first == &stub)
+        {
+            if (next == nullptr)
+            {
+                return nullptr;
+            }
+            tail = next;
+            first = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != nullptr)
+        {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(memory_order_acquire))
+        {
+            return nullptr;
+        }
+        push(&stub);
+        next = first->next.load(memory_order_acquire);
+        if (next != nullptr)
+        {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+
+    void wake()
+    {
+        lock_guard<mutex> lock(signalLock);
+        workReady.notify_one();
+    }
+
+    // Appends the arrived records that continue the log, and returns the last LSN written or 0.
+    uint64_t writeArrived()
+    {
+        for (Node *node = pop(); node != nullptr; node = pop())
+        {
+            held.push_back(node);
+        }
+        if (held.empty())
+        {
+            return 0;
+        }
+        sort(held.begin(), held.end(), [](const Node *a, const Node *b)
+             { return a->lsn < b->lsn; });
+
+        size_t written = 0;
+        {
+            lock_guard<mutex> lock(journalLock);
+            while (written < held.size() && held[written]->lsn == journal.lastLsn() + 1)
+            {
+                journal.append(held[written]->lsn, held[written]->type, held[written]->record);
+                written++;
+            }
+            if (!journal.flush())
+            {
+                broken = true;
+            }
+        }
+        if (written == 0)
+        {
+            return 0;
+        }
+        uint64_t last = held[written - 1]->lsn;
+        for (size_t i = 0; i < written; i++)
+        {
+            delete held[i];
+        }
+        held.erase(held.begin(), held.begin() + written);
+        return last;
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            uint64_t written = writeArrived();
+            if (written != 0)
+            {
+                writtenLsn.store(written);
+            }
+
+            uint64_t target = writtenLsn.load();
+            bool due = false;
+            chrono::steady_clock::time_point deadline;
+            {
+                lock_guard<mutex> lock(journalLock);
+                deadline = journal.oldestUnsynced() + chrono::milliseconds(groupCommitMillis.load());
+                if (durableLsn.load() < target && !broken.load() &&
+                    (waiters.load() > 0 || stopping.load() || journal.unsynced() >= groupCommitRecords.load() || chrono::steady_clock::now() >= deadline))
+                {
+                    if (journal.sync())
+                    {
+                        due = true;
+                    }
+                    else
+                    {
+                        broken = true;
+                    }
+                }
+            }
+            if (due)
+            {
+                durableLsn.store(target);
+            }
+            if ((written != 0 || due || broken.load()) && waiters.load() > 0)
+            {
+                lock_guard<mutex> lock(signalLock);
+                progress.notify_all();
+            }
+
+            if (nextLsn.load() - 1 > writtenLsn.load())
+            {
+                // Numbered records are on their way in.
+                if (written == 0)
+                {
+                    this_thread::yield();
+                }
+                continue;
+            }
+
+            unique_lock<mutex> lock(signalLock);
+            bool settled = durableLsn.load() == writtenLsn.load() || broken.load();
+            sleep.store(settled ? ASLEEP : DOZING);
+            if (nextLsn.load() - 1 == writtenLsn.load() && !(waiters.load() > 0 && !settled))
+            {
+                if (stopping.load() && settled)
+                {
+                    sleep.store(AWAKE);
+                    return;
+                }
+                if (settled && !stopping.load())
+                {
+                    workReady.wait(lock);
+                }
+                else if (!stopping.load())
+                {
+                    workReady.wait_until(lock, deadline);
+                }
+            }
+            sleep.store(AWAKE);
+        }
+    }
+
+    // A failure only cuts the wait short for durability: records are still written, or at least consumed, in order.
+    bool waitFor(const atomic<uint64_t> &position, uint64_t lsn, bool untilFailure)
+    {
+        if (position.load() >= lsn)
+        {
+            return true;
+        }
+        waiters++;
+        if (sleep.load() != AWAKE)
+        {
+            wake();
+        }
+        unique_lock<mutex> lock(signalLock);
+        progress.wait(lock, [&]()
+                      { return position.load() >= lsn || (untilFailure && broken.load()); });
+        waiters--;
+        return position.load() >= lsn;
+    }
+
+public:
+    atomic<size_t> groupCommitRecords;
+    atomic<int> groupCommitMillis;
+
+    LogWriter(Journal &log, mutex &lock) : journal(log), journalLock(lock), head(&stub), tail(&stub)
+    {
+        stub.next = nullptr;
+        nextLsn = 1;
+        writtenLsn = 0;
+        durableLsn = 0;
+        sleep = AWAKE;
+        stopping = false;
+        broken = false;
+        waiters = 0;
+        groupCommitRecords = 32;
+        groupCommitMillis = 20;
+    }
+
+    ~LogWriter()
+    {
+        stop();
+    }
+
+    // Continues the log after the last LSN the journal holds.
+    void start()
+    {
+        uint64_t last = journal.lastLsn();
+        nextLsn = last + 1;
+        writtenLsn = last;
+        durableLsn = last;
+        stopping = false;
+        broken = journal.failed();
+        writer = thread([this]()
+                        { run(); });
+    }
+
+    // Writes and syncs everything submitted, then ends the writer thread.
+    void stop()
+    {
+        if (writer.joinable())
+        {
+            {
+                lock_guard<mutex> lock(signalLock);
+                stopping = true;
+                workReady.notify_one();
+            }
+            writer.join();
+        }
+    }
+
+    uint64_t submit(LogType type, const LogRecord &record)
+    {
+        Node *node = new Node();
+        node->type = type;
+        node->record = record;
+        uint64_t lsn = nextLsn.fetch_add(1);
+        node->lsn = lsn;
+        push(node);
+        int state = sleep.load();
+        if (state == ASLEEP || (state == DOZING && lsn - writtenLsn.load() >= groupCommitRecords.load()))
+        {
+            wake();
+        }
+        return lsn;
+    }
+
+    uint64_t lastSubmitted() const
+    {
+        return nextLsn.load() - 1;
+    }
+
+    uint64_t lastDurable() const
+    {
+        return durableLsn.load();
+    }
+
+    bool failed() const
+    {
+        return broken.load();
+    }
+
+    // Blocks until the record with the given LSN, and every one before it, is in the file.
+    void waitWritten(uint64_t lsn)
+    {
+        waitFor(writtenLsn, lsn, false);
+    }
+
+    // Blocks until the record with the given LSN, and every one before it, has been synced.
+    // Returns false if the journal failed first.
+    bool waitDurable(uint64_t lsn)
+    {
+        return waitFor(durableLsn, lsn, true);
+    }
+};
+
+class MappedFile
+{
+private:
+    const char *data;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+public:
+    MappedFile()
+    {
+        data = nullptr;
+        length = 0;
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#endif
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const string &path)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        length = static_cast<size_t>(fileSize.QuadPart);
+        if (length > 0)
+        {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            data = mapping == nullptr ? nullptr : static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        fstat(fd, &info);
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0)
+        {
+            void *address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = address == MAP_FAILED ? nullptr : static_cast<const char *>(address);
+        }
+        ::close(fd);
+#endif
+        if (data == nullptr)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (data != nullptr)
+        {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr)
+        {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (data != nullptr)
+        {
+            munmap(const_cast<char *>(data), length);
+        }
+#endif
+        data = nullptr;
+        length = 0;
+    }
+
+    const char *begin() const
+    {
+        return data;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+};
+
+// Snapshot files are a header followed by 8-byte aligned sections that are used in place once mapped.
+enum SnapshotSectionId
+{
+    SECTION_STRINGS,
+    SECTION_USERS,
+    SECTION_DIRECTORY,
+    SECTION_FRIEND_OFFSETS,
+    SECTION_FRIEND_TARGETS,
+    SECTION_OUTBOX_OFFSETS,
+    SECTION_OUTBOX_TARGETS,
+    SECTION_INBOX_OFFSETS,
+    SECTION_INBOX_TARGETS,
+    SECTION_POST_OFFSETS,
+    SECTION_POSTS,
+    SECTION_POST_SEQUENCES,
+    SECTION_COUNTERS,
+    SECTION_NAME_ORDER,
+    SECTION_LIKER_OFFSETS,
+    SECTION_LIKERS,
+    SECTION_OUTBOX_STAMPS,
+    SECTION_INBOX_STAMPS,
+    SECTION_COUNT
+};
+
+struct SnapshotSection
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerCrc;
+    uint64_t lsn;
+    uint32_t idLimit;
+    uint32_t bodyCrc;
+    SnapshotSection sections[SECTION_COUNT];
+};
+
+struct SnapshotUser
+{
+    uint64_t nameOffset;
+    uint64_t passwordOffset;
+    uint32_t nameLength;
+    uint32_t passwordLength;
+};
+
+struct SnapshotPost
+{
+    uint64_t textOffset;
+    uint32_t textLength;
+    int32_t likes;
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'S', 'C', 'S', 'N', 'A', 'P', '\r', '\n'};
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+class SnapshotWriter
+{
+private:
+    SnapshotHeader header;
+    string body;
+
+public:
+    SnapshotWriter(uint64_t lsn, uint32_t idLimit)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.lsn = lsn;
+        header.idLimit = idLimit;
+    }
+
+    void addSection(SnapshotSectionId id, const char *data, size_t size)
+    {
+        body.append((8 - body.size() % 8) % 8, '\0');
+        header.sections[id].offset = sizeof(SnapshotHeader) + body.size();
+        header.sections[id].size = size;
+        body.append(data, size);
+    }
+
+    template <typename T>
+    void addSection(SnapshotSectionId id, const vector<T> &items)
+    {
+        addSection(id, reinterpret_cast<const char *>(items.data()), items.size() * sizeof(T));
+    }
+
+    string finish()
+    {
+        header.bodyCrc = crc32(body.data(), body.size());
+        header.headerCrc = 0;
+        header.headerCrc = crc32(reinterpret_cast<const char *>(&header), sizeof(header));
+        string out(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.append(body);
+        return out;
+    }
+};
+
+class SnapshotView
+{
+private:
+    const char *base;
+    SnapshotHeader header;
+
+public:
+    SnapshotView()
+    {
+        base = nullptr;
+        memset(&header, 0, sizeof(header));
+    }
+
+    // checkBody can be turned off for a file this process has just written and read back.
+    bool open(const char *data, size_t size, bool checkBody = true)
+    {
+        base = data;
+        memset(&header, 0, sizeof(header));
+        if (size < sizeof(SnapshotHeader) || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        {
+            return false;
+        }
+
+        memcpy(&header, data, sizeof(header));
+        uint32_t crc = header.headerCrc;
+        header.headerCrc = 0;
+        if (header.version != SNAPSHOT_VERSION || crc32(reinterpret_cast<const char *>(&header), sizeof(header)) != crc)
+        {
+            return false;
+        }
+        header.headerCrc = crc;
+        if (checkBody && crc32(data + sizeof(header), size - sizeof(header)) != header.bodyCrc)
+        {
+            return false;
+        }
+
+        for (const SnapshotSection &section : header.sections)
+        {
+            if (section.offset % 8 != 0 || section.offset > size || section.size > size - section.offset)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t lsn() const
+    {
+        return header.lsn;
+    }
+
+    uint32_t idLimit() const
+    {
+        return header.idLimit;
+    }
+
+    template <typename T>
+    const T *section(SnapshotSectionId id) const
+    {
+        return reinterpret_cast<const T *>(base + header.sections[id].offset);
+    }
+
+    template <typename T>
+    size_t count(SnapshotSectionId id) const
+    {
+        return header.sections[id].size / sizeof(T);
+    }
+
+    size_t bytes(SnapshotSectionId id) const
+    {
+        return header.sections[id].size;
+    }
+
+    bool validCsr(SnapshotSectionId offsetsId, SnapshotSectionId targetsId) const
+    {
+        if (count<uint64_t>(offsetsId) != static_cast<size_t>(idLimit()) + 1)
+        {
+            return false;
+        }
+
+        const uint64_t *offsets = section<uint64_t>(offsetsId);
+        const uint32_t *targets = section<uint32_t>(targetsId);
+        size_t targetCount = count<uint32_t>(targetsId);
+        if (offsets[0] != 0 || offsets[idLimit()] != targetCount)
+        {
+            return false;
+        }
+        for (uint32_t id = 0; id < idLimit(); id++)
+        {
+            if (offsets[id] > offsets[id + 1] || offsets[id + 1] > targetCount)
+            {
+                return false;
+            }
+            for (uint64_t i = offsets[id]; i < offsets[id + 1]; i++)
+            {
+                if (targets[i] >= idLimit() || (i > offsets[id] && targets[i - 1] >= targets[i]))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+class ChunkedLineParser
+{
+public:
+    // Splits the buffer into line-aligned chunks and calls visit(chunk, lineInChunk, begin, end) from one thread per chunk.
+    template <typename LineVisitor>
+    static vector<size_t> forEachLine(const char *data, size_t size, unsigned chunkCount, LineVisitor visit)
+    {
+        vector<size_t> bounds(chunkCount + 1, size);
+        bounds[0] = 0;
+        for (unsigned c = 1; c < chunkCount; c++)
+        {
+            size_t position = max(size / chunkCount * c, bounds[c - 1]);
+            const char *newline = position < size ? static_cast<const char *>(memchr(data + position, '\n', size - position)) : nullptr;
+            bounds[c] = newline == nullptr ? size : static_cast<size_t>(newline - data) + 1;
+        }
+
+        vector<size_t> lineCounts(chunkCount, 0);
+        vector<thread> workers;
+        for (unsigned c = 0; c < chunkCount; c++)
+        {
+            workers.emplace_back([&, c]()
+                                 {
+                                     const char *cursor = data + bounds[c];
+                                     const char *end = data + bounds[c + 1];
+                                     size_t line = 0;
+                                     while (cursor < end)
+                                     {
+                                         const char *newline = static_cast<const char *>(memchr(cursor, '\n', end - cursor));
+                                         const char *lineEnd = newline == nullptr ? end : newline;
+                                         visit(c, line++, cursor, lineEnd > cursor && lineEnd[-1] == '\r' ? lineEnd - 1 : lineEnd);
+                                         cursor = lineEnd + 1;
+                                     }
+                                     lineCounts[c] = line;
+                                 });
+        }
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+        return lineCounts;
+    }
+
+    static size_t splitTokens(const char *begin, const char *end, const char **tokens, size_t *lengths, size_t maxTokens)
+    {
+        size_t count = 0;
+        while (begin < end)
+        {
+            while (begin < end && (*begin == ' ' || *begin == '\t'))
+            {
+                begin++;
+            }
+            if (begin == end)
+            {
+                break;
+            }
+            const char *start = begin;
+            while (begin < end && *begin != ' ' && *begin != '\t')
+            {
+                begin++;
+            }
+            if (count < maxTokens)
+            {
+                tokens[count] = start;
+                lengths[count] = begin - start;
+            }
+            count++;
+        }
+        return count;
+    }
+};
+
+struct ImportRejection
+{
+    unsigned chunk;
+    size_t line;
+    string reason;
+};
+
+enum class OpStatus
+{
+    Ok,
+    UserNotFound,
+    UserExists,
+    InvalidUsername,
+    WrongPassword,
+    NoRequest,
+    NotFriends,
+    InvalidPost,
+    InvalidRequest,
+    AlreadyFriends,
+    DuplicateRequest,
+    NotConnected,
+    StorageError
+};
+
+static const char *statusName(OpStatus status)
+{
+    switch (status)
+    {
+    case OpStatus::Ok:
+        return "ok";
+    case OpStatus::UserNotFound:
+        return "user_not_found";
+    case OpStatus::UserExists:
+        return "user_exists";
+    case OpStatus::InvalidUsername:
+        return "invalid_username";
+    case OpStatus::WrongPassword:
+        return "wrong_password";
+    case OpStatus::NoRequest:
+        return "no_request";
+    case OpStatus::NotFriends:
+        return "not_friends";
+    case OpStatus::InvalidPost:
+        return "invalid_post";
+    case OpStatus::InvalidRequest:
+        return "invalid_request";
+    case OpStatus::AlreadyFriends:
+        return "already_friends";
+    case OpStatus::DuplicateRequest:
+        return "duplicate_request";
+    case OpStatus::NotConnected:
+        return "not_connected";
+    case OpStatus::StorageError:
+        return "storage_error";
+    }
+    return "unknown";
+}
+
+enum class FriendChange
+{
+    Request,
+    Accept,
+    Decline
+};
+
+// The sequence doubles as the post's ID, which stays valid while other posts are deleted.
+struct FeedEntry
+{
+    uint32_t author;
+    uint64_t sequence;
+    string text;
+    int likes;
+};
+
+struct TimelineItem
+{
+    uint64_t sequence;
+    uint32_t author;
+};
+
+// Everything one logged-in client needs between requests; the manager keeps no per-client state of its own.
+struct Session
+{
+    uint32_t userId;
+    string username;
+};
+
+typedef shared_lock<shared_timed_mutex> SharedLock;
+typedef unique_lock<shared_timed_mutex> ExclusiveLock;
+
+// A user's profile, friend list row and timeline are guarded by the stripe their ID maps to.
+class LockStripes
+{
+public:
+    static const uint32_t COUNT = 256;
+
+private:
+    mutable shared_timed_mutex locks[COUNT];
+
+public:
+    static uint32_t indexOf(uint32_t id)
+    {
+        return id % COUNT;
+    }
+
+    shared_timed_mutex &of(uint32_t id) const
+    {
+        return locks[indexOf(id)];
+    }
+};
+
+const uint32_t LockStripes::COUNT;
+
+// Locks the stripes of two users exclusively, always the lower stripe first, so that two-user operations running
+// in opposite directions cannot deadlock.
+class PairLock
+{
+private:
+    ExclusiveLock first;
+    ExclusiveLock second;
+
+public:
+    PairLock(const LockStripes &stripes, uint32_t a, uint32_t b)
+    {
+        if (LockStripes::indexOf(b) < LockStripes::indexOf(a))
+        {
+            swap(a, b);
+        }
+        first = ExclusiveLock(stripes.of(a));
+        if (LockStripes::indexOf(a) != LockStripes::indexOf(b))
+        {
+            second = ExclusiveLock(stripes.of(b));
+        }
+    }
+};
+
+// Profiles in memory are a cache over the snapshot they were last saved to, which stays mapped, so memory follows
+// the users who are active rather than all of them. A profile is read back from the snapshot the first time it is
+// used again. Snapshots are numbered as they are written, and a profile may only be dropped while it is unchanged
+// since the mapped one; changed profiles stay until a compaction writes them back and its snapshot is mapped.
+class ProfileCache
+{
+private:
+    const UserDirectory &directory;
+    vector<TextArena> &arenas;
+    unique_ptr<MappedFile> file;
+    SnapshotView view;
+    atomic<uint32_t> mappedGeneration;
+    uint32_t lastGeneration;
+    atomic<uint32_t> writtenGeneration;
+    // Loaders share the user's stripe with readers, so loaders of one stripe take turns on its arena.
+    mutable mutex loadLocks[LockStripes::COUNT];
+    atomic<size_t> residentCount;
+    atomic<size_t> sweepAbove;
+    atomic<uint64_t> loadCount;
+    atomic<uint64_t> evictionCount;
+    size_t capacity;
+    uint32_t hand;
+
+    void appendStored(uint32_t id, SnapshotSectionId offsetsId, SnapshotSectionId targetsId, SnapshotSectionId stampsId,
+                      vector<uint32_t> &ids, vector<uint64_t> &stamps) const
+    {
+        const uint64_t *offsets = view.section<uint64_t>(offsetsId);
+        ids.insert(ids.end(), view.section<uint32_t>(targetsId) + offsets[id], view.section<uint32_t>(targetsId) + offsets[id + 1]);
+        stamps.insert(stamps.end(), view.section<uint64_t>(stampsId) + offsets[id], view.section<uint64_t>(stampsId) + offsets[id + 1]);
+    }
+
+public:
+    static const size_t DEFAULT_CAPACITY = 1 << 18;
+
+    ProfileCache(const UserDirectory &userDirectory, vector<TextArena> &textArenas)
+        : directory(userDirectory), arenas(textArenas)
+    {
+        mappedGeneration = 0;
+        lastGeneration = 0;
+        writtenGeneration = 0;
+        residentCount = 0;
+        sweepAbove = DEFAULT_CAPACITY;
+        loadCount = 0;
+        evictionCount = 0;
+        capacity = DEFAULT_CAPACITY;
+        hand = 0;
+    }
+
+    // Windows cannot replace a snapshot that is still mapped, so there every profile stays in memory.
+    static bool canStayMapped()
+    {
+#ifdef _WIN32
+        return false;
+#else
+        return true;
+#endif
+    }
+
+    // Maps the snapshot at path as the next generation and returns it, or 0 if the file is not a usable snapshot.
+    uint32_t map(const string &path)
+    {
+        unique_ptr<MappedFile> mapped(new MappedFile());
+        SnapshotView opened;
+        // Only called once recovery has checked the same file.
+        if (!mapped->open(path) || !opened.open(mapped->begin(), mapped->size(), false))
+        {
+            return 0;
+        }
+        file.swap(mapped);
+        view = opened;
+        mappedGeneration = nextGeneration();
+        written(mappedGeneration);
+        return mappedGeneration;
+    }
+
+    void unmap()
+    {
+        file.reset();
+        view = SnapshotView();
+        mappedGeneration = 0;
+    }
+
+    uint32_t mapped() const
+    {
+        return mappedGeneration;
+    }
+
+    // Numbers a snapshot about to be written; written records that it reached the disk.
+    uint32_t nextGeneration()
+    {
+        return ++lastGeneration;
+    }
+
+    void written(uint32_t generation)
+    {
+        uint32_t current = writtenGeneration.load();
+        while (current < generation && !writtenGeneration.compare_exchange_weak(current, generation))
+        {
+        }
+    }
+
+    bool newerWritten() const
+    {
+        return canStayMapped() && writtenGeneration.load() > mappedGeneration;
+    }
+
+    // Maps the newest snapshot written, once the one in the file is newer than the mapped one.
+    void remap(const string &path)
+    {
+        uint32_t generation = writtenGeneration.load();
+        if (generation <= mappedGeneration)
+        {
+            return;
+        }
+        unique_ptr<MappedFile> mapped(new MappedFile());
+        SnapshotView opened;
+        if (mapped->open(path) && opened.open(mapped->begin(), mapped->size(), false))
+        {
+            file.swap(mapped);
+            view = opened;
+            mappedGeneration = generation;
+            sweepAbove = capacity;
+        }
+    }
+
+    const SnapshotView &snapshot() const
+    {
+        return view;
+    }
+
+    // Called with the user's stripe held; the profile is published through slot.
+    UserProfile *load(uint32_t id, atomic<UserProfile *> &slot)
+    {
+        lock_guard<mutex> guard(loadLocks[LockStripes::indexOf(id)]);
+        UserProfile *profile = slot.load(memory_order_acquire);
+        if (profile != nullptr)
+        {
+            return profile;
+        }
+
+        profile = new UserProfile(id, directory.nameOf(id));
+        const uint64_t *outboxOffsets = view.section<uint64_t>(SECTION_OUTBOX_OFFSETS);
+        const uint64_t *inboxOffsets = view.section<uint64_t>(SECTION_INBOX_OFFSETS);
+        profile->loadRequests(view.section<uint32_t>(SECTION_OUTBOX_TARGETS) + outboxOffsets[id], view.section<uint64_t>(SECTION_OUTBOX_STAMPS) + outboxOffsets[id],
+                              outboxOffsets[id + 1] - outboxOffsets[id],
+                              view.section<uint32_t>(SECTION_INBOX_TARGETS) + inboxOffsets[id], view.section<uint64_t>(SECTION_INBOX_STAMPS) + inboxOffsets[id],
+                              inboxOffsets[id + 1] - inboxOffsets[id]);
+        TextArena &arena = arenas[LockStripes::indexOf(id)];
+        forEachStoredPost(id, [&](uint64_t sequence, const PostText &text, int likes)
+                          { profile->loadPost(arena, text.data, text.length, likes, sequence); });
+        slot.store(profile, memory_order_release);
+        loadCount++;
+        admitted();
+        return profile;
+    }
+
+    template <typename Visitor>
+    void forEachStoredPost(uint32_t id, Visitor visit) const
+    {
+        const uint64_t *offsets = view.section<uint64_t>(SECTION_POST_OFFSETS);
+        const SnapshotPost *posts = view.section<SnapshotPost>(SECTION_POSTS);
+        const uint64_t *sequences = view.section<uint64_t>(SECTION_POST_SEQUENCES);
+        const char *strings = view.section<char>(SECTION_STRINGS);
+        for (uint64_t i = offsets[id]; i < offsets[id + 1]; i++)
+        {
+            visit(sequences[i], PostText{strings + posts[i].textOffset, posts[i].textLength}, static_cast<int>(posts[i].likes));
+        }
+    }
+
+    void appendStoredRequests(uint32_t id, vector<uint32_t> &outgoing, vector<uint64_t> &outgoingStamps,
+                              vector<uint32_t> &incoming, vector<uint64_t> &incomingStamps) const
+    {
+        appendStored(id, SECTION_OUTBOX_OFFSETS, SECTION_OUTBOX_TARGETS, SECTION_OUTBOX_STAMPS, outgoing, outgoingStamps);
+        appendStored(id, SECTION_INBOX_OFFSETS, SECTION_INBOX_TARGETS, SECTION_INBOX_STAMPS, incoming, incomingStamps);
+    }
+
+    // Whether the mapped snapshot holds any request sent or received by the user, without loading the profile.
+    bool hasStoredRequests(uint32_t id) const
+    {
+        if (id >= view.idLimit())
+        {
+            return false;
+        }
+        const uint64_t *outboxOffsets = view.section<uint64_t>(SECTION_OUTBOX_OFFSETS);
+        const uint64_t *inboxOffsets = view.section<uint64_t>(SECTION_INBOX_OFFSETS);
+        return outboxOffsets[id] != outboxOffsets[id + 1] || inboxOffsets[id] != inboxOffsets[id + 1];
+    }
+
+    void admitted()
+    {
+        residentCount++;
+    }
+
+    void released(bool evicted)
+    {
+        residentCount--;
+        if (evicted)
+        {
+            evictionCount++;
+        }
+    }
+
+    void setCapacity(size_t profiles)
+    {
+        capacity = max<size_t>(1, profiles);
+        sweepAbove = capacity;
+    }
+
+    bool sweepDue() const
+    {
+        return residentCount.load() > sweepAbove.load();
+    }
+
+    // A sweep stops once an eighth of the capacity is free, so the next one is that many loads away.
+    bool overTarget() const
+    {
+        return residentCount.load() > capacity - capacity / 8;
+    }
+
+    // After a sweep that could not get below the capacity, waits for as many more profiles before trying again.
+    void swept()
+    {
+        sweepAbove = max(capacity, residentCount.load() + capacity / 8);
+    }
+
+    uint32_t advanceHand(size_t userCount)
+    {
+        hand = hand + 1 < userCount ? hand + 1 : 0;
+        return hand;
+    }
+
+    size_t resident() const
+    {
+        return residentCount.load();
+    }
+
+    uint64_t loads() const
+    {
+        return loadCount.load();
+    }
+
+    uint64_t evictions() const
+    {
+        return evictionCount.load();
+    }
+};
+
+const size_t ProfileCache::DEFAULT_CAPACITY;
+
+class User
+{
+private:
+    uint32_t id;
+    string password;
+    ProfileCache *cache;
+    mutable atomic<UserProfile *> profile;
+    // Set on every use and cleared by the passing CLOCK hand.
+    mutable atomic<bool> referenced;
+    // The newest snapshot generation holding the profile as it is now, or 0 while none does.
+    uint32_t savedIn;
+
+public:
+    User(uint32_t userId, const string &pass, ProfileCache *profileCache)
+    {
+        id = userId;
+        password = pass;
+        cache = profileCache;
+        profile = nullptr;
+        referenced = false;
+        savedIn = 0;
+    }
+
+    User(const User &other)
+    {
+        id = other.id;
+        password = other.password;
+        cache = other.cache;
+        profile = other.profile.load();
+        referenced = other.referenced.load();
+        savedIn = other.savedIn;
+    }
+
+    User &operator=(const User &) = delete;
+
+    uint32_t getId() const
+    {
+        return id;
+    }
+
+    const string &getPassword() const
+    {
+        return password;
+    }
+
+    bool exists() const
+    {
+        return savedIn != 0 || profile.load(memory_order_acquire) != nullptr;
+    }
+
+    UserProfile *residentProfile() const
+    {
+        return profile.load(memory_order_acquire);
+    }
+
+    // Reads the profile back from the snapshot if it is not in memory. The caller holds the user's stripe.
+    UserProfile *getProfile() const
+    {
+        UserProfile *current = profile.load(memory_order_acquire);
+        if (!referenced.load(memory_order_relaxed))
+        {
+            referenced.store(true, memory_order_relaxed);
+        }
+        if (current == nullptr && savedIn != 0)
+        {
+            current = cache->load(id, profile);
+        }
+        return current;
+    }
+
+    void createProfile(const string &username)
+    {
+        profile = new UserProfile(id, username);
+        cache->admitted();
+    }
+
+    // Leaves the profile to be loaded from the mapped snapshot when first used.
+    void storedIn(uint32_t generation)
+    {
+        savedIn = generation;
+    }
+
+    void deleteProfile()
+    {
+        UserProfile *current = profile.exchange(nullptr);
+        if (current != nullptr)
+        {
+            delete current;
+            cache->released(false);
+        }
+        savedIn = 0;
+    }
+
+    // Records that the snapshot about to be written holds the profile; one unchanged since an earlier snapshot
+    // keeps that one, which may already be mapped.
+    void markSaved(uint32_t generation)
+    {
+        UserProfile *current = profile.load(memory_order_relaxed);
+        if (current != nullptr && (savedIn == 0 || current->isDirty()))
+        {
+            savedIn = generation;
+            current->markSaved();
+        }
+    }
+
+    // Gives a recently used profile a second chance, clearing its mark.
+    bool takeReference() const
+    {
+        return referenced.exchange(false, memory_order_relaxed);
+    }
+
+    // Drops the profile if the mapped snapshot holds it as it is. The caller holds the user's stripe exclusively.
+    bool evict(TextArena &arena, uint32_t mappedGeneration)
+    {
+        UserProfile *current = profile.load(memory_order_relaxed);
+        if (current == nullptr || savedIn == 0 || savedIn > mappedGeneration || current->isDirty())
+        {
+            return false;
+        }
+        current->releasePosts(arena);
+        profile.store(nullptr, memory_order_release);
+        delete current;
+        cache->released(true);
+        return true;
+    }
+
+    // Visits the live posts with their texts and likes without loading the profile.
+    template <typename Visitor>
+    void forEachPost(Visitor visit) const
+    {
+        const UserProfile *current = profile.load(memory_order_acquire);
+        if (current == nullptr)
+        {
+            if (savedIn != 0)
+            {
+                cache->forEachStoredPost(id, visit);
+            }
+            return;
+        }
+        for (size_t i = 0; i < current->getPostCount(); i++)
+        {
+            if (current->isLive(i))
+            {
+                visit(current->getPostSequences()[i], current->getPostText(i), current->getLikes(i));
+            }
+        }
+    }
+
+    // Appends the requests in snapshot order without loading the profile.
+    void appendRequests(vector<uint32_t> &outgoing, vector<uint64_t> &outgoingStamps, vector<uint32_t> &incoming, vector<uint64_t> &incomingStamps) const
+    {
+        const UserProfile *current = profile.load(memory_order_acquire);
+        if (current == nullptr)
+        {
+            if (savedIn != 0)
+            {
+                cache->appendStoredRequests(id, outgoing, outgoingStamps, incoming, incomingStamps);
+            }
+            return;
+        }
+        current->getFriendRequests().appendTo(outgoing, outgoingStamps);
+        current->getPendingRequests().appendTo(incoming, incomingStamps);
+    }
+};
+
+// Keeps a bounded, time-ordered timeline per reader. Posts by ordinary authors are pushed into their friends'
+// timelines when written; authors in the high-degree set are merged in at read time instead. Timelines are only
+// built for users who actually read their feed and are dropped whenever their friend list changes.
+//
+// Locking: a timeline is guarded by its reader's stripe, and no method holds two stripes at once. Callers hold the
+// user table at least shared; reset, removeNode and demotions in updateDegree need it exclusively.
+class FeedEngine
+{
+private:
+    enum TimelineState : uint8_t
+    {
+        TIMELINE_ABSENT,
+        TIMELINE_BUILDING,
+        TIMELINE_COMPLETE,
+        TIMELINE_TRUNCATED
+    };
+
+    static const uint32_t OWN_TIMELINE = UINT32_MAX;
+
+    // One source in the k-way merge. Sources are copied out a batch at a time so no lock is held while merging.
+    struct FeedStream
+    {
+        uint32_t author;
+        uint64_t below;
+        vector<TimelineItem> batch;
+        size_t next;
+        bool drained;
+    };
+
+    struct StreamHead
+    {
+        uint64_t sequence;
+        size_t stream;
+
+        bool operator<(const StreamHead &other) const
+        {
+            return sequence < other.sequence;
+        }
+    };
+
+    const FriendGraph &graph;
+    const vector<User> &users;
+    const LockStripes &stripes;
+    vector<vector<TimelineItem>> timelines;
+    vector<uint8_t> states;
+    mutable mutex degreeLock;
+    IdSet highDegree;
+
+    bool isHighDegree(uint32_t id) const
+    {
+        lock_guard<mutex> lock(degreeLock);
+        return highDegree.contains(id);
+    }
+
+    // degreeLock is only ever taken last, so it may be acquired while holding a stripe.
+    vector<uint32_t> ordinaryFriendsOf(uint32_t viewer) const
+    {
+        vector<uint32_t> authors;
+        SharedLock lock(stripes.of(viewer));
+        lock_guard<mutex> degree(degreeLock);
+        graph.friendsOf(viewer).forEach([&](uint32_t id)
+                                        {
+                                            if (!highDegree.contains(id))
+                                            {
+                                                authors.push_back(id);
+                                            }
+                                        });
+        return authors;
+    }
+
+    vector<uint32_t> highDegreeFriendsOf(uint32_t viewer) const
+    {
+        vector<uint32_t> authors;
+        SharedLock lock(stripes.of(viewer));
+        lock_guard<mutex> degree(degreeLock);
+        if (highDegree.size() < graph.friendsOf(viewer).size())
+        {
+            highDegree.forEach([&](uint32_t id)
+                               {
+                                   if (graph.isFriend(viewer, id))
+                                   {
+                                       authors.push_back(id);
+                                   }
+                               });
+        }
+        else
+        {
+            graph.friendsOf(viewer).forEach([&](uint32_t id)
+                                            {
+                                                if (highDegree.contains(id))
+                                                {
+                                                    authors.push_back(id);
+                                                }
+                                            });
+        }
+        return authors;
+    }
+
+    // Copies the newest posts below stream.below, at most batchSize of them. Returns true when the reader's
+    // timeline ran out and older posts have to come from the friends themselves.
+    bool refill(FeedStream &stream, uint32_t viewer, size_t batchSize, uint64_t &fallbackBelow) const
+    {
+        stream.batch.clear();
+        stream.next = 0;
+        if (stream.author != OWN_TIMELINE)
+        {
+            SharedLock lock(stripes.of(stream.author));
+            const UserProfile *profile = users[stream.author].getProfile();
+            if (profile != nullptr)
+            {
+                const vector<uint64_t> &sequences = profile->getPostSequences();
+                size_t end = lower_bound(sequences.begin(), sequences.end(), stream.below) - sequences.begin();
+                size_t begin = end > batchSize ? end - batchSize : 0;
+                for (size_t i = end; i > begin; i--)
+                {
+                    stream.batch.push_back(TimelineItem{sequences[i - 1], stream.author});
+                }
+                stream.drained = begin == 0;
+            }
+            else
+            {
+                stream.drained = true;
+            }
+        }
+        else
+        {
+            SharedLock lock(stripes.of(viewer));
+            const vector<TimelineItem> &items = timelines[viewer];
+            uint8_t state = states[viewer];
+            if (state != TIMELINE_COMPLETE && state != TIMELINE_TRUNCATED)
+            {
+                // Invalidated since the read started: everything from here on comes from the friends directly.
+                stream.drained = true;
+                fallbackBelow = stream.below;
+                return true;
+            }
+            size_t end = lower_bound(items.begin(), items.end(), stream.below,
+                                     [](const TimelineItem &item, uint64_t value)
+                                     { return item.sequence < value; }) -
+                         items.begin();
+            size_t begin = end > batchSize ? end - batchSize : 0;
+            for (size_t i = end; i > begin; i--)
+            {
+                stream.batch.push_back(items[i - 1]);
+            }
+            stream.drained = begin == 0;
+            if (stream.drained && state == TIMELINE_TRUNCATED)
+            {
+                fallbackBelow = items.empty() ? stream.below : min(stream.below, items.front().sequence);
+                return true;
+            }
+        }
+        if (!stream.batch.empty())
+        {
+            stream.below = stream.batch.back().sequence;
+        }
+        return false;
+    }
+
+    void materialize(uint32_t viewer)
+    {
+        {
+            ExclusiveLock lock(stripes.of(viewer));
+            if (states[viewer] != TIMELINE_ABSENT)
+            {
+                return;
+            }
+            states[viewer] = TIMELINE_BUILDING;
+            timelines[viewer].clear();
+        }
+
+        // Posts arriving while the friends are read are fanned out into the timeline as usual and merged below.
+        vector<TimelineItem> gathered;
+        size_t available = 0;
+        for (uint32_t author : ordinaryFriendsOf(viewer))
+        {
+            SharedLock lock(stripes.of(author));
+            const UserProfile *profile = users[author].getProfile();
+            if (profile == nullptr)
+            {
+                continue;
+            }
+            const vector<uint64_t> &sequences = profile->getPostSequences();
+            available += sequences.size();
+            for (size_t i = sequences.size() > capacity ? sequences.size() - capacity : 0; i < sequences.size(); i++)
+            {
+                gathered.push_back(TimelineItem{sequences[i], author});
+            }
+        }
+
+        ExclusiveLock lock(stripes.of(viewer));
+        if (states[viewer] != TIMELINE_BUILDING)
+        {
+            return;
+        }
+        vector<TimelineItem> &items = timelines[viewer];
+        items.insert(items.end(), gathered.begin(), gathered.end());
+        sort(items.begin(), items.end(), [](const TimelineItem &a, const TimelineItem &b)
+             { return a.sequence < b.sequence; });
+        items.erase(unique(items.begin(), items.end(), [](const TimelineItem &a, const TimelineItem &b)
+                           { return a.sequence == b.sequence; }),
+                    items.end());
+        bool truncated = available > capacity;
+        if (items.size() > capacity)
+        {
+            items.erase(items.begin(), items.end() - capacity);
+            truncated = true;
+        }
+        states[viewer] = truncated ? TIMELINE_TRUNCATED : TIMELINE_COMPLETE;
+    }
+
+public:
+    size_t capacity;
+    size_t fanoutLimit;
+
+    FeedEngine(const FriendGraph &friendGraph, const vector<User> &allUsers, const LockStripes &userStripes)
+        : graph(friendGraph), users(allUsers), stripes(userStripes)
+    {
+        capacity = 256;
+        fanoutLimit = 1000;
+    }
+
+    void addNode(uint32_t id)
+    {
+        if (id >= timelines.size())
+        {
+            timelines.resize(id + 1);
+            states.resize(id + 1, TIMELINE_ABSENT);
+        }
+    }
+
+    void removeNode(uint32_t id)
+    {
+        invalidate(id);
+        highDegree.erase(id);
+    }
+
+    // The caller holds id's stripe exclusively.
+    void invalidate(uint32_t id)
+    {
+        if (id < timelines.size())
+        {
+            vector<TimelineItem>().swap(timelines[id]);
+            states[id] = TIMELINE_ABSENT;
+        }
+    }
+
+    // The caller holds id's stripe after changing its friend count. Degrees only drop when a user is deleted,
+    // which runs with the table locked exclusively; the friends of an author dropping back under the limit never
+    // got its posts pushed, so their timelines are rebuilt on next read.
+    void updateDegree(uint32_t id)
+    {
+        bool demoted;
+        {
+            lock_guard<mutex> lock(degreeLock);
+            if (graph.friendsOf(id).size() > fanoutLimit)
+            {
+                highDegree.insert(id);
+                return;
+            }
+            demoted = highDegree.erase(id);
+        }
+        if (demoted)
+        {
+            graph.friendsOf(id).forEach([&](uint32_t friendId)
+                                        { invalidate(friendId); });
+        }
+    }
+
+    // The caller holds both stripes.
+    void onFriendshipAdded(uint32_t a, uint32_t b)
+    {
+        invalidate(a);
+        invalidate(b);
+        updateDegree(a);
+        updateDegree(b);
+    }
+
+    void reset(uint32_t nodeCount)
+    {
+        timelines.assign(nodeCount, vector<TimelineItem>());
+        states.assign(nodeCount, TIMELINE_ABSENT);
+        highDegree.clear();
+        for (uint32_t id = 0; id < nodeCount; id++)
+        {
+            if (users[id].exists() && graph.friendsOf(id).size() > fanoutLimit)
+            {
+                highDegree.insert(id);
+            }
+        }
+    }
+
+    // Called with the author's stripe held right after a post was added. Returns the readers to push it to, which
+    // is done by fanOut once that stripe has been released.
+    vector<uint32_t> fanOutTargets(uint32_t author) const
+    {
+        if (isHighDegree(author))
+        {
+            return vector<uint32_t>();
+        }
+        return graph.getFriendList(author);
+    }
+
+    void fanOut(uint32_t author, uint64_t sequence, const vector<uint32_t> &readers)
+    {
+        for (uint32_t reader : readers)
+        {
+            ExclusiveLock lock(stripes.of(reader));
+            if (states[reader] == TIMELINE_ABSENT)
+            {
+                continue;
+            }
+            // Concurrent posts can finish out of order, so the item goes in by sequence; that is nearly always last.
+            vector<TimelineItem> &items = timelines[reader];
+            vector<TimelineItem>::iterator at = items.end();
+            while (at != items.begin() && (at - 1)->sequence > sequence)
+            {
+                --at;
+            }
+            items.insert(at, TimelineItem{sequence, author});
+            if (items.size() >= 2 * capacity && states[reader] != TIMELINE_BUILDING)
+            {
+                items.erase(items.begin(), items.end() - capacity);
+                states[reader] = TIMELINE_TRUNCATED;
+            }
+        }
+    }
+
+    // Returns up to limit posts older than cursor, newest first; a cursor of 0 starts from the newest post.
+    // nextCursor is set to the value that continues after the last returned post, or 0 when nothing is left.
+    vector<FeedEntry> read(uint32_t viewer, size_t limit, uint64_t cursor, uint64_t &nextCursor)
+    {
+        vector<FeedEntry> page;
+        nextCursor = 0;
+        if (viewer >= timelines.size() || !users[viewer].exists() || limit == 0)
+        {
+            return page;
+        }
+        if (cursor == 0)
+        {
+            cursor = UINT64_MAX;
+        }
+
+        uint8_t state;
+        {
+            SharedLock lock(stripes.of(viewer));
+            state = states[viewer];
+        }
+        if (state == TIMELINE_ABSENT)
+        {
+            materialize(viewer);
+        }
+
+        // The reader's own timeline comes first; high-degree authors are always read directly, and so is every
+        // other friend once a truncated timeline runs out.
+        size_t batchSize = max<size_t>(limit, 16);
+        uint64_t fallbackBelow = cursor;
+        bool fallback = false;
+        vector<FeedStream> streams;
+        streams.push_back(FeedStream{OWN_TIMELINE, cursor, vector<TimelineItem>(), 0, false});
+        for (uint32_t author : highDegreeFriendsOf(viewer))
+        {
+            streams.push_back(FeedStream{author, cursor, vector<TimelineItem>(), 0, false});
+        }
+
+        priority_queue<StreamHead> heap;
+        size_t primed = streams.size();
+        for (size_t i = 0; i < primed; i++)
+        {
+            fallback |= refill(streams[i], viewer, batchSize, fallbackBelow);
+            if (!streams[i].batch.empty())
+            {
+                heap.push(StreamHead{streams[i].batch[0].sequence, i});
+            }
+        }
+
+        uint64_t lastSequence = 0;
+        while (page.size() < limit)
+        {
+            if (fallback)
+            {
+                fallback = false;
+                for (uint32_t author : ordinaryFriendsOf(viewer))
+                {
+                    streams.push_back(FeedStream{author, fallbackBelow, vector<TimelineItem>(), 0, false});
+                    refill(streams.back(), viewer, batchSize, fallbackBelow);
+                    if (!streams.back().batch.empty())
+                    {
+                        heap.push(StreamHead{streams.back().batch[0].sequence, streams.size() - 1});
+                    }
+                }
+            }
+            if (heap.empty())
+            {
+                break;
+            }
+
+            StreamHead head = heap.top();
+            heap.pop();
+            FeedStream &stream = streams[head.stream];
+            TimelineItem item = stream.batch[stream.next++];
+            if (stream.next == stream.batch.size() && !stream.drained)
+            {
+                fallback |= refill(stream, viewer, batchSize, fallbackBelow);
+            }
+            if (stream.next < stream.batch.size())
+            {
+                heap.push(StreamHead{stream.batch[stream.next].sequence, head.stream});
+            }
+
+            if (item.sequence == lastSequence)
+            {
+                continue;
+            }
+            lastSequence = item.sequence;
+
+            SharedLock lock(stripes.of(item.author));
+            const UserProfile *profile = users[item.author].getProfile();
+            int index = profile != nullptr && graph.canSeePosts(item.author, viewer) ? profile->findPost(item.sequence) : -1;
+            if (index >= 0)
+            {
+                page.push_back(FeedEntry{item.author, item.sequence,
+                                         profile->getPost(index), profile->getLikes(index)});
+            }
+        }
+
+        if (page.size() == limit && (!heap.empty() || fallback))
+        {
+            nextCursor = page.back().sequence;
+        }
+        return page;
+    }
+};
+
+// Counts the IDs two ascending, duplicate-free lists have in common. With SSE2 four IDs of each list are compared
+// against each other at once; whichever block ends lower is then advanced, so every match is seen exactly once.
+static size_t countCommon(const uint32_t *a, size_t aLength, const uint32_t *b, size_t bLength)
+{
+    size_t i = 0, j = 0, common = 0;
+#ifdef __SSE2__
+    while (i + 4 <= aLength && j + 4 <= bLength)
+    {
+        __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+        __m128i matches = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(left, right),
+                                                    _mm_cmpeq_epi32(left, _mm_shuffle_epi32(right, 0x39))),
+                                       _mm_or_si128(_mm_cmpeq_epi32(left, _mm_shuffle_epi32(right, 0x4E)),
+                                                    _mm_cmpeq_epi32(left, _mm_shuffle_epi32(right, 0x93))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(matches));
+        common += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+        uint32_t leftLast = a[i + 3];
+        uint32_t rightLast = b[j + 3];
+        if (leftLast <= rightLast)
+        {
+            i += 4;
+        }
+        if (rightLast <= leftLast)
+        {
+            j += 4;
+        }
+    }
+#endif
+    while (i < aLength && j < bLength)
+    {
+        if (a[i] < b[j])
+        {
+            i++;
+        }
+        else if (b[j] < a[i])
+        {
+            j++;
+        }
+        else
+        {
+            common++;
+            i++;
+            j++;
+        }
+    }
+    return common;
+}
+
+struct Recommendation
+{
+    uint32_t id;
+    uint32_t mutualFriends;
+};
+
+// Ranks friends of friends by how many friends they share with the viewer. Mutual counts are set intersections of
+// the viewer's friend list with each candidate's: probes into a bitset of the viewer's friends when that list is
+// dense, probes into the candidate's hash set when it is much larger, sorted-list intersection otherwise. Large
+// neighbourhoods are split across threads by candidate.
+//
+// The top results per viewer are cached until a friendship next to the viewer changes: a new edge a-b can change
+// the suggestions of a, b and every friend of either. Like FeedEngine, no method holds two stripes at once, and
+// cacheLock is only ever taken last.
+class RecommendationEngine
+{
+private:
+    static const size_t WORK_PER_THREAD = 1 << 16;
+
+    const FriendGraph &graph;
+    const LockStripes &stripes;
+    mutable mutex cacheLock;
+    vector<vector<Recommendation>> cached;
+    vector<uint8_t> cachedComplete;
+    vector<uint32_t> versions;
+    vector<uint8_t> present;
+
+    vector<uint32_t> sortedFriendsOf(uint32_t id) const
+    {
+        SharedLock lock(stripes.of(id));
+        return graph.getFriendList(id);
+    }
+
+    // Friends of friends who are neither the viewer nor already friends, ascending. work is the length of the walk,
+    // which is also about what counting the mutual friends of all candidates will cost.
+    vector<uint32_t> candidatesOf(uint32_t viewer, const vector<uint32_t> &friends, size_t &work) const
+    {
+        vector<uint32_t> candidates;
+        for (uint32_t friendId : friends)
+        {
+            SharedLock lock(stripes.of(friendId));
+            graph.friendsOf(friendId).forEach([&](uint32_t id)
+                                              { candidates.push_back(id); });
+        }
+        work = candidates.size();
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+        vector<uint32_t> excluded(friends);
+        excluded.insert(lower_bound(excluded.begin(), excluded.end(), viewer), viewer);
+        vector<uint32_t> remaining;
+        set_difference(candidates.begin(), candidates.end(), excluded.begin(), excluded.end(), back_inserter(remaining));
+
+        return remaining;
+    }
+
+    void countMutual(const vector<uint32_t> &friends, const vector<uint64_t> &bitset, const vector<uint32_t> &candidates,
+                     size_t begin, size_t end, vector<uint32_t> &mutual) const
+    {
+        vector<uint32_t> theirs;
+        for (size_t i = begin; i < end; i++)
+        {
+            uint32_t candidate = candidates[i];
+            SharedLock lock(stripes.of(candidate));
+            const IdSet &candidateFriends = graph.friendsOf(candidate);
+            uint32_t common = 0;
+            if (!bitset.empty())
+            {
+                candidateFriends.forEach([&](uint32_t id)
+                                         { common += (bitset[id >> 6] >> (id & 63)) & 1; });
+            }
+            else if (candidateFriends.size() > friends.size() * 8)
+            {
+                for (uint32_t id : friends)
+                {
+                    common += candidateFriends.contains(id);
+                }
+            }
+            else
+            {
+                theirs = candidateFriends.toSortedVector();
+                common = static_cast<uint32_t>(countCommon(friends.data(), friends.size(), theirs.data(), theirs.size()));
+            }
+            mutual[i] = common;
+        }
+    }
+
+    vector<Recommendation> compute(uint32_t viewer, uint32_t idLimit, size_t limit, bool &complete) const
+    {
+        vector<uint32_t> friends = sortedFriendsOf(viewer);
+        size_t work;
+        vector<uint32_t> candidates = candidatesOf(viewer, friends, work);
+
+        // A bitset costs idLimit / 8 bytes to clear but answers each probe in one load; it pays off once the viewer
+        // has about one friend per 256 users.
+        vector<uint64_t> bitset;
+        if (friends.size() * 256 >= idLimit)
+        {
+            bitset.assign((idLimit + 63) / 64, 0);
+            for (uint32_t id : friends)
+            {
+                if (id < idLimit)
+                {
+                    bitset[id >> 6] |= uint64_t(1) << (id & 63);
+                }
+            }
+        }
+
+        vector<uint32_t> mutual(candidates.size(), 0);
+        unsigned threadCount = static_cast<unsigned>(min<size_t>(max(1u, thread::hardware_concurrency()), work / WORK_PER_THREAD + 1));
+        if (threadCount <= 1)
+        {
+            countMutual(friends, bitset, candidates, 0, candidates.size(), mutual);
+        }
+        else
+        {
+            vector<thread> workers;
+            for (unsigned t = 0; t < threadCount; t++)
+            {
+                size_t begin = candidates.size() * t / threadCount;
+                size_t end = candidates.size() * (t + 1) / threadCount;
+                workers.emplace_back([&, begin, end]()
+                                     { countMutual(friends, bitset, candidates, begin, end, mutual); });
+            }
+            for (thread &worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        vector<Recommendation> ranked;
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (mutual[i] > 0)
+            {
+                ranked.push_back(Recommendation{candidates[i], mutual[i]});
+            }
+        }
+        complete = ranked.size() <= limit;
+        size_t kept = min(limit, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + kept, ranked.end(),
+                     [](const Recommendation &left, const Recommendation &right)
+                     {
+                         return left.mutualFriends != right.mutualFriends ? left.mutualFriends > right.mutualFriends : left.id < right.id;
+                     });
+        ranked.resize(kept);
+        return ranked;
+    }
+
+    // The caller holds cacheLock.
+    void invalidateLocked(uint32_t id)
+    {
+        if (id < versions.size())
+        {
+            versions[id]++;
+            present[id] = false;
+            vector<Recommendation>().swap(cached[id]);
+        }
+    }
+
+public:
+    size_t cacheDepth;
+
+    RecommendationEngine(const FriendGraph &friendGraph, const LockStripes &userStripes)
+        : graph(friendGraph), stripes(userStripes)
+    {
+        cacheDepth = 50;
+    }
+
+    // Needs the user table exclusively, as does reset.
+    void addNode(uint32_t id)
+    {
+        if (id >= cached.size())
+        {
+            cached.resize(id + 1);
+            cachedComplete.resize(id + 1, false);
+            versions.resize(id + 1, 0);
+            present.resize(id + 1, false);
+        }
+    }
+
+    void reset(uint32_t nodeCount)
+    {
+        lock_guard<mutex> lock(cacheLock);
+        cached.assign(nodeCount, vector<Recommendation>());
+        cachedComplete.assign(nodeCount, false);
+        present.assign(nodeCount, false);
+        versions.resize(nodeCount, 0);
+        for (uint32_t &version : versions)
+        {
+            version++;
+        }
+    }
+
+    // Called before a user's friendships are removed; anyone whose suggestions could name the user or count them
+    // as a mutual friend is at most two hops away.
+    void removeNode(uint32_t id)
+    {
+        lock_guard<mutex> lock(cacheLock);
+        invalidateLocked(id);
+        graph.friendsOf(id).forEach([&](uint32_t friendId)
+                                    {
+                                        invalidateLocked(friendId);
+                                        graph.friendsOf(friendId).forEach([&](uint32_t other)
+                                                                          { invalidateLocked(other); });
+                                    });
+    }
+
+    // The caller holds both stripes, with the edge already added or removed.
+    void onFriendshipChanged(uint32_t a, uint32_t b)
+    {
+        lock_guard<mutex> lock(cacheLock);
+        invalidateLocked(a);
+        invalidateLocked(b);
+        for (uint32_t id : {a, b})
+        {
+            graph.friendsOf(id).forEach([&](uint32_t friendId)
+                                        { invalidateLocked(friendId); });
+        }
+    }
+
+    // The same as onFriendshipChanged(a, b) for every b, after all the edges were added, visiting a's friends once.
+    void onFriendshipsAdded(uint32_t a, const vector<uint32_t> &others)
+    {
+        lock_guard<mutex> lock(cacheLock);
+        invalidateLocked(a);
+        graph.friendsOf(a).forEach([&](uint32_t friendId)
+                                   { invalidateLocked(friendId); });
+        for (uint32_t b : others)
+        {
+            graph.friendsOf(b).forEach([&](uint32_t friendId)
+                                       { invalidateLocked(friendId); });
+        }
+    }
+
+    vector<Recommendation> recommend(uint32_t viewer, size_t limit)
+    {
+        uint32_t version;
+        uint32_t idLimit;
+        {
+            lock_guard<mutex> lock(cacheLock);
+            if (present[viewer] && (limit <= cached[viewer].size() || cachedComplete[viewer]))
+            {
+                const vector<Recommendation> &hit = cached[viewer];
+                return vector<Recommendation>(hit.begin(), hit.begin() + min(limit, hit.size()));
+            }
+            version = versions[viewer];
+            idLimit = static_cast<uint32_t>(versions.size());
+        }
+
+        bool complete;
+        vector<Recommendation> ranked = compute(viewer, idLimit, max(limit, cacheDepth), complete);
+
+        // A friendship that changed while computing bumped the version, and the stale result is not kept.
+        lock_guard<mutex> lock(cacheLock);
+        if (versions[viewer] == version)
+        {
+            cached[viewer] = ranked;
+            cachedComplete[viewer] = complete;
+            present[viewer] = true;
+        }
+        if (ranked.size() > limit)
+        {
+            ranked.resize(limit);
+        }
+        return ranked;
+    }
+};
+
+const size_t RecommendationEngine::WORK_PER_THREAD;
+
+// Runs body(t) for t below threadCount, on the calling thread alone when there is one.
+template <typename Body>
+static void inParallel(unsigned threadCount, Body body)
+{
+    if (threadCount <= 1)
+    {
+        body(0u);
+        return;
+    }
+    vector<thread> workers;
+    for (unsigned t = 0; t < threadCount; t++)
+    {
+        workers.emplace_back([&body, t]()
+                             { body(t); });
+    }
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// Hands out [begin, end) chunks of 0..count to the threads as they finish the previous one, so a few expensive
+// items do not leave the other threads idle.
+template <typename Body>
+static void parallelChunks(unsigned threadCount, size_t count, size_t chunk, Body body)
+{
+    atomic<size_t> next(0);
+    inParallel(threadCount, [&](unsigned t)
+               {
+                   for (size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk))
+                   {
+                       body(t, begin, min(count, begin + chunk));
+                   }
+               });
+}
+
+// Shortest friendship paths by bidirectional BFS. Each step grows the side with the smaller frontier: top-down from
+// the frontier while it is small, and bottom-up, with every unvisited user looking for a friend in the frontier, once
+// the frontier holds more than 1/14 of the users that side has not reached (Beamer's rule, counted in users so the
+// average degree cancels out). Visited sets are bitmaps, and each level is kept as a sorted ID list so the path can
+// be walked back without a parent entry per user. Steps with enough work are split across threads.
+//
+// Locking: adjacency is read with one user's stripe held shared at a time, so while friendships change the result
+// is a path whose edges each existed when read. Callers hold the user table at least shared.
+class PathFinder
+{
+private:
+    static const size_t USERS_PER_THREAD = 1 << 12;
+    static const uint32_t NONE = 0xFFFFFFFF;
+    static const size_t BOTTOM_UP_RATIO = 14;
+
+    struct Side
+    {
+        unique_ptr<atomic<uint64_t>[]> visited;
+        vector<vector<uint32_t>> levels;
+        size_t visitedCount;
+
+        Side(uint32_t idLimit, uint32_t start) : visited(new atomic<uint64_t>[(idLimit + 63) / 64]()), levels(1, vector<uint32_t>(1, start))
+        {
+            visited[start >> 6].store(uint64_t(1) << (start & 63), memory_order_relaxed);
+            visitedCount = 1;
+        }
+
+        bool contains(uint32_t id) const
+        {
+            return (visited[id >> 6].load(memory_order_relaxed) >> (id & 63)) & 1;
+        }
+
+        // True for the one thread that marks the user first.
+        bool claim(uint32_t id)
+        {
+            uint64_t bit = uint64_t(1) << (id & 63);
+            return (visited[id >> 6].fetch_or(bit, memory_order_relaxed) & bit) == 0;
+        }
+
+        size_t levelOf(uint32_t id) const
+        {
+            size_t level = levels.size();
+            while (level > 0 && !binary_search(levels[level - 1].begin(), levels[level - 1].end(), id))
+            {
+                level--;
+            }
+            return level - 1;
+        }
+    };
+
+    const FriendGraph &graph;
+    const LockStripes &stripes;
+
+    static unsigned threadsFor(size_t users)
+    {
+        return static_cast<unsigned>(min<size_t>(max(1u, thread::hardware_concurrency()), users / USERS_PER_THREAD + 1));
+    }
+
+    // Adds a newly claimed user to the next level and remembers the first one the other side has reached too.
+    static void reach(const Side &other, uint32_t id, vector<uint32_t> &found, atomic<uint32_t> &meet)
+    {
+        found.push_back(id);
+        uint32_t none = NONE;
+        if (other.contains(id))
+        {
+            meet.compare_exchange_strong(none, id);
+        }
+    }
+
+    void expandTopDown(Side &side, const Side &other, uint32_t idLimit, vector<vector<uint32_t>> &found, atomic<uint32_t> &meet) const
+    {
+        const vector<uint32_t> &frontier = side.levels.back();
+        unsigned threadCount = static_cast<unsigned>(found.size());
+        inParallel(threadCount, [&](unsigned t)
+                   {
+                       size_t end = frontier.size() * (t + 1) / threadCount;
+                       for (size_t i = frontier.size() * t / threadCount; i < end; i++)
+                       {
+                           SharedLock lock(stripes.of(frontier[i]));
+                           graph.friendsOf(frontier[i]).forEach([&](uint32_t friendId)
+                                                                {
+                                                                    if (friendId < idLimit && side.claim(friendId))
+                                                                    {
+                                                                        reach(other, friendId, found[t], meet);
+                                                                    }
+                                                                });
+                       }
+                   });
+    }
+
+    // Each thread takes whole stripes, so a step locks every stripe once instead of every user.
+    void expandBottomUp(Side &side, const Side &other, uint32_t idLimit, vector<vector<uint32_t>> &found, atomic<uint32_t> &meet) const
+    {
+        vector<uint64_t> frontier((idLimit + 63) / 64, 0);
+        for (uint32_t id : side.levels.back())
+        {
+            frontier[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+        unsigned threadCount = static_cast<unsigned>(found.size());
+        inParallel(threadCount, [&](unsigned t)
+                   {
+                       for (uint32_t stripe = t; stripe < LockStripes::COUNT; stripe += threadCount)
+                       {
+                           SharedLock lock(stripes.of(stripe));
+                           for (uint32_t id = stripe; id < idLimit; id += LockStripes::COUNT)
+                           {
+                               if (!side.contains(id) && graph.friendsOf(id).any([&](uint32_t friendId)
+                                                                                 { return friendId < idLimit && ((frontier[friendId >> 6] >> (friendId & 63)) & 1); }))
+                               {
+                                   side.claim(id);
+                                   reach(other, id, found[t], meet);
+                               }
+                           }
+                       }
+                   });
+    }
+
+    // The path from the side's start to a user on the given level, start first; empty if an edge on the way is gone.
+    vector<uint32_t> walkBack(const Side &side, size_t level, uint32_t id) const
+    {
+        vector<uint32_t> path(1, id);
+        while (level > 0)
+        {
+            const vector<uint32_t> &previous = side.levels[--level];
+            uint32_t parent = NONE;
+            {
+                SharedLock lock(stripes.of(id));
+                graph.friendsOf(id).any([&](uint32_t friendId)
+                                        {
+                                            bool found = binary_search(previous.begin(), previous.end(), friendId);
+                                            parent = found ? friendId : NONE;
+                                            return found;
+                                        });
+            }
+            if (parent == NONE)
+            {
+                return vector<uint32_t>();
+            }
+            path.push_back(parent);
+            id = parent;
+        }
+        reverse(path.begin(), path.end());
+        return path;
+    }
+
+public:
+    PathFinder(const FriendGraph &friendGraph, const LockStripes &lockStripes) : graph(friendGraph), stripes(lockStripes)
+    {
+    }
+
+    // The users on a shortest path from one user to another, both included; empty when they are not connected.
+    vector<uint32_t> shortestPath(uint32_t from, uint32_t to, uint32_t idLimit) const
+    {
+        if (from == to)
+        {
+            return vector<uint32_t>(1, from);
+        }
+
+        Side sides[2] = {Side(idLimit, from), Side(idLimit, to)};
+        while (true)
+        {
+            size_t grown = sides[0].levels.back().size() <= sides[1].levels.back().size() ? 0 : 1;
+            Side &side = sides[grown];
+            const Side &other = sides[1 - grown];
+            size_t frontierSize = side.levels.back().size();
+            bool bottomUp = frontierSize * BOTTOM_UP_RATIO > idLimit - side.visitedCount;
+
+            atomic<uint32_t> meet(NONE);
+            vector<vector<uint32_t>> found(threadsFor(bottomUp ? idLimit : frontierSize));
+            if (bottomUp)
+            {
+                expandBottomUp(side, other, idLimit, found, meet);
+            }
+            else
+            {
+                expandTopDown(side, other, idLimit, found, meet);
+            }
+
+            vector<uint32_t> next;
+            for (const vector<uint32_t> &part : found)
+            {
+                next.insert(next.end(), part.begin(), part.end());
+            }
+            if (next.empty())
+            {
+                return vector<uint32_t>();
+            }
+            sort(next.begin(), next.end());
+            side.visitedCount += next.size();
+            side.levels.push_back(move(next));
+
+            uint32_t middle = meet.load();
+            if (middle != NONE)
+            {
+                vector<uint32_t> head = walkBack(side, side.levels.size() - 1, middle);
+                vector<uint32_t> tail = walkBack(other, other.levelOf(middle), middle);
+                if (head.empty() || tail.empty())
+                {
+                    return vector<uint32_t>();
+                }
+                tail.pop_back();
+                head.insert(head.end(), tail.rbegin(), tail.rend());
+                if (grown == 1)
+                {
+                    reverse(head.begin(), head.end());
+                }
+                return head;
+            }
+        }
+    }
+};
+
+const size_t PathFinder::USERS_PER_THREAD;
+const uint32_t PathFinder::NONE;
+const size_t PathFinder::BOTTOM_UP_RATIO;
+
+// Cluster structure of the whole friend graph. Labels are user IDs: a component is named by its lowest user ID,
+// a community by the user whose label won. IDs without a user get NONE and are not counted.
+struct ClusterReport
+{
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    vector<uint32_t> component;
+    vector<uint32_t> community;
+    vector<uint32_t> componentSize;
+    vector<uint32_t> communitySize;
+    size_t componentCount;
+    size_t communityCount;
+    size_t rounds;
+};
+
+const uint32_t ClusterReport::NONE;
+
+struct ClusterSummary
+{
+    size_t componentCount;
+    size_t communityCount;
+    size_t rounds;
+    // (label, size), largest first.
+    vector<pair<uint32_t, uint32_t>> largestComponents;
+    vector<pair<uint32_t, uint32_t>> largestCommunities;
+};
+
+// The labels with the most members as (label, size), largest first and lowest label on ties.
+static vector<pair<uint32_t, uint32_t>> largestClusters(const vector<uint32_t> &sizes, size_t limit)
+{
+    vector<pair<uint32_t, uint32_t>> ranked;
+    for (uint32_t label = 0; label < sizes.size(); label++)
+    {
+        if (sizes[label] > 0)
+        {
+            ranked.push_back(make_pair(label, sizes[label]));
+        }
+    }
+    size_t keep = min(limit, ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(), [](const pair<uint32_t, uint32_t> &a, const pair<uint32_t, uint32_t> &b)
+                 { return a.second != b.second ? a.second > b.second : a.first < b.first; });
+    ranked.resize(keep);
+    return ranked;
+}
+
+// Connected components by Afforest: every user is first linked to a couple of its friends, which already joins
+// most of the giant component, then only users outside the most common component link the rest of their friends.
+// Links are lock-free hooks of the higher root under the lower one, so a component ends up named by its lowest ID.
+// Communities come from label propagation: each round every user takes the label most common among itself and its
+// friends, the lowest on ties, until almost nothing changes. Both run over a CSR copy of the graph on all cores.
+class GraphAnalytics
+{
+public:
+    struct Csr
+    {
+        vector<uint64_t> offsets;
+        vector<uint32_t> targets;
+    };
+
+private:
+    static const size_t SAMPLE_ROUNDS = 2;
+    static const size_t SAMPLE_SIZE = 1024;
+    static const size_t MAX_ROUNDS = 20;
+    static const size_t CHUNK = 1 << 12;
+
+    const FriendGraph &graph;
+    const LockStripes &stripes;
+
+    static unsigned threadCount()
+    {
+        return max(1u, thread::hardware_concurrency());
+    }
+
+    static void link(atomic<uint32_t> *parent, uint32_t u, uint32_t v)
+    {
+        uint32_t first = parent[u].load(memory_order_relaxed);
+        uint32_t second = parent[v].load(memory_order_relaxed);
+        while (first != second)
+        {
+            uint32_t high = max(first, second);
+            uint32_t low = min(first, second);
+            uint32_t highParent = parent[high].load(memory_order_relaxed);
+            if (highParent == low || (highParent == high && parent[high].compare_exchange_strong(highParent, low)))
+            {
+                return;
+            }
+            first = parent[parent[high].load(memory_order_relaxed)].load(memory_order_relaxed);
+            second = parent[low].load(memory_order_relaxed);
+        }
+    }
+
+    static void compress(atomic<uint32_t> *parent, uint32_t idLimit)
+    {
+        parallelChunks(threadCount(), idLimit, CHUNK, [&](unsigned, size_t begin, size_t end)
+                       {
+                           for (size_t n = begin; n < end; n++)
+                           {
+                               uint32_t up = parent[n].load(memory_order_relaxed);
+                               uint32_t top = parent[up].load(memory_order_relaxed);
+                               while (up != top)
+                               {
+                                   parent[n].store(top, memory_order_relaxed);
+                                   up = top;
+                                   top = parent[up].load(memory_order_relaxed);
+                               }
+                           }
+                       });
+    }
+
+    static vector<uint32_t> components(const Csr &csr, uint32_t idLimit)
+    {
+        unique_ptr<atomic<uint32_t>[]> parent(new atomic<uint32_t>[idLimit]);
+        parallelChunks(threadCount(), idLimit, CHUNK, [&](unsigned, size_t begin, size_t end)
+                       {
+                           for (size_t n = begin; n < end; n++)
+                           {
+                               parent[n].store(static_cast<uint32_t>(n), memory_order_relaxed);
+                           }
+                       });
+
+        for (size_t round = 0; round < SAMPLE_ROUNDS; round++)
+        {
+            parallelChunks(threadCount(), idLimit, CHUNK, [&](unsigned, size_t begin, size_t end)
+                           {
+                               for (size_t n = begin; n < end; n++)
+                               {
+                                   if (csr.offsets[n] + round < csr.offsets[n + 1])
+                                   {
+                                       link(parent.get(), static_cast<uint32_t>(n), csr.targets[csr.offsets[n] + round]);
+                                   }
+                               }
+                           });
+            compress(parent.get(), idLimit);
+        }
+
+        // The most common root among a sample is almost surely the giant component, whose users can skip the rest.
+        uint32_t frequent = ClusterReport::NONE;
+        if (idLimit > 0)
+        {
+            mt19937 random(idLimit);
+            unordered_map<uint32_t, size_t> seen;
+            size_t best = 0;
+            for (size_t i = 0; i < SAMPLE_SIZE; i++)
+            {
+                uint32_t root = parent[random() % idLimit].load(memory_order_relaxed);
+                if (++seen[root] > best)
+                {
+                    best = seen[root];
+                    frequent = root;
+                }
+            }
+        }
+
+        parallelChunks(threadCount(), idLimit, CHUNK, [&](unsigned, size_t begin, size_t end)
+                       {
+                           for (size_t n = begin; n < end; n++)
+                           {
+                               if (parent[n].load(memory_order_relaxed) == frequent)
+                               {
+                                   continue;
+                               }
+                               for (uint64_t i = csr.offsets[n] + SAMPLE_ROUNDS; i < csr.offsets[n + 1]; i++)
+                               {
+                                   link(parent.get(), static_cast<uint32_t>(n), csr.targets[i]);
+                               }
+                           }
+                       });
+        compress(parent.get(), idLimit);
+
+        vector<uint32_t> labels(idLimit);
+        for (uint32_t n = 0; n < idLimit; n++)
+        {
+            labels[n] = parent[n].load(memory_order_relaxed);
+        }
+        return labels;
+    }
+
+    static vector<uint32_t> communities(const Csr &csr, uint32_t idLimit, size_t &rounds)
+    {
+        vector<uint32_t> labels(idLimit), next(idLimit);
+        for (uint32_t n = 0; n < idLimit; n++)
+        {
+            labels[n] = n;
+        }
+
+        unsigned threads = threadCount();
+        vector<vector<uint32_t>> scratch(threads);
+        for (rounds = 1; rounds <= MAX_ROUNDS; rounds++)
+        {
+            vector<size_t> changed(threads, 0);
+            parallelChunks(threads, idLimit, CHUNK, [&](unsigned t, size_t begin, size_t end)
+                           {
+                               vector<uint32_t> &seen = scratch[t];
+                               for (size_t n = begin; n < end; n++)
+                               {
+                                   seen.assign(1, labels[n]);
+                                   for (uint64_t i = csr.offsets[n]; i < csr.offsets[n + 1]; i++)
+                                   {
+                                       seen.push_back(labels[csr.targets[i]]);
+                                   }
+                                   sort(seen.begin(), seen.end());
+                                   uint32_t best = labels[n];
+                                   size_t bestCount = 0;
+                                   for (size_t i = 0; i < seen.size();)
+                                   {
+                                       size_t j = i;
+                                       while (j < seen.size() && seen[j] == seen[i])
+                                       {
+                                           j++;
+                                       }
+                                       if (j - i > bestCount)
+                                       {
+                                           best = seen[i];
+                                           bestCount = j - i;
+                                       }
+                                       i = j;
+                                   }
+                                   next[n] = best;
+                                   changed[t] += best != labels[n];
+                               }
+                           });
+            labels.swap(next);
+
+            size_t total = 0;
+            for (size_t count : changed)
+            {
+                total += count;
+            }
+            if (total * 1000 <= idLimit)
+            {
+                break;
+            }
+        }
+        rounds = min(rounds, MAX_ROUNDS);
+        return labels;
+    }
+
+    static void countLabels(const vector<uint32_t> &labels, const vector<uint8_t> &present, vector<uint32_t> &label,
+                            vector<uint32_t> &sizes, size_t &count)
+    {
+        label = labels;
+        sizes.assign(labels.size(), 0);
+        count = 0;
+        for (size_t n = 0; n < labels.size(); n++)
+        {
+            if (!present[n])
+            {
+                label[n] = ClusterReport::NONE;
+                continue;
+            }
+            count += sizes[labels[n]]++ == 0;
+        }
+    }
+
+public:
+    GraphAnalytics(const FriendGraph &friendGraph, const LockStripes &lockStripes) : graph(friendGraph), stripes(lockStripes)
+    {
+    }
+
+    // Copies the adjacency with one stripe held shared at a time, each thread taking whole stripes. A friendship
+    // that changes meanwhile may be copied in one direction only, which neither algorithm minds. Callers hold the
+    // user table at least shared.
+    Csr copyGraph(uint32_t idLimit) const
+    {
+        unsigned threads = min<unsigned>(threadCount(), LockStripes::COUNT);
+        vector<vector<uint32_t>> parts(threads);
+        Csr csr;
+        csr.offsets.assign(static_cast<size_t>(idLimit) + 1, 0);
+        inParallel(threads, [&](unsigned t)
+                   {
+                       for (uint32_t stripe = t; stripe < LockStripes::COUNT; stripe += threads)
+                       {
+                           SharedLock lock(stripes.of(stripe));
+                           for (uint32_t id = stripe; id < idLimit; id += LockStripes::COUNT)
+                           {
+                               size_t before = parts[t].size();
+                               graph.friendsOf(id).forEach([&](uint32_t friendId)
+                                                           {
+                                                               if (friendId < idLimit)
+                                                               {
+                                                                   parts[t].push_back(friendId);
+                                                               }
+                                                           });
+                               csr.offsets[id + 1] = parts[t].size() - before;
+                           }
+                       }
+                   });
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            csr.offsets[id + 1] += csr.offsets[id];
+        }
+
+        csr.targets.resize(csr.offsets[idLimit]);
+        inParallel(threads, [&](unsigned t)
+                   {
+                       size_t read = 0;
+                       for (uint32_t stripe = t; stripe < LockStripes::COUNT; stripe += threads)
+                       {
+                           for (uint32_t id = stripe; id < idLimit; id += LockStripes::COUNT)
+                           {
+                               size_t length = csr.offsets[id + 1] - csr.offsets[id];
+                               copy(parts[t].begin() + read, parts[t].begin() + read + length, csr.targets.begin() + csr.offsets[id]);
+                               read += length;
+                           }
+                       }
+                       vector<uint32_t>().swap(parts[t]);
+                   });
+        return csr;
+    }
+
+    // present[id] tells which IDs of the copy have a user.
+    static unique_ptr<ClusterReport> analyze(const Csr &csr, const vector<uint8_t> &present)
+    {
+        uint32_t idLimit = static_cast<uint32_t>(present.size());
+        unique_ptr<ClusterReport> report(new ClusterReport());
+        countLabels(components(csr, idLimit), present, report->component, report->componentSize, report->componentCount);
+        countLabels(communities(csr, idLimit, report->rounds), present, report->community, report->communitySize, report->communityCount);
+        return report;
+    }
+};
+
+const size_t GraphAnalytics::SAMPLE_ROUNDS;
+const size_t GraphAnalytics::SAMPLE_SIZE;
+const size_t GraphAnalytics::MAX_ROUNDS;
+const size_t GraphAnalytics::CHUNK;
+
+struct TrendingPost
+{
+    uint64_t sequence;
+    uint32_t author;
+    uint32_t recentLikes;
+};
+
+// Popular posts from the stream of like events, in memory that stays the same however many posts there are. The
+// likes of each twelfth of the window go into a count-min sketch of their own, and a running sum of those sketches
+// estimates how often any post was liked lately; when the window moves on, the oldest sketch is subtracted from the
+// sum and cleared. Two bounded heaps keep the best CAPACITY posts seen so far: one by recent likes, rescored as the
+// window moves, and one by the total like counts the caller passes in. A post pushed out of a heap only comes back
+// with its next like, so both rankings are those of the stream rather than of a scan over every post.
+//
+// An unlike takes a like back out of the current sketch. If that like has already left the window the counters end
+// up one low, so estimates are clamped at zero.
+//
+// Locking: the tracker has its own lock, taken last.
+class TrendingTracker
+{
+public:
+    static const size_t CAPACITY = 100;
+
+private:
+    static const size_t DEPTH = 4;
+    static const size_t WIDTH_BITS = 11;
+    static const size_t WIDTH = size_t(1) << WIDTH_BITS;
+    static const size_t BUCKETS = 12;
+
+    // The highest-scoring posts, lowest on top, with the position of each so that its score can change in place.
+    class TopPosts
+    {
+    public:
+        struct Entry
+        {
+            uint64_t sequence;
+            uint32_t author;
+            int64_t score;
+        };
+
+    private:
+        vector<Entry> heap;
+        unordered_map<uint64_t, size_t> positions;
+
+        static bool lower(const Entry &a, const Entry &b)
+        {
+            return a.score != b.score ? a.score < b.score : a.sequence < b.sequence;
+        }
+
+        void siftUp(size_t i)
+        {
+            Entry entry = heap[i];
+            while (i > 0 && lower(entry, heap[(i - 1) / 2]))
+            {
+                heap[i] = heap[(i - 1) / 2];
+                positions[heap[i].sequence] = i;
+                i = (i - 1) / 2;
+            }
+            heap[i] = entry;
+            positions[entry.sequence] = i;
+        }
+
+        void siftDown(size_t i)
+        {
+            Entry entry = heap[i];
+            for (;;)
+            {
+                size_t child = 2 * i + 1;
+                if (child >= heap.size())
+                {
+                    break;
+                }
+                if (child + 1 < heap.size() && lower(heap[child + 1], heap[child]))
+                {
+                    child++;
+                }
+                if (!lower(heap[child], entry))
+                {
+                    break;
+                }
+                heap[i] = heap[child];
+                positions[heap[i].sequence] = i;
+                i = child;
+            }
+            heap[i] = entry;
+            positions[entry.sequence] = i;
+        }
+
+        void removeAt(size_t i)
+        {
+            positions.erase(heap[i].sequence);
+            Entry last = heap.back();
+            heap.pop_back();
+            if (i < heap.size())
+            {
+                heap[i] = last;
+                if (i > 0 && lower(last, heap[(i - 1) / 2]))
+                {
+                    siftUp(i);
+                }
+                else
+                {
+                    siftDown(i);
+                }
+            }
+        }
+
+    public:
+        // Sets the score of a post, taking it in if it beats the lowest one kept. Posts without a positive score
+        // drop out.
+        void update(uint64_t sequence, uint32_t author, int64_t score)
+        {
+            unordered_map<uint64_t, size_t>::iterator it = positions.find(sequence);
+            if (it != positions.end())
+            {
+                size_t i = it->second;
+                if (score <= 0)
+                {
+                    removeAt(i);
+                    return;
+                }
+                bool rose = score > heap[i].score;
+                heap[i].score = score;
+                if (rose)
+                {
+                    siftDown(i);
+                }
+                else
+                {
+                    siftUp(i);
+                }
+                return;
+            }
+
+            Entry entry{sequence, author, score};
+            if (score <= 0 || (heap.size() == CAPACITY && !lower(heap.front(), entry)))
+            {
+                return;
+            }
+            if (heap.size() == CAPACITY)
+            {
+                positions.erase(heap.front().sequence);
+                heap.front() = entry;
+                siftDown(0);
+            }
+            else
+            {
+                heap.push_back(entry);
+                siftUp(heap.size() - 1);
+            }
+        }
+
+        void remove(uint64_t sequence)
+        {
+            unordered_map<uint64_t, size_t>::iterator it = positions.find(sequence);
+            if (it != positions.end())
+            {
+                removeAt(it->second);
+            }
+        }
+
+        // Rescores every post at once and heapifies again, dropping those left without a positive score.
+        template <typename Score>
+        void rescore(Score score)
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < heap.size(); i++)
+            {
+                heap[i].score = score(heap[i].sequence);
+                if (heap[i].score > 0)
+                {
+                    heap[kept++] = heap[i];
+                }
+            }
+            heap.resize(kept);
+            positions.clear();
+            for (size_t i = 0; i < heap.size(); i++)
+            {
+                positions[heap[i].sequence] = i;
+            }
+            for (size_t i = heap.size() / 2; i-- > 0;)
+            {
+                siftDown(i);
+            }
+        }
+
+        // The posts kept, best first.
+        vector<Entry> ranked() const
+        {
+            vector<Entry> entries(heap);
+            sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                 { return lower(b, a); });
+            return entries;
+        }
+    };
+
+    chrono::steady_clock::time_point origin;
+    chrono::steady_clock::duration bucketLength;
+    // Bucket lengths from the origin to the current bucket; bucket n is kept at n % BUCKETS.
+    uint64_t currentBucket;
+    // BUCKETS sketches of DEPTH rows of WIDTH counters each, and their sum over the window.
+    vector<int32_t> buckets;
+    vector<int32_t> window;
+    TopPosts recent;
+    TopPosts allTime;
+    mutable mutex lock;
+
+    // Multiply-shift hashing with a multiplier per row; post IDs are sequential, and the high bits of the product
+    // spread them evenly.
+    static size_t cell(size_t row, uint64_t sequence)
+    {
+        static const uint64_t multipliers[DEPTH] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+        return row * WIDTH + static_cast<size_t>((sequence * multipliers[row]) >> (64 - WIDTH_BITS));
+    }
+
+    int64_t estimate(uint64_t sequence) const
+    {
+        int64_t least = INT32_MAX;
+        for (size_t row = 0; row < DEPTH; row++)
+        {
+            least = min<int64_t>(least, window[cell(row, sequence)]);
+        }
+        return max<int64_t>(least, 0);
+    }
+
+    // Moves the window on to now, expiring the buckets that fell out of it.
+    void advance(chrono::steady_clock::time_point now)
+    {
+        uint64_t bucket = now > origin ? static_cast<uint64_t>((now - origin) / bucketLength) : 0;
+        if (bucket <= currentBucket)
+        {
+            return;
+        }
+        uint64_t expired = min<uint64_t>(bucket - currentBucket, BUCKETS);
+        for (uint64_t i = 1; i <= expired; i++)
+        {
+            int32_t *counters = &buckets[((currentBucket + i) % BUCKETS) * DEPTH * WIDTH];
+            for (size_t c = 0; c < DEPTH * WIDTH; c++)
+            {
+                window[c] -= counters[c];
+                counters[c] = 0;
+            }
+        }
+        currentBucket = bucket;
+        recent.rescore([this](uint64_t sequence)
+                       { return estimate(sequence); });
+    }
+
+public:
+    TrendingTracker(chrono::steady_clock::duration windowLength = chrono::hours(1))
+        : origin(chrono::steady_clock::now()), bucketLength(windowLength / BUCKETS), currentBucket(0),
+          buckets(BUCKETS * DEPTH * WIDTH, 0), window(DEPTH * WIDTH, 0)
+    {
+    }
+
+    // A like given, or taken back with liked clear, at now; likes is the post's total afterwards.
+    void record(uint64_t sequence, uint32_t author, bool liked, int likes, chrono::steady_clock::time_point now = chrono::steady_clock::now())
+    {
+        lock_guard<mutex> guard(lock);
+        advance(now);
+        int32_t *counters = &buckets[(currentBucket % BUCKETS) * DEPTH * WIDTH];
+        int32_t delta = liked ? 1 : -1;
+        for (size_t row = 0; row < DEPTH; row++)
+        {
+            size_t c = cell(row, sequence);
+            counters[c] += delta;
+            window[c] += delta;
+        }
+        recent.update(sequence, author, estimate(sequence));
+        allTime.update(sequence, author, likes);
+    }
+
+    // Ranks a post by its total likes only, as when the counts come from storage rather than from like events.
+    void rank(uint64_t sequence, uint32_t author, int likes)
+    {
+        lock_guard<mutex> guard(lock);
+        allTime.update(sequence, author, likes);
+    }
+
+    void forget(uint64_t sequence)
+    {
+        lock_guard<mutex> guard(lock);
+        recent.remove(sequence);
+        allTime.remove(sequence);
+    }
+
+    // Up to limit of the posts liked most within the window, or of all time with allTimeTop set, best first.
+    vector<TrendingPost> top(bool allTimeTop, size_t limit, chrono::steady_clock::time_point now = chrono::steady_clock::now())
+    {
+        lock_guard<mutex> guard(lock);
+        advance(now);
+        vector<TopPosts::Entry> entries = (allTimeTop ? allTime : recent).ranked();
+        vector<TrendingPost> posts;
+        for (size_t i = 0; i < entries.size() && i < limit; i++)
+        {
+            posts.push_back(TrendingPost{entries[i].sequence, entries[i].author, static_cast<uint32_t>(estimate(entries[i].sequence))});
+        }
+        return posts;
+    }
+};
+
+const size_t TrendingTracker::CAPACITY;
+const size_t TrendingTracker::DEPTH;
+const size_t TrendingTracker::WIDTH_BITS;
+const size_t TrendingTracker::WIDTH;
+const size_t TrendingTracker::BUCKETS;
+
+// Full-text search over every post. Each term maps to the ascending sequences of the posts containing it, stored
+// as blocks of varint gaps behind a skip list of block starts, plus a short uncompressed tail for the newest posts.
+// Queries walk the matching sequences newest first; candidates come from the postings and are then checked
+// against the post text itself, which settles phrases, exclusions and posts edited or deleted in the meantime.
+//
+// Query syntax: words must all appear; "quoted words" must appear in order; a OR b accepts either; -word excludes.
+//
+// Locking: the index has its own lock, taken after a stripe by writers. Readers collect candidates under it and
+// release it before taking any stripe to read the posts.
+class PostSearchIndex
+{
+private:
+    static const size_t BLOCK_SIZE = 128;
+    static const size_t MAX_TERM_LENGTH = 64;
+    static const size_t BATCH_SIZE = 64;
+    static const uint32_t NO_AUTHOR = UINT32_MAX;
+
+    struct PostingList
+    {
+        string gaps;
+        vector<uint64_t> blockFirst;
+        vector<uint32_t> blockOffset;
+        vector<uint64_t> tail;
+        uint64_t last;
+    };
+
+    struct QueryNode
+    {
+        enum Kind : uint8_t
+        {
+            TERM,
+            ALL,
+            ANY
+        } kind;
+        const PostingList *list;
+        vector<QueryNode> children;
+        size_t decodedBlock;
+        vector<uint64_t> decoded;
+    };
+
+    // A quoted phrase or a single word, which may itself tokenize into several words.
+    typedef vector<string> QueryItem;
+
+    struct Query
+    {
+        vector<vector<QueryItem>> groups;
+        vector<QueryItem> excluded;
+    };
+
+    const FriendGraph &graph;
+    const vector<User> &users;
+    const LockStripes &stripes;
+    mutable shared_timed_mutex indexLock;
+    unordered_map<string, PostingList> terms;
+    vector<uint32_t> authors;
+    size_t livePostings;
+    size_t deadPostings;
+    bool deferring;
+
+    static void putVarint(string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static uint64_t getVarint(const char *&in)
+    {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            uint8_t byte = static_cast<uint8_t>(*in++);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+    }
+
+    static void decodeBlock(const PostingList &list, size_t block, vector<uint64_t> &out)
+    {
+        out.resize(BLOCK_SIZE);
+        const char *in = list.gaps.data() + list.blockOffset[block];
+        out[0] = list.blockFirst[block];
+        for (size_t i = 1; i < BLOCK_SIZE; i++)
+        {
+            out[i] = out[i - 1] + getVarint(in);
+        }
+    }
+
+    static void encodeBlock(PostingList &list, const uint64_t *entries)
+    {
+        list.blockFirst.push_back(entries[0]);
+        list.blockOffset.push_back(static_cast<uint32_t>(list.gaps.size()));
+        for (size_t i = 1; i < BLOCK_SIZE; i++)
+        {
+            putVarint(list.gaps, entries[i] - entries[i - 1]);
+        }
+    }
+
+    // Re-encodes everything from the given block on, given as a non-empty ascending list; full blocks are
+    // compressed and the rest becomes the tail.
+    static void rewrite(PostingList &list, size_t fromBlock, const vector<uint64_t> &entries)
+    {
+        if (fromBlock < list.blockFirst.size())
+        {
+            list.gaps.resize(list.blockOffset[fromBlock]);
+            list.blockFirst.resize(fromBlock);
+            list.blockOffset.resize(fromBlock);
+        }
+        size_t full = entries.size() / BLOCK_SIZE * BLOCK_SIZE;
+        for (size_t i = 0; i < full; i += BLOCK_SIZE)
+        {
+            encodeBlock(list, &entries[i]);
+        }
+        list.tail.assign(entries.begin() + full, entries.end());
+        list.last = entries.back();
+    }
+
+    static vector<uint64_t> decodeFrom(const PostingList &list, size_t fromBlock)
+    {
+        vector<uint64_t> entries, block;
+        for (size_t b = fromBlock; b < list.blockFirst.size(); b++)
+        {
+            decodeBlock(list, b, block);
+            entries.insert(entries.end(), block.begin(), block.end());
+        }
+        entries.insert(entries.end(), list.tail.begin(), list.tail.end());
+        return entries;
+    }
+
+    static bool append(PostingList &list, uint64_t sequence)
+    {
+        if (sequence > list.last)
+        {
+            list.tail.push_back(sequence);
+            list.last = sequence;
+            if (list.tail.size() == BLOCK_SIZE)
+            {
+                encodeBlock(list, list.tail.data());
+                list.tail.clear();
+            }
+            return true;
+        }
+
+        // Concurrent posts can reach the index slightly out of order.
+        size_t block = upper_bound(list.blockFirst.begin(), list.blockFirst.end(), sequence) - list.blockFirst.begin();
+        block = block > 0 ? block - 1 : 0;
+        vector<uint64_t> entries = decodeFrom(list, block);
+        auto it = lower_bound(entries.begin(), entries.end(), sequence);
+        if (it != entries.end() && *it == sequence)
+        {
+            return false;
+        }
+        entries.insert(it, sequence);
+        rewrite(list, block, entries);
+        return true;
+    }
+
+    // Largest sequence in the list that is at most bound, or 0.
+    static uint64_t seekTerm(QueryNode &node, uint64_t bound)
+    {
+        const PostingList &list = *node.list;
+        if (!list.tail.empty() && list.tail.front() <= bound)
+        {
+            return *(upper_bound(list.tail.begin(), list.tail.end(), bound) - 1);
+        }
+        size_t block = upper_bound(list.blockFirst.begin(), list.blockFirst.end(), bound) - list.blockFirst.begin();
+        if (block == 0)
+        {
+            return 0;
+        }
+        if (node.decodedBlock != block - 1)
+        {
+            decodeBlock(list, block - 1, node.decoded);
+            node.decodedBlock = block - 1;
+        }
+        return *(upper_bound(node.decoded.begin(), node.decoded.end(), bound) - 1);
+    }
+
+    static uint64_t seek(QueryNode &node, uint64_t bound)
+    {
+        if (node.kind == QueryNode::TERM)
+        {
+            return seekTerm(node, bound);
+        }
+        if (node.kind == QueryNode::ANY)
+        {
+            uint64_t best = 0;
+            for (QueryNode &child : node.children)
+            {
+                best = max(best, seek(child, bound));
+            }
+            return best;
+        }
+
+        // Leapfrog: every child has to land on the same sequence.
+        uint64_t candidate = bound;
+        size_t agreed = 0;
+        for (size_t i = 0; agreed < node.children.size(); i = (i + 1) % node.children.size())
+        {
+            uint64_t found = seek(node.children[i], candidate);
+            if (found == 0)
+            {
+                return 0;
+            }
+            agreed = found == candidate ? agreed + 1 : 1;
+            candidate = found;
+        }
+        return candidate;
+    }
+
+    static void resetCursors(QueryNode &node)
+    {
+        node.decodedBlock = SIZE_MAX;
+        for (QueryNode &child : node.children)
+        {
+            resetCursors(child);
+        }
+    }
+
+    static Query parse(const string &text)
+    {
+        Query query;
+        bool joinNext = false;
+        for (size_t i = 0; i < text.size();)
+        {
+            if (isspace(static_cast<unsigned char>(text[i])))
+            {
+                i++;
+                continue;
+            }
+            bool negate = text[i] == '-';
+            if (negate)
+            {
+                i++;
+            }
+            string raw;
+            bool quoted = i < text.size() && text[i] == '"';
+            if (quoted)
+            {
+                size_t close = text.find('"', i + 1);
+                raw = text.substr(i + 1, close == string::npos ? string::npos : close - i - 1);
+                i = close == string::npos ? text.size() : close + 1;
+            }
+            else
+            {
+                size_t end = i;
+                while (end < text.size() && !isspace(static_cast<unsigned char>(text[end])))
+                {
+                    end++;
+                }
+                raw = text.substr(i, end - i);
+                i = end;
+            }
+
+            if (!quoted && !negate && raw == "OR")
+            {
+                joinNext = !query.groups.empty();
+                continue;
+            }
+            QueryItem item;
+            tokenize(raw, item);
+            if (item.empty())
+            {
+                continue;
+            }
+            if (negate)
+            {
+                query.excluded.push_back(item);
+            }
+            else if (joinNext)
+            {
+                query.groups.back().push_back(item);
+            }
+            else
+            {
+                query.groups.push_back(vector<QueryItem>(1, item));
+            }
+            joinNext = false;
+        }
+        return query;
+    }
+
+    static bool contains(const vector<string> &words, const QueryItem &item)
+    {
+        if (item.size() > words.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i + item.size() <= words.size(); i++)
+        {
+            if (equal(item.begin(), item.end(), words.begin() + i))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool matches(const Query &query, const PostText &text)
+    {
+        vector<string> words;
+        tokenize(text.data, text.length, words);
+        for (const vector<QueryItem> &group : query.groups)
+        {
+            if (none_of(group.begin(), group.end(), [&](const QueryItem &item)
+                        { return contains(words, item); }))
+            {
+                return false;
+            }
+        }
+        return none_of(query.excluded.begin(), query.excluded.end(), [&](const QueryItem &item)
+                       { return contains(words, item); });
+    }
+
+    // The caller holds indexLock. Words missing from the index match nothing.
+    QueryNode plan(const Query &query) const
+    {
+        static const PostingList empty = PostingList{string(), vector<uint64_t>(), vector<uint32_t>(), vector<uint64_t>(), 0};
+        QueryNode root{QueryNode::ALL, nullptr, vector<QueryNode>(), SIZE_MAX, vector<uint64_t>()};
+        for (const vector<QueryItem> &group : query.groups)
+        {
+            QueryNode any{QueryNode::ANY, nullptr, vector<QueryNode>(), SIZE_MAX, vector<uint64_t>()};
+            for (const QueryItem &item : group)
+            {
+                QueryNode all{QueryNode::ALL, nullptr, vector<QueryNode>(), SIZE_MAX, vector<uint64_t>()};
+                for (const string &word : item)
+                {
+                    auto it = terms.find(word);
+                    all.children.push_back(QueryNode{QueryNode::TERM, it == terms.end() ? &empty : &it->second,
+                                                     vector<QueryNode>(), SIZE_MAX, vector<uint64_t>()});
+                }
+                any.children.push_back(all);
+            }
+            root.children.push_back(any);
+        }
+        return root;
+    }
+
+    void purge()
+    {
+        vector<uint64_t> kept;
+        for (auto it = terms.begin(); it != terms.end();)
+        {
+            kept.clear();
+            for (uint64_t sequence : decodeFrom(it->second, 0))
+            {
+                if (authors[sequence] != NO_AUTHOR)
+                {
+                    kept.push_back(sequence);
+                }
+            }
+            if (kept.empty())
+            {
+                it = terms.erase(it);
+                continue;
+            }
+            PostingList fresh{string(), vector<uint64_t>(), vector<uint32_t>(), vector<uint64_t>(), 0};
+            rewrite(fresh, 0, kept);
+            it->second.gaps.swap(fresh.gaps);
+            it->second.blockFirst.swap(fresh.blockFirst);
+            it->second.blockOffset.swap(fresh.blockOffset);
+            it->second.tail.swap(fresh.tail);
+            ++it;
+        }
+        livePostings -= deadPostings;
+        deadPostings = 0;
+    }
+
+    size_t addLocked(uint64_t sequence, uint32_t author, const PostText &text)
+    {
+        if (sequence >= authors.size())
+        {
+            authors.resize(sequence + 1, NO_AUTHOR);
+        }
+        authors[sequence] = author;
+
+        vector<string> words;
+        tokenize(text.data, text.length, words);
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+        size_t added = 0;
+        for (const string &word : words)
+        {
+            PostingList &list = terms[word];
+            added += append(list, sequence) ? 1 : 0;
+        }
+        livePostings += added;
+        return added;
+    }
+
+public:
+    // Each query ranks this many of its newest visible matches per requested result.
+    size_t rankWindow;
+    // How many posts newer carry as much weight as doubling the likes.
+    double recencyScale;
+    // Upper bound on candidates read from the postings per query, visible or not.
+    size_t scanLimit;
+
+    PostSearchIndex(const FriendGraph &friendGraph, const vector<User> &allUsers, const LockStripes &userStripes)
+        : graph(friendGraph), users(allUsers), stripes(userStripes)
+    {
+        livePostings = 0;
+        deadPostings = 0;
+        deferring = false;
+        rankWindow = 8;
+        recencyScale = 1000;
+        scanLimit = 200000;
+    }
+
+    // Lower-case runs of ASCII letters and digits; bytes above ASCII are kept as word characters so UTF-8 words
+    // survive intact.
+    static void tokenize(const string &text, vector<string> &words)
+    {
+        tokenize(text.data(), text.size(), words);
+    }
+
+    static void tokenize(const char *text, size_t length, vector<string> &words)
+    {
+        string word;
+        for (size_t i = 0; i <= length; i++)
+        {
+            unsigned char c = i < length ? static_cast<unsigned char>(text[i]) : ' ';
+            if (isalnum(c) || c >= 0x80)
+            {
+                if (word.size() < MAX_TERM_LENGTH)
+                {
+                    word.push_back(static_cast<char>(tolower(c)));
+                }
+            }
+            else if (!word.empty())
+            {
+                words.push_back(word);
+                word.clear();
+            }
+        }
+    }
+
+    // While deferred, adds and erases are ignored; applyDeferred indexes every post from scratch.
+    void deferUpdates()
+    {
+        deferring = true;
+    }
+
+    void applyDeferred()
+    {
+        deferring = false;
+        terms.clear();
+        authors.clear();
+        livePostings = 0;
+        deadPostings = 0;
+
+        // Texts of profiles that are not in memory are read from the snapshot, without loading them.
+        vector<pair<uint64_t, pair<uint32_t, PostText>>> posts;
+        for (const User &user : users)
+        {
+            user.forEachPost([&](uint64_t sequence, const PostText &text, int)
+                             { posts.push_back(make_pair(sequence, make_pair(user.getId(), text))); });
+        }
+        sort(posts.begin(), posts.end(), [](const pair<uint64_t, pair<uint32_t, PostText>> &a, const pair<uint64_t, pair<uint32_t, PostText>> &b)
+             { return a.first < b.first; });
+        for (const pair<uint64_t, pair<uint32_t, PostText>> &post : posts)
+        {
+            addLocked(post.first, post.second.first, post.second.second);
+        }
+    }
+
+    void add(uint64_t sequence, uint32_t author, const PostText &text)
+    {
+        if (!deferring)
+        {
+            ExclusiveLock lock(indexLock);
+            addLocked(sequence, author, text);
+        }
+    }
+
+    // Deleted posts stay in the postings, marked dead, until they make up half of them.
+    void erase(uint64_t sequence, const PostText &text)
+    {
+        if (deferring)
+        {
+            return;
+        }
+        vector<string> words;
+        tokenize(text.data, text.length, words);
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+
+        ExclusiveLock lock(indexLock);
+        if (sequence < authors.size() && authors[sequence] != NO_AUTHOR)
+        {
+            authors[sequence] = NO_AUTHOR;
+            deadPostings += words.size();
+            if (deadPostings > (1 << 16) && deadPostings * 2 > livePostings)
+            {
+                purge();
+            }
+        }
+    }
+
+    // Posts by the viewer and their friends that match the query, best first.
+    vector<FeedEntry> search(uint32_t viewer, const string &text, size_t limit) const
+    {
+        Query query = parse(text);
+        vector<FeedEntry> window;
+        if (query.groups.empty() || limit == 0)
+        {
+            return window;
+        }
+
+        vector<uint32_t> friends;
+        {
+            SharedLock lock(stripes.of(viewer));
+            friends = graph.getFriendList(viewer);
+        }
+
+        size_t wanted = limit * rankWindow;
+        uint64_t bound = UINT64_MAX;
+        size_t scanned = 0;
+        bool exhausted = false;
+        vector<pair<uint64_t, uint32_t>> batch;
+        while (!exhausted && window.size() < wanted && scanned < scanLimit)
+        {
+            batch.clear();
+            {
+                SharedLock lock(indexLock);
+                QueryNode root = plan(query);
+                while (batch.size() < BATCH_SIZE && scanned < scanLimit)
+                {
+                    uint64_t sequence = bound == 0 ? 0 : seek(root, bound);
+                    if (sequence == 0)
+                    {
+                        exhausted = true;
+                        break;
+                    }
+                    bound = sequence - 1;
+                    scanned++;
+                    uint32_t author = authors[sequence];
+                    if (author != NO_AUTHOR && (author == viewer || binary_search(friends.begin(), friends.end(), author)))
+                    {
+                        batch.push_back(make_pair(sequence, author));
+                    }
+                }
+            }
+
+            for (const pair<uint64_t, uint32_t> &candidate : batch)
+            {
+                SharedLock lock(stripes.of(candidate.second));
+                const UserProfile *profile = users[candidate.second].getProfile();
+                int index = profile != nullptr && graph.canSeePosts(candidate.second, viewer) ? profile->findPost(candidate.first) : -1;
+                if (index >= 0 && matches(query, profile->getPostText(index)))
+                {
+                    window.push_back(FeedEntry{candidate.second, candidate.first,
+                                               profile->getPost(index), profile->getLikes(index)});
+                }
+            }
+        }
+
+        if (window.empty())
+        {
+            return window;
+        }
+        uint64_t newest = window.front().sequence;
+        auto score = [&](const FeedEntry &entry)
+        {
+            return log2(1.0 + max(0, entry.likes)) - static_cast<double>(newest - entry.sequence) / recencyScale;
+        };
+        size_t kept = min(limit, window.size());
+        partial_sort(window.begin(), window.begin() + kept, window.end(), [&](const FeedEntry &a, const FeedEntry &b)
+                     {
+                         double left = score(a), right = score(b);
+                         return left != right ? left > right : a.sequence > b.sequence;
+                     });
+        window.resize(kept);
+        return window;
+    }
+};
+
+const size_t PostSearchIndex::BLOCK_SIZE;
+const size_t PostSearchIndex::MAX_TERM_LENGTH;
+const size_t PostSearchIndex::BATCH_SIZE;
+const uint32_t PostSearchIndex::NO_AUTHOR;
+
+// The last record each thread logged and the manager it went to, for operations that wait until it is durable.
+struct LoggedPosition
+{
+    const void *owner;
+    uint64_t lsn;
+};
+
+static thread_local LoggedPosition lastLogged = {nullptr, 0};
+
+// Concurrency: operations hold tableLock shared and lock the stripes of the users they touch; anything that adds or
+// removes users, or needs a consistent picture of all of them (imports, snapshots), holds tableLock exclusively.
+// Log records are numbered and queued while the stripes they describe are still held, so conflicting operations
+// reach the log in the order they were applied; the writer thread keeps the file in that order.
+class UserManager
+{
+private:
+    UserDirectory directory;
+    UsernameIndex userNames;
+    FriendGraph graph;
+    vector<User> users;
+    LockStripes stripes;
+    // One arena of post texts per lock stripe, guarded by that stripe.
+    vector<TextArena> arenas;
+    // The likers of the posts of each stripe.
+    vector<LikeIndex> likes;
+    ProfileCache profiles;
+    FeedEngine feed;
+    RecommendationEngine recommendations;
+    PathFinder paths;
+    GraphAnalytics analytics;
+    unique_ptr<ClusterReport> clusters;
+    mutable mutex clusterLock;
+    PostSearchIndex postIndex;
+    TrendingTracker trending;
+    string filename;
+    mutable Metrics metrics;
+    Journal journal;
+    thread compactor;
+    uint64_t snapshotLsn;
+    atomic<uint64_t> nextPostSequence;
+    atomic<uint64_t> nextRequestStamp;
+    atomic<uint64_t> livePosts;
+    size_t compactBytes;
+    mutable shared_timed_mutex tableLock;
+    mutable mutex journalLock;
+    LogWriter logWriter;
+    // Whether operations wait for their records to be synced before returning.
+    atomic<bool> durableOperations;
+    atomic<bool> compactionDue;
+    // Stripes whose tombstones or arena garbage are due to be reclaimed once the deleting operation is done.
+    mutex sweepLock;
+    vector<bool> sweepPending;
+    atomic<bool> sweepDue;
+    // Only one thread at a time moves the CLOCK hand.
+    mutex evictionLock;
+
+    // Holds the user table for one operation and runs any compaction it triggered once the table is released.
+    class OperationScope
+    {
+    private:
+        UserManager &manager;
+        SharedLock shared;
+        ExclusiveLock exclusive;
+
+    public:
+        OperationScope(UserManager &owner, bool changesTable) : manager(owner)
+        {
+            lastLogged.owner = nullptr;
+            if (changesTable)
+            {
+                exclusive = ExclusiveLock(manager.tableLock);
+            }
+            else
+            {
+                shared = SharedLock(manager.tableLock);
+            }
+        }
+
+        ~OperationScope()
+        {
+            if (shared.owns_lock())
+            {
+                shared.unlock();
+            }
+            if (exclusive.owns_lock())
+            {
+                exclusive.unlock();
+            }
+            if (manager.profiles.sweepDue())
+            {
+                manager.evictProfiles();
+            }
+            if (manager.sweepDue.exchange(false))
+            {
+                manager.sweepStripes();
+            }
+            if (manager.compactionDue.exchange(false))
+            {
+                manager.compact();
+            }
+            if (manager.durableOperations.load() && lastLogged.owner == &manager)
+            {
+                manager.logWriter.waitDurable(lastLogged.lsn);
+            }
+        }
+    };
+
+public:
+    UserManager(const string &file)
+        : userNames(directory), arenas(LockStripes::COUNT), likes(LockStripes::COUNT), profiles(directory, arenas), feed(graph, users, stripes), recommendations(graph, stripes), paths(graph, stripes), analytics(graph, stripes), postIndex(graph, users, stripes), logWriter(journal, journalLock)
+    {
+        filename = file;
+        snapshotLsn = 0;
+        nextPostSequence = 1;
+        nextRequestStamp = 1;
+        livePosts = 0;
+        compactBytes = 4 << 20;
+        compactionDue = false;
+        sweepPending.assign(LockStripes::COUNT, false);
+        sweepDue = false;
+        durableOperations = true;
+        journal.metrics = &metrics;
+        recover();
+        logWriter.start();
+    }
+
+    ~UserManager()
+    {
+        logWriter.stop();
+        journal.close();
+        if (compactor.joinable())
+        {
+            compactor.join();
+        }
+        for (User &user : users)
+        {
+            user.deleteProfile();
+        }
+    }
+
+    // Reads the legacy user list. Rows the importer would reject are reported with their line number and skipped.
+    void loadUsers()
+    {
+        ifstream file(filename);
+
+        if (file.is_open())
+        {
+            string line;
+            size_t lineNumber = 0;
+
+            while (getline(file, line))
+            {
+                lineNumber++;
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                const char *tokens[2];
+                size_t lengths[2];
+                size_t count = ChunkedLineParser::splitTokens(line.data(), line.data() + line.size(), tokens, lengths, 2);
+                if (count == 0 || *tokens[0] == '#')
+                {
+                    continue;
+                }
+                const char *problem = userRowProblem(tokens, lengths, count);
+                if (problem != nullptr)
+                {
+                    cout << filename << ":" << lineNumber << ": " << problem << endl;
+                    continue;
+                }
+                addUser(string(tokens[0], lengths[0]), string(tokens[1], lengths[1]));
+            }
+
+            file.close();
+        }
+    }
+
+    void recover()
+    {
+        LatencyTimer timer(metrics, Metric::Recover);
+        string snapshotPath = filename + ".snap";
+        string walPath = filename + ".wal";
+        string oldWalPath = walPath + ".old";
+        bool clean = true;
+        string contents;
+
+        userNames.deferUpdates();
+        postIndex.deferUpdates();
+        MappedFile mapped;
+        if (mapped.open(snapshotPath))
+        {
+            SnapshotView view;
+            if (!view.open(mapped.begin(), mapped.size()) || !loadSnapshot(view))
+            {
+                cout << "\t\tSnapshot is damaged; recovering from the log only." << endl;
+                loadUsers();
+                clean = false;
+            }
+            mapped.close();
+        }
+        else
+        {
+            loadUsers();
+            clean = false;
+        }
+        journal.advancePast(snapshotLsn);
+
+        for (const string &path : {oldWalPath, walPath})
+        {
+            if (!readWholeFile(path, contents))
+            {
+                continue;
+            }
+            if (path == oldWalPath)
+            {
+                clean = false;
+            }
+            clean &= Journal::replay(contents.data(), contents.size(), [this](uint64_t lsn, LogType type, LogReader &reader)
+                                     {
+                                         if (lsn > snapshotLsn)
+                                         {
+                                             applyRecord(type, reader);
+                                             journal.advancePast(lsn);
+                                         }
+                                     });
+        }
+        userNames.applyDeferred();
+        postIndex.applyDeferred();
+        sweepStripes();
+
+        if (!clean)
+        {
+            uint32_t generation;
+            string state = saveState(journal.lastLsn(), generation);
+            if (readsBack(state) && writeFileDurably(snapshotPath, state))
+            {
+                profiles.written(generation);
+                remapSnapshot();
+                snapshotLsn = journal.lastLsn();
+                remove(oldWalPath.c_str());
+                remove(walPath.c_str());
+            }
+        }
+        journal.open(walPath);
+        feed.reset(directory.idLimit());
+        recommendations.reset(directory.idLimit());
+        rankStoredPosts();
+    }
+
+    // Opens a freshly serialized state the way recovery will. A snapshot that would not load must never replace the log.
+    static bool readsBack(const string &state)
+    {
+        SnapshotView view;
+        if (view.open(state.data(), state.size()) && validSnapshot(view))
+        {
+            return true;
+        }
+        cerr << "Snapshot did not read back; keeping the log" << endl;
+        return false;
+    }
+
+    // Checks that every section is consistent with the others, so that loading can index them without bounds checks.
+    static bool validSnapshot(const SnapshotView &view)
+    {
+        uint32_t idLimit = view.idLimit();
+        size_t stringBytes = view.bytes(SECTION_STRINGS);
+        size_t postCount = view.count<SnapshotPost>(SECTION_POSTS);
+        const SnapshotUser *records = view.section<SnapshotUser>(SECTION_USERS);
+        const uint64_t *postOffsets = view.section<uint64_t>(SECTION_POST_OFFSETS);
+        const SnapshotPost *posts = view.section<SnapshotPost>(SECTION_POSTS);
+        const uint64_t *likerOffsets = view.section<uint64_t>(SECTION_LIKER_OFFSETS);
+        const uint32_t *likers = view.section<uint32_t>(SECTION_LIKERS);
+        size_t likerCount = view.count<uint32_t>(SECTION_LIKERS);
+
+        if (view.count<SnapshotUser>(SECTION_USERS) != idLimit ||
+            view.count<uint64_t>(SECTION_POST_OFFSETS) != static_cast<size_t>(idLimit) + 1 ||
+            postOffsets[0] != 0 || postOffsets[idLimit] != postCount ||
+            view.count<uint64_t>(SECTION_POST_SEQUENCES) != postCount || view.count<uint64_t>(SECTION_COUNTERS) < 2 ||
+            view.count<uint64_t>(SECTION_LIKER_OFFSETS) != postCount + 1 || likerOffsets[0] != 0 || likerOffsets[postCount] != likerCount ||
+            view.count<uint64_t>(SECTION_OUTBOX_STAMPS) != view.count<uint32_t>(SECTION_OUTBOX_TARGETS) ||
+            view.count<uint64_t>(SECTION_INBOX_STAMPS) != view.count<uint32_t>(SECTION_INBOX_TARGETS) ||
+            !view.validCsr(SECTION_FRIEND_OFFSETS, SECTION_FRIEND_TARGETS) ||
+            !view.validCsr(SECTION_OUTBOX_OFFSETS, SECTION_OUTBOX_TARGETS) ||
+            !view.validCsr(SECTION_INBOX_OFFSETS, SECTION_INBOX_TARGETS))
+        {
+            return false;
+        }
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            const SnapshotUser &record = records[id];
+            if (record.nameOffset > stringBytes || record.nameLength > stringBytes - record.nameOffset ||
+                record.passwordOffset > stringBytes || record.passwordLength > stringBytes - record.passwordOffset ||
+                postOffsets[id] > postOffsets[id + 1])
+            {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < postCount; i++)
+        {
+            if (posts[i].textOffset > stringBytes || posts[i].textLength > stringBytes - posts[i].textOffset ||
+                likerOffsets[i] > likerOffsets[i + 1] || likerOffsets[i + 1] > likerCount)
+            {
+                return false;
+            }
+            for (uint64_t j = likerOffsets[i] + 1; j < likerOffsets[i + 1]; j++)
+            {
+                if (likers[j - 1] >= likers[j])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool loadSnapshot(const SnapshotView &view)
+    {
+        if (!validSnapshot(view))
+        {
+            return false;
+        }
+        uint32_t idLimit = view.idLimit();
+        const char *strings = view.section<char>(SECTION_STRINGS);
+        const SnapshotUser *records = view.section<SnapshotUser>(SECTION_USERS);
+        const uint64_t *postOffsets = view.section<uint64_t>(SECTION_POST_OFFSETS);
+        const SnapshotPost *posts = view.section<SnapshotPost>(SECTION_POSTS);
+        const uint64_t *postSequences = view.section<uint64_t>(SECTION_POST_SEQUENCES);
+        const uint64_t *likerOffsets = view.section<uint64_t>(SECTION_LIKER_OFFSETS);
+        const uint32_t *likers = view.section<uint32_t>(SECTION_LIKERS);
+        const uint64_t *outboxStamps = view.section<uint64_t>(SECTION_OUTBOX_STAMPS);
+        const uint64_t *inboxStamps = view.section<uint64_t>(SECTION_INBOX_STAMPS);
+
+        // Profiles stay in the snapshot until they are used.
+        uint32_t generation = ProfileCache::canStayMapped() ? profiles.map(filename + ".snap") : 0;
+        users.reserve(idLimit);
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            const SnapshotUser &record = records[id];
+            directory.appendName(strings + record.nameOffset, record.nameLength);
+            users.push_back(User(id, string(strings + record.passwordOffset, record.passwordLength), &profiles));
+            if (record.nameLength > 0 && generation != 0)
+            {
+                users.back().storedIn(generation);
+            }
+            else if (record.nameLength > 0)
+            {
+                users.back().createProfile(directory.nameOf(id));
+            }
+        }
+        if (!directory.restoreTable(view.section<char>(SECTION_DIRECTORY), view.bytes(SECTION_DIRECTORY) / directory.slotSize()))
+        {
+            directory.rebuildTable();
+        }
+
+        if (!userNames.assignOrder(view.section<uint32_t>(SECTION_NAME_ORDER), view.count<uint32_t>(SECTION_NAME_ORDER), directory.size()))
+        {
+            for (uint32_t id = 0; id < idLimit; id++)
+            {
+                if (records[id].nameLength > 0)
+                {
+                    userNames.insert(id);
+                }
+            }
+        }
+        graph.importCsr(view.section<uint64_t>(SECTION_FRIEND_OFFSETS), view.section<uint32_t>(SECTION_FRIEND_TARGETS), idLimit);
+
+        const uint64_t *outboxOffsets = view.section<uint64_t>(SECTION_OUTBOX_OFFSETS);
+        const uint32_t *outboxTargets = view.section<uint32_t>(SECTION_OUTBOX_TARGETS);
+        const uint64_t *inboxOffsets = view.section<uint64_t>(SECTION_INBOX_OFFSETS);
+        const uint32_t *inboxTargets = view.section<uint32_t>(SECTION_INBOX_TARGETS);
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            if (records[id].nameLength > 0 && generation != 0)
+            {
+                // Likers stay in memory for every post.
+                for (uint64_t i = postOffsets[id]; i < postOffsets[id + 1]; i++)
+                {
+                    livePosts++;
+                    likesOf(id).load(postSequences[i], likers + likerOffsets[i], likerOffsets[i + 1] - likerOffsets[i]);
+                }
+                continue;
+            }
+            UserProfile *profile = users[id].getProfile();
+            if (profile == nullptr)
+            {
+                continue;
+            }
+
+            profile->loadRequests(outboxTargets + outboxOffsets[id], outboxStamps + outboxOffsets[id], outboxOffsets[id + 1] - outboxOffsets[id],
+                                  inboxTargets + inboxOffsets[id], inboxStamps + inboxOffsets[id], inboxOffsets[id + 1] - inboxOffsets[id]);
+            for (uint64_t i = postOffsets[id]; i < postOffsets[id + 1]; i++)
+            {
+                profile->loadPost(arenaOf(id), strings + posts[i].textOffset, posts[i].textLength, posts[i].likes, postSequences[i]);
+                livePosts++;
+                likesOf(id).load(postSequences[i], likers + likerOffsets[i], likerOffsets[i + 1] - likerOffsets[i]);
+            }
+        }
+        nextPostSequence = view.section<uint64_t>(SECTION_COUNTERS)[0];
+        nextRequestStamp = view.section<uint64_t>(SECTION_COUNTERS)[1];
+
+        snapshotLsn = view.lsn();
+        return true;
+    }
+
+    void applyRecord(LogType type, LogReader &reader)
+    {
+        switch (type)
+        {
+        case LogType::RegisterUser:
+        {
+            uint32_t id = reader.get32();
+            string username = reader.getString();
+            string password = reader.getString();
+            if (reader.ok())
+            {
+                addUser(username, password, id);
+            }
+            break;
+        }
+        case LogType::DeleteUser:
+            removeUser(reader.get32());
+            break;
+        case LogType::DeleteUsers:
+        {
+            uint32_t count = reader.get32();
+            for (uint32_t i = 0; i < count && reader.ok(); i++)
+            {
+                uint32_t id = reader.get32();
+                if (reader.ok())
+                {
+                    removeUser(id);
+                }
+            }
+            break;
+        }
+        case LogType::FriendRequest:
+        {
+            uint32_t sender = reader.get32();
+            uint32_t receiver = reader.get32();
+            uint64_t stamp = reader.get64();
+            if (reader.ok())
+            {
+                applyFriendRequest(sender, receiver, stamp);
+            }
+            break;
+        }
+        case LogType::AcceptRequest:
+        {
+            uint32_t id = reader.get32();
+            applyAcceptRequest(id, reader.get32());
+            break;
+        }
+        case LogType::DeclineRequest:
+        {
+            uint32_t id = reader.get32();
+            applyDeclineRequest(id, reader.get32());
+            break;
+        }
+        case LogType::RespondRequests:
+        {
+            uint32_t id = reader.get32();
+            bool accept = reader.get32() != 0;
+            uint32_t count = reader.get32();
+            vector<uint32_t> senders;
+            for (uint32_t i = 0; i < count && reader.ok(); i++)
+            {
+                senders.push_back(reader.get32());
+            }
+            if (reader.ok())
+            {
+                applyRespondRequests(id, senders, accept);
+            }
+            break;
+        }
+        case LogType::AddPost:
+        {
+            uint32_t owner = reader.get32();
+            string post = reader.getString();
+            uint64_t sequence = reader.get64();
+            if (reader.ok() && findUserById(owner) != nullptr)
+            {
+                applyPost(owner, post, sequence);
+            }
+            break;
+        }
+        case LogType::DeletePostById:
+        case LogType::LikePostById:
+        case LogType::UnlikePost:
+        {
+            uint32_t owner = reader.get32();
+            uint64_t postId = reader.get64();
+            uint32_t liker = type != LogType::DeletePostById ? reader.get32() : 0;
+            User *user = findUserById(owner);
+            if (!reader.ok() || user == nullptr)
+            {
+                break;
+            }
+            if (type == LogType::DeletePostById)
+            {
+                applyDeletePost(owner, user->getProfile()->findPost(postId));
+            }
+            else
+            {
+                applyLike(owner, liker, postId, type == LogType::LikePostById, [](int) {});
+            }
+            break;
+        }
+        }
+    }
+
+    string serializeState(uint64_t lsn) const
+    {
+        uint32_t idLimit = directory.idLimit();
+        string strings;
+        vector<SnapshotUser> records(idLimit, SnapshotUser{0, 0, 0, 0});
+        vector<uint64_t> outboxOffsets(1, 0), inboxOffsets(1, 0), postOffsets(1, 0);
+        vector<uint32_t> outboxTargets, inboxTargets;
+        vector<uint64_t> outboxStamps, inboxStamps;
+        vector<SnapshotPost> posts;
+        vector<uint64_t> postSequences;
+        vector<uint64_t> likerOffsets(1, 0);
+        vector<uint32_t> likers;
+
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            const User *user = findUserById(id);
+            if (user != nullptr)
+            {
+                const string &name = directory.nameOf(id);
+                records[id] = SnapshotUser{strings.size(), strings.size() + name.size(),
+                                           static_cast<uint32_t>(name.size()), static_cast<uint32_t>(user->getPassword().size())};
+                strings.append(name);
+                strings.append(user->getPassword());
+
+                // Profiles not in memory are copied from the mapped snapshot as they are.
+                user->appendRequests(outboxTargets, outboxStamps, inboxTargets, inboxStamps);
+                user->forEachPost([&](uint64_t sequence, const PostText &text, int postLikes)
+                                  {
+                                      postSequences.push_back(sequence);
+                                      posts.push_back(SnapshotPost{strings.size(), text.length, postLikes});
+                                      strings.append(text.data, text.length);
+                                      likes[LockStripes::indexOf(id)].appendLikers(sequence, likers);
+                                      likerOffsets.push_back(likers.size());
+                                  });
+            }
+            outboxOffsets.push_back(outboxTargets.size());
+            inboxOffsets.push_back(inboxTargets.size());
+            postOffsets.push_back(posts.size());
+        }
+
+        vector<uint64_t> friendOffsets;
+        vector<uint32_t> friendTargets;
+        graph.exportCsr(friendOffsets, friendTargets, idLimit);
+
+        SnapshotWriter writer(lsn, idLimit);
+        writer.addSection(SECTION_STRINGS, strings.data(), strings.size());
+        writer.addSection(SECTION_USERS, records);
+        writer.addSection(SECTION_DIRECTORY, directory.tableBytes(), directory.tableSize() * directory.slotSize());
+        writer.addSection(SECTION_FRIEND_OFFSETS, friendOffsets);
+        writer.addSection(SECTION_FRIEND_TARGETS, friendTargets);
+        writer.addSection(SECTION_OUTBOX_OFFSETS, outboxOffsets);
+        writer.addSection(SECTION_OUTBOX_TARGETS, outboxTargets);
+        writer.addSection(SECTION_INBOX_OFFSETS, inboxOffsets);
+        writer.addSection(SECTION_INBOX_TARGETS, inboxTargets);
+        writer.addSection(SECTION_POST_OFFSETS, postOffsets);
+        writer.addSection(SECTION_POSTS, posts);
+        writer.addSection(SECTION_POST_SEQUENCES, postSequences);
+        writer.addSection(SECTION_COUNTERS, vector<uint64_t>{nextPostSequence, nextRequestStamp});
+        writer.addSection(SECTION_NAME_ORDER, userNames.exportOrder());
+        writer.addSection(SECTION_LIKER_OFFSETS, likerOffsets);
+        writer.addSection(SECTION_LIKERS, likers);
+        writer.addSection(SECTION_OUTBOX_STAMPS, outboxStamps);
+        writer.addSection(SECTION_INBOX_STAMPS, inboxStamps);
+        return writer.finish();
+    }
+
+    // Numbers the snapshot of the state at lsn; the profiles in it can be dropped once it is written and mapped.
+    string saveState(uint64_t lsn, uint32_t &generation)
+    {
+        string state = serializeState(lsn);
+        generation = profiles.nextGeneration();
+        for (User &user : users)
+        {
+            user.markSaved(generation);
+        }
+        return state;
+    }
+
+    void joinCompactor()
+    {
+        if (compactor.joinable())
+        {
+            compactor.join();
+        }
+    }
+
+    void waitForCompaction()
+    {
+        ExclusiveLock table(tableLock);
+        joinCompactor();
+    }
+
+    // The caller holds the table exclusively, or is recovering, so no profile is being read from the old mapping.
+    void remapSnapshot()
+    {
+        profiles.remap(filename + ".snap");
+    }
+
+    void compact()
+    {
+        LatencyTimer timer(metrics, Metric::Snapshot);
+        ExclusiveLock table(tableLock);
+        joinCompactor();
+        remapSnapshot();
+        // Nothing new is logged while the table is held, so once the writer has caught up the journal is ours.
+        logWriter.waitWritten(logWriter.lastSubmitted());
+        lock_guard<mutex> journalGuard(journalLock);
+
+        string walPath = filename + ".wal";
+        string oldWalPath = walPath + ".old";
+        uint64_t lsn = journal.lastLsn();
+        uint32_t generation;
+        string state = saveState(lsn, generation);
+        string snapshotPath = filename + ".snap";
+
+        if (fileExists(oldWalPath))
+        {
+            journal.close();
+            if (readsBack(state) && writeFileDurably(snapshotPath, state))
+            {
+                snapshotLsn = lsn;
+                remove(oldWalPath.c_str());
+                remove(walPath.c_str());
+                profiles.written(generation);
+                remapSnapshot();
+            }
+            journal.open(walPath);
+            return;
+        }
+
+        journal.close();
+        replaceFile(walPath, oldWalPath);
+        journal.open(walPath);
+        snapshotLsn = lsn;
+
+        ProfileCache *cache = &profiles;
+        compactor = thread([snapshotPath, oldWalPath, cache, generation](string contents)
+                           {
+                               if (readsBack(contents) && writeFileDurably(snapshotPath, contents))
+                               {
+                                   cache->written(generation);
+                                   remove(oldWalPath.c_str());
+                               }
+                           },
+                           std::move(state));
+    }
+
+    // Queues the record for the writer thread and returns at once. Compaction needs the table exclusively, so it is
+    // left to the OperationScope that is current, as is waiting for the record to be durable.
+    void logRecord(LogType type, const LogRecord &record)
+    {
+        LatencyTimer timer(metrics, Metric::JournalAppend);
+        lastLogged = LoggedPosition{this, logWriter.submit(type, record)};
+        if (journal.size() >= compactBytes)
+        {
+            compactionDue = true;
+        }
+    }
+
+    User *addUser(const string &username, const string &password, uint32_t id = UserDirectory::INVALID_ID)
+    {
+        if (id != UserDirectory::INVALID_ID)
+        {
+            if (id < directory.idLimit())
+            {
+                return nullptr;
+            }
+            directory.reserveIds(id);
+            while (users.size() < id)
+            {
+                users.push_back(User(static_cast<uint32_t>(users.size()), "", &profiles));
+            }
+        }
+
+        return createUser(directory.insert(username), password);
+    }
+
+    TextArena &arenaOf(uint32_t id)
+    {
+        return arenas[LockStripes::indexOf(id)];
+    }
+
+    LikeIndex &likesOf(uint32_t id)
+    {
+        return likes[LockStripes::indexOf(id)];
+    }
+
+    User *createUser(uint32_t id, const string &password)
+    {
+        if (id == UserDirectory::INVALID_ID)
+        {
+            return nullptr;
+        }
+
+        users.push_back(User(id, password, &profiles));
+        users.back().createProfile(directory.nameOf(id));
+        userNames.insert(id);
+        graph.addNode(id);
+        feed.addNode(id);
+        recommendations.addNode(id);
+        return &users.back();
+    }
+
+    static unsigned importThreadCount(size_t bytes)
+    {
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        return static_cast<unsigned>(min<size_t>(threads, bytes / (1 << 16) + 1));
+    }
+
+    static void reportImport(ostream &log, const string &path, const string &what, size_t rows, size_t imported,
+                             vector<ImportRejection> &rejections, const vector<size_t> &lineCounts,
+                             chrono::steady_clock::time_point started, const char *verb = "Imported")
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        vector<size_t> firstLine(lineCounts.size(), 1);
+        for (size_t c = 1; c < lineCounts.size(); c++)
+        {
+            firstLine[c] = firstLine[c - 1] + lineCounts[c - 1];
+        }
+        sort(rejections.begin(), rejections.end(), [](const ImportRejection &a, const ImportRejection &b)
+             { return a.chunk != b.chunk ? a.chunk < b.chunk : a.line < b.line; });
+
+        for (size_t i = 0; i < rejections.size() && i < 20; i++)
+        {
+            log << path << ":" << firstLine[rejections[i].chunk] + rejections[i].line << ": " << rejections[i].reason << endl;
+        }
+        if (rejections.size() > 20)
+        {
+            log << "... " << rejections.size() - 20 << " more rejected lines" << endl;
+        }
+        log << verb << " " << imported << " " << what << " from " << path << ": " << rows << " rows, "
+             << rejections.size() << " rejected, " << static_cast<long long>(seconds * 1000) << " ms, "
+             << static_cast<long long>(seconds > 0 ? rows / seconds : rows) << " rows/sec" << endl;
+    }
+
+    bool importUsers(const string &path)
+    {
+        MappedFile input;
+        if (!input.open(path))
+        {
+            cout << "Unable to open " << path << endl;
+            return false;
+        }
+        importUsers(input.begin(), input.size(), path, cout);
+        return true;
+    }
+
+    bool deleteUsers(const string &path)
+    {
+        MappedFile input;
+        if (!input.open(path))
+        {
+            cout << "Unable to open " << path << endl;
+            return false;
+        }
+        deleteUsers(input.begin(), input.size(), path, cout);
+        return true;
+    }
+
+    bool importEdges(const string &path)
+    {
+        MappedFile input;
+        if (!input.open(path))
+        {
+            cout << "Unable to open " << path << endl;
+            return false;
+        }
+        importEdges(input.begin(), input.size(), path, cout);
+        return true;
+    }
+
+    size_t importUsers(const char *data, size_t size, const string &label, ostream &log)
+    {
+        struct ParsedUser
+        {
+            const char *name;
+            const char *password;
+            uint32_t nameLength;
+            uint32_t passwordLength;
+            uint32_t hash;
+            size_t line;
+        };
+
+        ExclusiveLock table(tableLock);
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        unsigned chunks = importThreadCount(size);
+        vector<vector<ParsedUser>> parsed(chunks);
+        vector<vector<ImportRejection>> rejected(chunks);
+
+        vector<size_t> lineCounts = ChunkedLineParser::forEachLine(data, size, chunks,
+                                                                   [&](unsigned chunk, size_t line, const char *begin, const char *end)
+                                                                   {
+                                                                       const char *tokens[2];
+                                                                       size_t lengths[2];
+                                                                       size_t count = ChunkedLineParser::splitTokens(begin, end, tokens, lengths, 2);
+                                                                       if (count == 0 || *tokens[0] == '#')
+                                                                       {
+                                                                           return;
+                                                                       }
+                                                                       const char *problem = userRowProblem(tokens, lengths, count);
+                                                                       if (problem != nullptr)
+                                                                       {
+                                                                           rejected[chunk].push_back(ImportRejection{chunk, line, problem});
+                                                                       }
+                                                                       else
+                                                                       {
+                                                                           parsed[chunk].push_back(ParsedUser{tokens[0], tokens[1], static_cast<uint32_t>(lengths[0]), static_cast<uint32_t>(lengths[1]),
+                                                                                                              UserDirectory::hashName(tokens[0], lengths[0]), line});
+                                                                       }
+                                                                   });
+
+        size_t rows = 0;
+        for (unsigned c = 0; c < chunks; c++)
+        {
+            rows += parsed[c].size() + rejected[c].size();
+        }
+        directory.reserve(directory.size() + rows);
+        users.reserve(users.size() + rows);
+
+        size_t imported = 0;
+        userNames.deferUpdates();
+        for (unsigned c = 0; c < chunks; c++)
+        {
+            for (const ParsedUser &row : parsed[c])
+            {
+                uint32_t id = directory.insert(string(row.name, row.nameLength), row.hash);
+                if (id == UserDirectory::INVALID_ID)
+                {
+                    rejected[c].push_back(ImportRejection{c, row.line, "duplicate user name '" + string(row.name, row.nameLength) + "'"});
+                    continue;
+                }
+                createUser(id, string(row.password, row.passwordLength));
+                imported++;
+            }
+        }
+        userNames.applyDeferred();
+
+        vector<ImportRejection> rejections;
+        for (vector<ImportRejection> &chunk : rejected)
+        {
+            rejections.insert(rejections.end(), chunk.begin(), chunk.end());
+        }
+        reportImport(log, label, "users", rows, imported, rejections, lineCounts, started);
+        return imported;
+    }
+
+    size_t importEdges(const char *data, size_t size, const string &label, ostream &log)
+    {
+        ExclusiveLock table(tableLock);
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        unsigned chunks = importThreadCount(size);
+        vector<vector<pair<uint32_t, uint32_t>>> edges(chunks);
+        vector<vector<ImportRejection>> rejected(chunks);
+
+        vector<size_t> lineCounts = ChunkedLineParser::forEachLine(data, size, chunks,
+                                                                   [&](unsigned chunk, size_t line, const char *begin, const char *end)
+                                                                   {
+                                                                       const char *tokens[2];
+                                                                       size_t lengths[2];
+                                                                       size_t count = ChunkedLineParser::splitTokens(begin, end, tokens, lengths, 2);
+                                                                       if (count == 0 || *tokens[0] == '#')
+                                                                       {
+                                                                           return;
+                                                                       }
+                                                                       if (count != 2)
+                                                                       {
+                                                                           rejected[chunk].push_back(ImportRejection{chunk, line, "expected 'user friend'"});
+                                                                           return;
+                                                                       }
+
+                                                                       uint32_t ids[2];
+                                                                       for (int i = 0; i < 2; i++)
+                                                                       {
+                                                                           ids[i] = directory.find(tokens[i], lengths[i], UserDirectory::hashName(tokens[i], lengths[i]));
+                                                                           if (ids[i] == UserDirectory::INVALID_ID)
+                                                                           {
+                                                                               rejected[chunk].push_back(ImportRejection{chunk, line, "unknown user '" + string(tokens[i], lengths[i]) + "'"});
+                                                                               return;
+                                                                           }
+                                                                       }
+                                                                       if (ids[0] == ids[1])
+                                                                       {
+                                                                           rejected[chunk].push_back(ImportRejection{chunk, line, "self friendship"});
+                                                                           return;
+                                                                       }
+                                                                       edges[chunk].push_back(make_pair(ids[0], ids[1]));
+                                                                   });
+
+        size_t rows = 0;
+        vector<ImportRejection> rejections;
+        for (unsigned c = 0; c < chunks; c++)
+        {
+            rows += edges[c].size() + rejected[c].size();
+            rejections.insert(rejections.end(), rejected[c].begin(), rejected[c].end());
+        }
+
+        size_t imported = applyFriendships(edges);
+        reportImport(log, label, "friendships", rows, imported, rejections, lineCounts, started);
+        return imported;
+    }
+
+    // Takes one user name per line.
+    size_t deleteUsers(const char *data, size_t size, const string &label, ostream &log)
+    {
+        OperationScope scope(*this, true);
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        unsigned chunks = importThreadCount(size);
+        vector<vector<string>> names(chunks);
+        vector<vector<ImportRejection>> rejected(chunks);
+
+        vector<size_t> lineCounts = ChunkedLineParser::forEachLine(data, size, chunks,
+                                                                   [&](unsigned chunk, size_t line, const char *begin, const char *end)
+                                                                   {
+                                                                       const char *tokens[2];
+                                                                       size_t lengths[2];
+                                                                       size_t count = ChunkedLineParser::splitTokens(begin, end, tokens, lengths, 2);
+                                                                       if (count == 0 || *tokens[0] == '#')
+                                                                       {
+                                                                           return;
+                                                                       }
+                                                                       if (count != 1)
+                                                                       {
+                                                                           rejected[chunk].push_back(ImportRejection{chunk, line, "expected 'username'"});
+                                                                       }
+                                                                       else if (liveId(string(tokens[0], lengths[0])) == UserDirectory::INVALID_ID)
+                                                                       {
+                                                                           rejected[chunk].push_back(ImportRejection{chunk, line, "unknown user '" + string(tokens[0], lengths[0]) + "'"});
+                                                                       }
+                                                                       else
+                                                                       {
+                                                                           names[chunk].push_back(string(tokens[0], lengths[0]));
+                                                                       }
+                                                                   });
+
+        size_t rows = 0;
+        vector<string> usernames;
+        vector<ImportRejection> rejections;
+        for (unsigned c = 0; c < chunks; c++)
+        {
+            rows += names[c].size() + rejected[c].size();
+            usernames.insert(usernames.end(), names[c].begin(), names[c].end());
+            rejections.insert(rejections.end(), rejected[c].begin(), rejected[c].end());
+        }
+
+        size_t deleted = applyDeleteAccounts(usernames);
+        reportImport(log, label, "users", rows, deleted, rejections, lineCounts, started, "Deleted");
+        return deleted;
+    }
+
+    size_t applyDeleteAccounts(const vector<string> &usernames)
+    {
+        vector<uint32_t> ids;
+        for (const string &username : usernames)
+        {
+            uint32_t id = liveId(username);
+            if (id != UserDirectory::INVALID_ID && removeUser(id))
+            {
+                ids.push_back(id);
+            }
+        }
+        if (!ids.empty())
+        {
+            LogRecord record;
+            record.put32(static_cast<uint32_t>(ids.size()));
+            for (uint32_t id : ids)
+            {
+                record.put32(id);
+            }
+            logRecord(LogType::DeleteUsers, record);
+        }
+        return ids.size();
+    }
+
+    size_t addFriendshipsInBulk(const vector<vector<pair<uint32_t, uint32_t>>> &edges)
+    {
+        ExclusiveLock table(tableLock);
+        return applyFriendships(edges);
+    }
+
+    size_t applyFriendships(const vector<vector<pair<uint32_t, uint32_t>>> &edges)
+    {
+        size_t added = graph.addFriendsInBulk(edges, max(1u, thread::hardware_concurrency()));
+        feed.reset(directory.idLimit());
+        recommendations.reset(directory.idLimit());
+
+        // Only the endpoints of the new edges can hold requests that became friendships. A profile that is not in
+        // memory is only read back if the snapshot says it has requests at all.
+        vector<bool> endpoint(users.size(), false);
+        for (const vector<pair<uint32_t, uint32_t>> &chunk : edges)
+        {
+            for (const pair<uint32_t, uint32_t> &edge : chunk)
+            {
+                endpoint[edge.first] = true;
+                endpoint[edge.second] = true;
+            }
+        }
+        for (uint32_t id = 0; id < endpoint.size(); id++)
+        {
+            if (!endpoint[id] || !users[id].exists() || (users[id].residentProfile() == nullptr && !profiles.hasStoredRequests(id)))
+            {
+                continue;
+            }
+            User &user = users[id];
+            UserProfile *profile = user.getProfile();
+            if (profile == nullptr || (profile->getFriendRequests().empty() && profile->getPendingRequests().empty()))
+            {
+                continue;
+            }
+            for (uint32_t other : profile->getFriendRequests().toVector())
+            {
+                if (graph.isFriend(user.getId(), other))
+                {
+                    profile->removeFriendRequest(other);
+                }
+            }
+            for (uint32_t other : profile->getPendingRequests().toVector())
+            {
+                if (graph.isFriend(user.getId(), other))
+                {
+                    profile->removePendingRequest(other);
+                }
+            }
+        }
+        return added;
+    }
+
+    // Only the profiles that refer to the user are touched: friendships are symmetric, and every outgoing request
+    // is the receiver's incoming one and the other way round. The caller holds the table exclusively.
+    bool removeUser(uint32_t id)
+    {
+        User *user = findUserById(id);
+        if (user == nullptr)
+        {
+            return false;
+        }
+
+        UserProfile *profile = user->getProfile();
+        vector<uint32_t> friends = graph.getFriendList(id);
+        recommendations.removeNode(id);
+        for (uint32_t friendId : friends)
+        {
+            graph.removeFriend(friendId, id);
+        }
+        profile->getFriendRequests().forEach([&](uint32_t receiver)
+                                             {
+                                                 if (findUserById(receiver) != nullptr)
+                                                 {
+                                                     users[receiver].getProfile()->removePendingRequest(id);
+                                                 }
+                                             });
+        profile->getPendingRequests().forEach([&](uint32_t sender)
+                                              {
+                                                  if (findUserById(sender) != nullptr)
+                                                  {
+                                                      users[sender].getProfile()->removeFriendRequest(id);
+                                                  }
+                                              });
+
+        graph.removeNode(id);
+        feed.removeNode(id);
+        for (uint32_t friendId : friends)
+        {
+            feed.updateDegree(friendId);
+        }
+        for (size_t i = 0; i < profile->getPostCount(); i++)
+        {
+            if (profile->isLive(i))
+            {
+                postIndex.erase(profile->getPostSequences()[i], profile->getPostText(i));
+                likesOf(id).erasePost(profile->getPostSequences()[i]);
+                trending.forget(profile->getPostSequences()[i]);
+            }
+        }
+        livePosts -= profile->getLivePostCount();
+        profile->releasePosts(arenaOf(id));
+        user->deleteProfile();
+        userNames.erase(id);
+        directory.erase(directory.nameOf(id));
+        return true;
+    }
+
+    // The apply functions below change state without locking or logging; operations call them with the stripes
+    // of the users involved held, and recovery calls them before any other thread exists.
+    OpStatus applyFriendRequest(uint32_t sender, uint32_t receiver, uint64_t stamp)
+    {
+        User *senderUser = findUserById(sender);
+        User *receiverUser = findUserById(receiver);
+        if (senderUser == nullptr || receiverUser == nullptr)
+        {
+            return OpStatus::UserNotFound;
+        }
+        if (sender == receiver)
+        {
+            return OpStatus::InvalidRequest;
+        }
+        if (graph.isFriend(sender, receiver))
+        {
+            return OpStatus::AlreadyFriends;
+        }
+        if (!senderUser->getProfile()->addFriendRequest(receiver, stamp))
+        {
+            return OpStatus::DuplicateRequest;
+        }
+
+        receiverUser->getProfile()->addPendingRequest(sender, stamp);
+        uint64_t next = nextRequestStamp.load();
+        while (stamp >= next && !nextRequestStamp.compare_exchange_weak(next, stamp + 1))
+        {
+        }
+        return OpStatus::Ok;
+    }
+
+    bool applyDeclineRequest(uint32_t id, uint32_t sender)
+    {
+        User *user = findUserById(id);
+        User *senderUser = findUserById(sender);
+        if (user == nullptr || senderUser == nullptr || !user->getProfile()->hasPendingRequestFrom(sender))
+        {
+            return false;
+        }
+        user->getProfile()->removePendingRequest(sender);
+        senderUser->getProfile()->removeFriendRequest(id);
+        return true;
+    }
+
+    // Answers many requests to one user; the caller holds the table exclusively. Recommendations around the user
+    // are invalidated once at the end instead of once per accepted request. Returns the senders answered.
+    vector<uint32_t> applyRespondRequests(uint32_t id, const vector<uint32_t> &senders, bool accept)
+    {
+        vector<uint32_t> answered;
+        for (uint32_t sender : senders)
+        {
+            if (accept ? applyAcceptRequest(id, sender, false) : applyDeclineRequest(id, sender))
+            {
+                answered.push_back(sender);
+            }
+        }
+        if (accept && !answered.empty())
+        {
+            recommendations.onFriendshipsAdded(id, answered);
+        }
+        return answered;
+    }
+
+    bool applyAcceptRequest(uint32_t id, uint32_t friendId, bool refreshRecommendations = true)
+    {
+        User *user = findUserById(id);
+        User *friendUser = findUserById(friendId);
+        if (user == nullptr || friendUser == nullptr || !friendUser->getProfile()->hasFriendRequestFrom(id))
+        {
+            return false;
+        }
+
+        UserProfile *profile = user->getProfile();
+        UserProfile *friendProfile = friendUser->getProfile();
+        graph.addFriend(id, friendId);
+        feed.onFriendshipAdded(id, friendId);
+        if (refreshRecommendations)
+        {
+            recommendations.onFriendshipChanged(id, friendId);
+        }
+
+        profile->removeFriendRequest(friendId);
+        profile->removePendingRequest(friendId);
+        friendProfile->removeFriendRequest(id);
+        friendProfile->removePendingRequest(id);
+        return true;
+    }
+
+    // Deleting leaves a tombstone; the slots are reclaimed by a sweep of the owner's stripe after the operation.
+    void applyDeletePost(uint32_t owner, int index)
+    {
+        UserProfile *profile = users[owner].getProfile();
+        if (index >= 0 && index < (int)profile->getPostCount() && profile->isLive(index))
+        {
+            postIndex.erase(profile->getPostSequences()[index], profile->getPostText(index));
+            likesOf(owner).erasePost(profile->getPostSequences()[index]);
+            trending.forget(profile->getPostSequences()[index]);
+            profile->deletePost(arenaOf(owner), index);
+            livePosts--;
+            if (profile->wantsPurge() || arenaOf(owner).wantsCompaction())
+            {
+                scheduleSweep(LockStripes::indexOf(owner));
+            }
+        }
+    }
+
+    void scheduleSweep(uint32_t stripe)
+    {
+        lock_guard<mutex> lock(sweepLock);
+        sweepPending[stripe] = true;
+        sweepDue = true;
+    }
+
+    // Runs after the operation that scheduled it has released its locks, so deletes never wait for a sweep.
+    void sweepStripes()
+    {
+        vector<uint32_t> due;
+        {
+            lock_guard<mutex> lock(sweepLock);
+            for (uint32_t stripe = 0; stripe < LockStripes::COUNT; stripe++)
+            {
+                if (sweepPending[stripe])
+                {
+                    due.push_back(stripe);
+                    sweepPending[stripe] = false;
+                }
+            }
+        }
+
+        SharedLock table(tableLock);
+        for (uint32_t stripe : due)
+        {
+            ExclusiveLock lock(stripes.of(stripe));
+            compactStripe(stripe);
+        }
+    }
+
+    // Sweeps the clock hand over the users until the resident profiles are back under the cache's target. Profiles
+    // used since the last pass get a second chance; ones changed since the mapped snapshot stay until compaction has
+    // written them, which is asked for when they are what keeps the cache full.
+    void evictProfiles()
+    {
+        unique_lock<mutex> guard(evictionLock, try_to_lock);
+        if (!guard.owns_lock())
+        {
+            return;
+        }
+        if (profiles.newerWritten())
+        {
+            ExclusiveLock table(tableLock);
+            joinCompactor();
+            remapSnapshot();
+        }
+
+        SharedLock table(tableLock);
+        size_t limit = users.size() * 2;
+        size_t unsaved = 0;
+        size_t visited = 0;
+        for (; visited < limit && profiles.overTarget(); visited++)
+        {
+            uint32_t id = profiles.advanceHand(users.size());
+            User &user = users[id];
+            if (user.residentProfile() == nullptr || user.takeReference())
+            {
+                continue;
+            }
+            ExclusiveLock lock(stripes.of(id), try_to_lock);
+            if (!lock.owns_lock())
+            {
+                continue;
+            }
+            if (!user.evict(arenaOf(id), profiles.mapped()))
+            {
+                unsaved++;
+            }
+            else if (arenaOf(id).wantsCompaction())
+            {
+                scheduleSweep(LockStripes::indexOf(id));
+            }
+        }
+        if (profiles.overTarget() && unsaved > 0)
+        {
+            compactionDue = true;
+        }
+        profiles.swept();
+    }
+
+    // The caller holds the stripe, which guards every profile whose texts live in its arena.
+    void compactStripe(uint32_t stripe)
+    {
+        for (uint32_t id = stripe; id < users.size(); id += LockStripes::COUNT)
+        {
+            UserProfile *profile = users[id].residentProfile();
+            if (profile != nullptr && profile->wantsPurge())
+            {
+                profile->purgeDeletedPosts();
+            }
+        }
+        if (!arenas[stripe].wantsCompaction())
+        {
+            return;
+        }
+
+        TextArena fresh;
+        for (uint32_t id = stripe; id < users.size(); id += LockStripes::COUNT)
+        {
+            UserProfile *profile = users[id].residentProfile();
+            if (profile != nullptr)
+            {
+                profile->purgeDeletedPosts();
+                profile->moveTextsTo(fresh);
+            }
+        }
+        arenas[stripe].swap(fresh);
+    }
+
+    // Returns the readers the post still has to be fanned out to once the owner's stripe is released.
+    vector<uint32_t> applyPost(uint32_t owner, const string &post, uint64_t sequence)
+    {
+        UserProfile *profile = users[owner].getProfile();
+        profile->addPost(arenaOf(owner), post, sequence);
+        livePosts++;
+        postIndex.add(sequence, owner, profile->getPostText(profile->getPostCount() - 1));
+        uint64_t next = nextPostSequence.load();
+        while (sequence >= next && !nextPostSequence.compare_exchange_weak(next, sequence + 1))
+        {
+        }
+        return feed.fanOutTargets(owner);
+    }
+
+    // Liking twice or unliking a post that was not liked changes nothing, and onChange is not called.
+    template <typename Callback>
+    OpStatus applyLike(uint32_t owner, uint32_t liker, uint64_t postId, bool liked, Callback onChange)
+    {
+        UserProfile *profile = users[owner].getProfile();
+        int index = profile->findPost(postId);
+        if (index < 0)
+        {
+            return OpStatus::InvalidPost;
+        }
+        likesOf(owner).change(postId, liker, liked, [&]()
+                              {
+                                  if (liked)
+                                  {
+                                      profile->likePost(index);
+                                  }
+                                  else
+                                  {
+                                      profile->unlikePost(index);
+                                  }
+                                  onChange(profile->getLikes(index));
+                              });
+        return OpStatus::Ok;
+    }
+
+    OpStatus changeLike(uint32_t likerId, uint32_t ownerId, uint64_t postId, bool liked)
+    {
+        return applyLike(ownerId, likerId, postId, liked, [&](int likes)
+                         {
+                             logRecord(liked ? LogType::LikePostById : LogType::UnlikePost, LogRecord().put32(ownerId).put64(postId).put32(likerId));
+                             trending.record(postId, ownerId, liked, likes);
+                         });
+    }
+
+    uint32_t liveId(const string &username) const
+    {
+        uint32_t id = directory.find(username);
+        return id != UserDirectory::INVALID_ID && findUserById(id) != nullptr ? id : UserDirectory::INVALID_ID;
+    }
+
+    OpStatus addPost(uint32_t userId, const string &post)
+    {
+        uint64_t postId;
+        return addPost(userId, post, postId);
+    }
+
+    // The post gets an ID of at least floor; a sharded deployment uses it to keep IDs in posting order across shards.
+    OpStatus addPost(uint32_t userId, const string &post, uint64_t &postId, uint64_t floor = 0)
+    {
+        LatencyTimer timer(metrics, Metric::AddPost);
+        OperationScope scope(*this, false);
+        if (findUserById(userId) == nullptr)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        uint64_t sequence;
+        vector<uint32_t> readers;
+        {
+            ExclusiveLock lock(stripes.of(userId));
+            uint64_t next = nextPostSequence.load();
+            do
+            {
+                sequence = max(next, floor);
+            } while (!nextPostSequence.compare_exchange_weak(next, sequence + 1));
+            readers = applyPost(userId, post, sequence);
+            logRecord(LogType::AddPost, LogRecord().put32(userId).putString(post).put64(sequence));
+        }
+        feed.fanOut(userId, sequence, readers);
+        postId = sequence;
+        return OpStatus::Ok;
+    }
+
+    OpStatus deletePost(uint32_t userId, uint64_t postId)
+    {
+        LatencyTimer timer(metrics, Metric::DeletePost);
+        OperationScope scope(*this, false);
+        if (findUserById(userId) == nullptr)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        ExclusiveLock lock(stripes.of(userId));
+        int index = users[userId].getProfile()->findPost(postId);
+        if (index < 0)
+        {
+            return OpStatus::InvalidPost;
+        }
+        applyDeletePost(userId, index);
+        logRecord(LogType::DeletePostById, LogRecord().put32(userId).put64(postId));
+        return OpStatus::Ok;
+    }
+
+    // Likes only need the owner's stripe shared: the counters are atomic, and slots only move during a stripe
+    // sweep, which holds the stripe exclusively, so the post found by ID stays put while it is liked and logged.
+    OpStatus likePost(uint32_t ownerId, uint64_t postId)
+    {
+        LatencyTimer timer(metrics, Metric::Like);
+        OperationScope scope(*this, false);
+        if (findUserById(ownerId) == nullptr)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        SharedLock lock(stripes.of(ownerId));
+        return changeLike(ownerId, ownerId, postId, true);
+    }
+
+    OpStatus likeFriendPost(uint32_t likerId, const string &owner, uint64_t postId)
+    {
+        LatencyTimer timer(metrics, Metric::Like);
+        OperationScope scope(*this, false);
+        uint32_t ownerId = liveId(owner);
+        if (ownerId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        SharedLock lock(stripes.of(ownerId));
+        if (ownerId != likerId && !graph.canLikePosts(ownerId, likerId))
+        {
+            return OpStatus::NotFriends;
+        }
+        return changeLike(likerId, ownerId, postId, true);
+    }
+
+    // Unliking needs no friendship, so a like can still be taken back after the friendship ended.
+    OpStatus unlikePost(uint32_t likerId, const string &owner, uint64_t postId)
+    {
+        LatencyTimer timer(metrics, Metric::Like);
+        OperationScope scope(*this, false);
+        uint32_t ownerId = liveId(owner);
+        if (ownerId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        SharedLock lock(stripes.of(ownerId));
+        return changeLike(likerId, ownerId, postId, false);
+    }
+
+    OpStatus likersOf(uint32_t viewerId, const string &owner, uint64_t postId, vector<uint32_t> &likers)
+    {
+        OperationScope scope(*this, false);
+        uint32_t ownerId = liveId(owner);
+        if (ownerId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        SharedLock lock(stripes.of(ownerId));
+        if (ownerId != viewerId && !graph.canSeePosts(ownerId, viewerId))
+        {
+            return OpStatus::NotFriends;
+        }
+        if (users[ownerId].getProfile()->findPost(postId) < 0)
+        {
+            return OpStatus::InvalidPost;
+        }
+        // Likes of deleted accounts stay counted, but their likers are left out.
+        vector<uint32_t> all;
+        likes[LockStripes::indexOf(ownerId)].appendLikers(postId, all);
+        likers.clear();
+        for (uint32_t id : all)
+        {
+            if (findUserById(id) != nullptr)
+            {
+                likers.push_back(id);
+            }
+        }
+        return OpStatus::Ok;
+    }
+
+    // Answers for a whole page at once, locking each stripe the page touches once.
+    vector<bool> likedBy(uint32_t viewerId, const vector<FeedEntry> &page) const
+    {
+        SharedLock table(tableLock);
+        vector<pair<uint32_t, size_t>> order;
+        for (size_t i = 0; i < page.size(); i++)
+        {
+            order.push_back(make_pair(LockStripes::indexOf(page[i].author), i));
+        }
+        sort(order.begin(), order.end());
+
+        vector<bool> liked(page.size(), false);
+        for (size_t i = 0; i < order.size();)
+        {
+            uint32_t stripe = order[i].first;
+            SharedLock lock(stripes.of(stripe));
+            for (; i < order.size() && order[i].first == stripe; i++)
+            {
+                liked[order[i].second] = likes[stripe].contains(page[order[i].second].sequence, viewerId);
+            }
+        }
+        return liked;
+    }
+
+    OpStatus createAccount(const string &username, const string &password)
+    {
+        LatencyTimer timer(metrics, Metric::Register);
+        if (!isValidUsername(username.data(), username.size()) || password.empty())
+        {
+            return OpStatus::InvalidUsername;
+        }
+
+        OperationScope scope(*this, true);
+        User *user = addUser(username, password);
+        if (user == nullptr)
+        {
+            return OpStatus::UserExists;
+        }
+        logRecord(LogType::RegisterUser, LogRecord().put32(user->getId()).putString(username).putString(password));
+        return OpStatus::Ok;
+    }
+
+    OpStatus authenticate(const string &username, const string &password, Session &session)
+    {
+        LatencyTimer timer(metrics, Metric::Login);
+        OperationScope scope(*this, false);
+        uint32_t id = liveId(username);
+        // Accounts mirrored from another shard have no password and cannot log in here.
+        if (id == UserDirectory::INVALID_ID || password.empty() || users[id].getPassword() != password)
+        {
+            return OpStatus::WrongPassword;
+        }
+        session.userId = id;
+        session.username = username;
+        return OpStatus::Ok;
+    }
+
+    OpStatus deleteAccount(const string &username)
+    {
+        LatencyTimer timer(metrics, Metric::DeleteUser);
+        OperationScope scope(*this, true);
+        uint32_t id = liveId(username);
+        if (id == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        removeUser(id);
+        logRecord(LogType::DeleteUser, LogRecord().put32(id));
+        return OpStatus::Ok;
+    }
+
+    // Deletes every listed account that exists under one table lock and one log record. Returns how many were deleted.
+    size_t deleteAccounts(const vector<string> &usernames)
+    {
+        OperationScope scope(*this, true);
+        return applyDeleteAccounts(usernames);
+    }
+
+    OpStatus requestFriendship(const string &sender, const string &receiver)
+    {
+        LatencyTimer timer(metrics, Metric::FriendRequest);
+        OperationScope scope(*this, false);
+        uint32_t senderId = liveId(sender);
+        uint32_t receiverId = liveId(receiver);
+        if (senderId == UserDirectory::INVALID_ID || receiverId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        PairLock lock(stripes, senderId, receiverId);
+        uint64_t stamp = nextRequestStamp++;
+        OpStatus status = applyFriendRequest(senderId, receiverId, stamp);
+        if (status == OpStatus::Ok)
+        {
+            logRecord(LogType::FriendRequest, LogRecord().put32(senderId).put32(receiverId).put64(stamp));
+        }
+        return status;
+    }
+
+    OpStatus acceptFriendship(const string &username, const string &friendUsername)
+    {
+        LatencyTimer timer(metrics, Metric::AcceptRequest);
+        OperationScope scope(*this, false);
+        uint32_t id = liveId(username);
+        uint32_t friendId = liveId(friendUsername);
+        if (id == UserDirectory::INVALID_ID || friendId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        PairLock lock(stripes, id, friendId);
+        if (!applyAcceptRequest(id, friendId))
+        {
+            return OpStatus::NoRequest;
+        }
+        logRecord(LogType::AcceptRequest, LogRecord().put32(id).put32(friendId));
+        return OpStatus::Ok;
+    }
+
+    OpStatus declineFriendship(const string &username, const string &senderUsername)
+    {
+        LatencyTimer timer(metrics, Metric::DeclineRequest);
+        OperationScope scope(*this, false);
+        uint32_t id = liveId(username);
+        uint32_t senderId = liveId(senderUsername);
+        if (id == UserDirectory::INVALID_ID || senderId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        PairLock lock(stripes, id, senderId);
+        if (!applyDeclineRequest(id, senderId))
+        {
+            return OpStatus::NoRequest;
+        }
+        logRecord(LogType::DeclineRequest, LogRecord().put32(id).put32(senderId));
+        return OpStatus::Ok;
+    }
+
+    // In a sharded deployment a shard knows users homed elsewhere only as password-less accounts, created the first
+    // time a friendship change involves them. Their own shard deletes them along with the real account.
+    OpStatus addRemoteUser(const string &username)
+    {
+        LatencyTimer timer(metrics, Metric::Register);
+        if (!isValidUsername(username.data(), username.size()))
+        {
+            return OpStatus::InvalidUsername;
+        }
+
+        OperationScope scope(*this, true);
+        if (liveId(username) != UserDirectory::INVALID_ID)
+        {
+            return OpStatus::Ok;
+        }
+        User *user = addUser(username, string());
+        if (user == nullptr)
+        {
+            return OpStatus::UserExists;
+        }
+        logRecord(LogType::RegisterUser, LogRecord().put32(user->getId()).putString(username).putString(string()));
+        return OpStatus::Ok;
+    }
+
+    // The status requestFriendship, acceptFriendship or declineFriendship would return now, without changing
+    // anything. The remote user, when named, may not be mirrored here yet; there is then nothing between the two.
+    OpStatus checkFriendship(FriendChange change, const string &username, const string &otherUsername, const string &remote)
+    {
+        OperationScope scope(*this, false);
+        uint32_t id = liveId(username);
+        uint32_t otherId = liveId(otherUsername);
+        if ((id == UserDirectory::INVALID_ID && username != remote) || (otherId == UserDirectory::INVALID_ID && otherUsername != remote))
+        {
+            return OpStatus::UserNotFound;
+        }
+        if (id == UserDirectory::INVALID_ID || otherId == UserDirectory::INVALID_ID)
+        {
+            return change == FriendChange::Request ? OpStatus::Ok : OpStatus::NoRequest;
+        }
+
+        PairLock lock(stripes, id, otherId);
+        const UserProfile *profile = users[id].getProfile();
+        const UserProfile *otherProfile = users[otherId].getProfile();
+        switch (change)
+        {
+        case FriendChange::Request:
+            if (id == otherId)
+            {
+                return OpStatus::InvalidRequest;
+            }
+            if (graph.isFriend(id, otherId))
+            {
+                return OpStatus::AlreadyFriends;
+            }
+            return profile->hasFriendRequestFrom(otherId) ? OpStatus::DuplicateRequest : OpStatus::Ok;
+        case FriendChange::Accept:
+            return otherProfile->hasFriendRequestFrom(id) ? OpStatus::Ok : OpStatus::NoRequest;
+        case FriendChange::Decline:
+            return profile->hasPendingRequestFrom(otherId) ? OpStatus::Ok : OpStatus::NoRequest;
+        }
+        return OpStatus::Ok;
+    }
+
+    // Accepts or declines the requests from the listed senders, or every pending request oldest first when the
+    // list is empty, under one table lock and one log record. Senders without a request are skipped.
+    OpStatus respondToRequests(const string &username, const vector<string> &senders, bool accept, size_t &answered)
+    {
+        LatencyTimer timer(metrics, Metric::RespondRequests);
+        OperationScope scope(*this, true);
+        answered = 0;
+        uint32_t id = liveId(username);
+        if (id == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+
+        vector<uint32_t> senderIds;
+        if (senders.empty())
+        {
+            senderIds = users[id].getProfile()->getPendingRequests().toVector();
+        }
+        for (const string &sender : senders)
+        {
+            uint32_t senderId = liveId(sender);
+            if (senderId != UserDirectory::INVALID_ID)
+            {
+                senderIds.push_back(senderId);
+            }
+        }
+
+        vector<uint32_t> done = applyRespondRequests(id, senderIds, accept);
+        answered = done.size();
+        if (!done.empty())
+        {
+            LogRecord record;
+            record.put32(id).put32(accept ? 1 : 0).put32(static_cast<uint32_t>(done.size()));
+            for (uint32_t sender : done)
+            {
+                record.put32(sender);
+            }
+            logRecord(LogType::RespondRequests, record);
+        }
+        return OpStatus::Ok;
+    }
+
+    vector<FeedEntry> readFeed(uint32_t viewerId, size_t limit, uint64_t cursor, uint64_t &nextCursor)
+    {
+        LatencyTimer timer(metrics, Metric::Feed);
+        OperationScope scope(*this, false);
+        return feed.read(viewerId, limit, cursor, nextCursor);
+    }
+
+    vector<uint32_t> usersWithPrefix(const string &prefix, const string &after, size_t limit) const
+    {
+        SharedLock table(tableLock);
+        return userNames.withPrefix(prefix, after, limit);
+    }
+
+    // Autocomplete first, then names a typo or two away: none for very short queries, one up to five characters.
+    vector<uint32_t> searchUsers(const string &query, size_t limit) const
+    {
+        LatencyTimer timer(metrics, Metric::SearchUsers);
+        SharedLock table(tableLock);
+        vector<uint32_t> matches = userNames.withPrefix(query, string(), limit);
+        if (matches.size() < limit)
+        {
+            unsigned maxEdits = query.size() <= 2 ? 0 : query.size() <= 5 ? 1 : 2;
+            for (const pair<unsigned, uint32_t> &similar : userNames.similarTo(query, maxEdits, limit))
+            {
+                if (matches.size() < limit && directory.nameOf(similar.second).compare(0, query.size(), query) != 0)
+                {
+                    matches.push_back(similar.second);
+                }
+            }
+        }
+        return matches;
+    }
+
+    vector<FeedEntry> searchPosts(uint32_t viewerId, const string &query, size_t limit)
+    {
+        LatencyTimer timer(metrics, Metric::SearchPosts);
+        OperationScope scope(*this, false);
+        if (findUserById(viewerId) == nullptr)
+        {
+            return vector<FeedEntry>();
+        }
+        return postIndex.search(viewerId, query, limit);
+    }
+
+    vector<Recommendation> recommendFriends(uint32_t viewerId, size_t limit)
+    {
+        LatencyTimer timer(metrics, Metric::Recommend);
+        OperationScope scope(*this, false);
+        if (findUserById(viewerId) == nullptr)
+        {
+            return vector<Recommendation>();
+        }
+        return recommendations.recommend(viewerId, limit);
+    }
+
+    // Fills path with a shortest chain of friendships from one user to another, both included; its length minus one
+    // is their degree of separation.
+    OpStatus connectionBetween(const string &from, const string &to, vector<uint32_t> &path)
+    {
+        LatencyTimer timer(metrics, Metric::Separation);
+        OperationScope scope(*this, false);
+        path.clear();
+        uint32_t fromId = liveId(from);
+        uint32_t toId = liveId(to);
+        if (fromId == UserDirectory::INVALID_ID || toId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+        path = paths.shortestPath(fromId, toId, directory.idLimit());
+        return path.empty() ? OpStatus::NotConnected : OpStatus::Ok;
+    }
+
+    // Recomputes the cluster structure over a copy of the graph; the table is only held while copying. Membership
+    // queries answer from the latest analysis.
+    void analyzeClusters()
+    {
+        LatencyTimer timer(metrics, Metric::Clusters);
+        vector<uint8_t> present;
+        GraphAnalytics::Csr csr;
+        {
+            SharedLock table(tableLock);
+            uint32_t idLimit = directory.idLimit();
+            present.resize(idLimit);
+            for (uint32_t id = 0; id < idLimit; id++)
+            {
+                present[id] = findUserById(id) != nullptr;
+            }
+            csr = analytics.copyGraph(idLimit);
+        }
+        unique_ptr<ClusterReport> report = GraphAnalytics::analyze(csr, present);
+        lock_guard<mutex> lock(clusterLock);
+        clusters.swap(report);
+    }
+
+    ClusterSummary clusterSummary(size_t limit)
+    {
+        lock_guard<mutex> lock(clusterLock);
+        ClusterSummary summary{0, 0, 0, vector<pair<uint32_t, uint32_t>>(), vector<pair<uint32_t, uint32_t>>()};
+        if (clusters != nullptr)
+        {
+            summary.componentCount = clusters->componentCount;
+            summary.communityCount = clusters->communityCount;
+            summary.rounds = clusters->rounds;
+            summary.largestComponents = largestClusters(clusters->componentSize, limit);
+            summary.largestCommunities = largestClusters(clusters->communitySize, limit);
+        }
+        return summary;
+    }
+
+    // The component and community of a user as (label, size) pairs from the latest analysis, running one if there
+    // is none yet. False for users the analysis did not see.
+    bool clusterOf(uint32_t id, pair<uint32_t, uint32_t> &component, pair<uint32_t, uint32_t> &community)
+    {
+        bool analyzed;
+        {
+            lock_guard<mutex> lock(clusterLock);
+            analyzed = clusters != nullptr;
+        }
+        if (!analyzed)
+        {
+            analyzeClusters();
+        }
+        lock_guard<mutex> lock(clusterLock);
+        if (id >= clusters->component.size() || clusters->component[id] == ClusterReport::NONE)
+        {
+            return false;
+        }
+        component = make_pair(clusters->component[id], clusters->componentSize[clusters->component[id]]);
+        community = make_pair(clusters->community[id], clusters->communitySize[clusters->community[id]]);
+        return true;
+    }
+
+    // Totals loaded from storage never pass through the tracker as like events, so every stored post is ranked by
+    // its total once after loading; likes within the window start from none.
+    void rankStoredPosts()
+    {
+        SharedLock table(tableLock);
+        uint32_t idLimit = directory.idLimit();
+        for (uint32_t id = 0; id < idLimit; id++)
+        {
+            if (findUserById(id) == nullptr)
+            {
+                continue;
+            }
+            SharedLock lock(stripes.of(id));
+            users[id].forEachPost([&](uint64_t sequence, const PostText &, int postLikes)
+                                  {
+                                      if (postLikes > 0)
+                                      {
+                                          trending.rank(sequence, id, postLikes);
+                                      }
+                                  });
+        }
+    }
+
+    // The posts liked most within the trending window, or of all time with allTime set, each with its likes in the
+    // window. With a valid viewer only the posts they can see are kept, so fewer than limit may come back.
+    vector<pair<FeedEntry, uint32_t>> trendingPosts(uint32_t viewerId, bool allTime, size_t limit)
+    {
+        LatencyTimer timer(metrics, Metric::Trending);
+        OperationScope scope(*this, false);
+        vector<pair<FeedEntry, uint32_t>> posts;
+        if (viewerId != UserDirectory::INVALID_ID && findUserById(viewerId) == nullptr)
+        {
+            return posts;
+        }
+        for (const TrendingPost &candidate : trending.top(allTime, TrendingTracker::CAPACITY))
+        {
+            if (posts.size() == limit)
+            {
+                break;
+            }
+            SharedLock lock(stripes.of(candidate.author));
+            const UserProfile *profile = findUserById(candidate.author) != nullptr ? users[candidate.author].getProfile() : nullptr;
+            bool visible = profile != nullptr && (viewerId == UserDirectory::INVALID_ID || graph.canSeePosts(candidate.author, viewerId));
+            int index = visible ? profile->findPost(candidate.sequence) : -1;
+            if (index >= 0)
+            {
+                posts.push_back(make_pair(FeedEntry{candidate.author, candidate.sequence, profile->getPost(index), profile->getLikes(index)},
+                                          candidate.recentLikes));
+            }
+        }
+        return posts;
+    }
+
+    vector<uint32_t> friendsOf(uint32_t id) const
+    {
+        SharedLock table(tableLock);
+        SharedLock lock(stripes.of(id));
+        return findUserById(id) != nullptr ? graph.getFriendList(id) : vector<uint32_t>();
+    }
+
+    // Pages through a user's received requests, or sent ones with outgoing set, newest first.
+    vector<uint32_t> requestsOf(uint32_t id, bool outgoing, size_t limit, uint64_t cursor, uint64_t &nextCursor)
+    {
+        OperationScope scope(*this, false);
+        SharedLock lock(stripes.of(id));
+        nextCursor = 0;
+        if (findUserById(id) == nullptr)
+        {
+            return vector<uint32_t>();
+        }
+        const UserProfile *profile = users[id].getProfile();
+        return (outgoing ? profile->getFriendRequests() : profile->getPendingRequests()).page(limit, cursor, nextCursor);
+    }
+
+    vector<FeedEntry> postsOf(uint32_t id)
+    {
+        OperationScope scope(*this, false);
+        SharedLock lock(stripes.of(id));
+        vector<FeedEntry> posts;
+        if (findUserById(id) != nullptr)
+        {
+            const UserProfile *profile = users[id].getProfile();
+            for (size_t i = 0; i < profile->getPostCount(); i++)
+            {
+                if (profile->isLive(i))
+                {
+                    posts.push_back(FeedEntry{id, profile->getPostSequences()[i], profile->getPost(i), profile->getLikes(i)});
+                }
+            }
+        }
+        return posts;
+    }
+
+    uint32_t findUserId(const string &username) const
+    {
+        SharedLock table(tableLock);
+        return liveId(username);
+    }
+
+    string nameOf(uint32_t id) const
+    {
+        SharedLock table(tableLock);
+        return directory.nameOf(id);
+    }
+
+    // Records are synced in groups of up to groupCommitRecords, at most groupCommitMillis after the first of them
+    // was written. With waitForDurable, each operation returns only once its records are synced; without, it
+    // returns as soon as they are queued, and callers that need an acknowledgment call syncJournal.
+    void setDurability(size_t groupCommitRecords, int groupCommitMillis, bool waitForDurable)
+    {
+        logWriter.groupCommitRecords = groupCommitRecords;
+        logWriter.groupCommitMillis = groupCommitMillis;
+        durableOperations = waitForDurable;
+    }
+
+    // Bounds how many profiles stay in memory. Past it, profiles not used lately are dropped and read back from the
+    // snapshot when next needed.
+    void setProfileCapacity(size_t capacity)
+    {
+        profiles.setCapacity(capacity);
+    }
+
+    // Waits until everything logged so far, by any thread, is synced. Returns false if the journal failed to write
+    // or sync; from then on nothing more is acknowledged as durable.
+    bool syncJournal()
+    {
+        return logWriter.waitDurable(logWriter.lastSubmitted());
+    }
+
+    // Whether the last operation on this thread logged a change after the journal had failed.
+    bool changeUnsaved() const
+    {
+        return lastLogged.owner == this && logWriter.failed();
+    }
+
+    vector<pair<string, uint64_t>> sampleGauges() const
+    {
+        vector<pair<string, uint64_t>> gauges;
+        {
+            SharedLock table(tableLock);
+            gauges.push_back(make_pair("users", directory.size()));
+        }
+        gauges.push_back(make_pair("friendships", graph.getEdgeCount()));
+        gauges.push_back(make_pair("posts", livePosts.load()));
+        gauges.push_back(make_pair("next_post_id", nextPostSequence.load()));
+        gauges.push_back(make_pair("journal_bytes", journal.size()));
+        gauges.push_back(make_pair("journal_unsynced_records", logWriter.lastSubmitted() - logWriter.lastDurable()));
+        gauges.push_back(make_pair("profiles_resident", profiles.resident()));
+        gauges.push_back(make_pair("profile_loads", profiles.loads()));
+        gauges.push_back(make_pair("profile_evictions", profiles.evictions()));
+        return gauges;
+    }
+
+    void writeMetrics(ostream &out) const
+    {
+        metrics.writeText(out, sampleGauges());
+    }
+
+    string metricsJson() const
+    {
+        return metrics.toJson(sampleGauges());
+    }
+
+    void registerUser()
+    {
+        string username, password;
+        cout << "\t\tEnter User Name: ";
+        cin >> username;
+        cout << "\t\tEnter Password: ";
+        cin >> password;
+
+        OpStatus status = createAccount(username, password);
+        if (status == OpStatus::InvalidUsername)
+        {
+            cout << "\t\tUser Name must be a single word." << endl;
+            return;
+        }
+        if (status == OpStatus::UserExists)
+        {
+            cout << "\t\tUser Name already exists." << endl;
+            return;
+        }
+
+        cout << "\t\tUser Registered Successfully." << endl;
+    }
+
+    void loginUser(const string &name, const string &pass)
+    {
+        Session session;
+        if (authenticate(name, pass, session) == OpStatus::Ok)
+        {
+            cout << "\t\tLogin Successful." << endl;
+            showPendingRequests(session.userId);
+            profileMenu(session);
+            return;
+        }
+        cout << "\t\tInvalid User Name or Password." << endl;
+    }
+
+    User *findUserById(uint32_t id) const
+    {
+        if (id >= users.size() || !users[id].exists())
+        {
+            return nullptr;
+        }
+        return const_cast<User *>(&users[id]);
+    }
+
+    User *findUserByUsername(const string &username) const
+    {
+        uint32_t id = directory.find(username);
+        if (id == UserDirectory::INVALID_ID)
+        {
+            return nullptr;
+        }
+        return findUserById(id);
+    }
+
+    bool areFriends(uint32_t a, uint32_t b) const
+    {
+        SharedLock table(tableLock);
+        SharedLock lock(stripes.of(a));
+        return findUserById(a) != nullptr && graph.isFriend(a, b);
+    }
+
+    // Prints a user's own posts and returns how many there are.
+    size_t showPosts(uint32_t id)
+    {
+        OperationScope scope(*this, false);
+        SharedLock lock(stripes.of(id));
+        User *user = findUserById(id);
+        if (user == nullptr)
+        {
+            return 0;
+        }
+        user->getProfile()->showPosts();
+        return user->getProfile()->getLivePostCount();
+    }
+
+    void showUsers() const
+    {
+        cout << "\t\t--- Users List ---" << endl;
+        string last;
+        for (;;)
+        {
+            vector<uint32_t> page = usersWithPrefix(string(), last, 20);
+            for (uint32_t id : page)
+            {
+                last = nameOf(id);
+                cout << "\t\t" << last << endl;
+            }
+            if (page.size() < 20)
+            {
+                return;
+            }
+
+            char more;
+            cout << "\t\tShow more users [Yes/No]? ";
+            cin >> more;
+            if (more != 'y' && more != 'Y')
+            {
+                return;
+            }
+        }
+    }
+
+    void searchUser(const string &username) const
+    {
+        bool found = findUserId(username) != UserDirectory::INVALID_ID;
+        cout << (found ? "\t\tUser Found" : "\t\tUser Not Found") << endl;
+
+        vector<uint32_t> matches = searchUsers(username, found ? 11 : 10);
+        matches.erase(remove(matches.begin(), matches.end(), findUserId(username)), matches.end());
+        if (!matches.empty())
+        {
+            cout << (found ? "\t\tOther matches:" : "\t\tDid you mean:") << endl;
+            for (uint32_t id : matches)
+            {
+                cout << "\t\t- " << nameOf(id) << endl;
+            }
+        }
+    }
+
+    void showPendingRequests(uint32_t id)
+    {
+        OperationScope scope(*this, false);
+        vector<uint32_t> pendingRequests;
+        {
+            SharedLock lock(stripes.of(id));
+            if (findUserById(id) != nullptr)
+            {
+                pendingRequests = users[id].getProfile()->getPendingRequests().toVector();
+            }
+        }
+        if (pendingRequests.empty())
+        {
+            cout << "\t\tNo pending friend requests." << endl;
+        }
+        else
+        {
+            cout << "\t\tPending Friend Requests:" << endl;
+            for (uint32_t requestId : pendingRequests)
+            {
+                cout << "\t\t- " << directory.nameOf(requestId) << endl;
+            }
+        }
+    }
+
+    void showFriendList(uint32_t id) const
+    {
+        SharedLock table(tableLock);
+        vector<uint32_t> friends;
+        {
+            SharedLock lock(stripes.of(id));
+            friends = graph.getFriendList(id);
+        }
+        if (friends.empty())
+        {
+            cout << "\t\tNo friends in the friend list." << endl;
+        }
+        else
+        {
+            cout << "\t\tFriend List:" << endl;
+            for (uint32_t friendId : friends)
+            {
+                cout << "\t\t- " << directory.nameOf(friendId) << endl;
+            }
+        }
+    }
+
+    void showSearchResults(uint32_t viewerId, const string &query)
+    {
+        vector<FeedEntry> results = searchPosts(viewerId, query, 10);
+        if (results.empty())
+        {
+            cout << "\t\tNo posts match your search." << endl;
+            return;
+        }
+        for (const FeedEntry &entry : results)
+        {
+            cout << "\t\t- " << nameOf(entry.author) << ": " << entry.text << " (Likes: " << entry.likes << ")" << endl;
+        }
+    }
+
+    void showTrending(uint32_t viewerId)
+    {
+        for (bool allTime : {false, true})
+        {
+            vector<pair<FeedEntry, uint32_t>> posts = trendingPosts(viewerId, allTime, 10);
+            cout << (allTime ? "\t\t--- Most liked of all time ---" : "\t\t--- Trending now ---") << endl;
+            if (posts.empty())
+            {
+                cout << "\t\tNothing to show yet." << endl;
+            }
+            for (const pair<FeedEntry, uint32_t> &post : posts)
+            {
+                cout << "\t\t- " << nameOf(post.first.author) << ": " << post.first.text << " (Likes: " << post.first.likes
+                     << ", lately: " << post.second << ")" << endl;
+            }
+        }
+    }
+
+    void showConnection(const string &username, const string &otherUsername)
+    {
+        vector<uint32_t> path;
+        OpStatus status = connectionBetween(username, otherUsername, path);
+        if (status == OpStatus::UserNotFound)
+        {
+            cout << "\t\tUser Not Found." << endl;
+            return;
+        }
+        if (status == OpStatus::NotConnected)
+        {
+            cout << "\t\tYou are not connected to " << otherUsername << "." << endl;
+            return;
+        }
+        cout << "\t\t";
+        for (size_t i = 0; i < path.size(); i++)
+        {
+            cout << (i > 0 ? " -> " : "") << nameOf(path[i]);
+        }
+        cout << " (" << path.size() - 1 << (path.size() == 2 ? " step)" : " steps)") << endl;
+    }
+
+    // Prints the sizes of the largest clusters and, given a path, writes "user,component,community" for every user,
+    // each cluster named by its label user.
+    bool reportClusters(ostream &out, const string &path)
+    {
+        analyzeClusters();
+        ClusterSummary summary = clusterSummary(10);
+        out << summary.componentCount << " components, " << summary.communityCount << " communities after " << summary.rounds
+            << (summary.rounds == 1 ? " round" : " rounds") << endl;
+        for (int kind = 0; kind < 2; kind++)
+        {
+            out << (kind == 0 ? "Largest components:" : "Largest communities:");
+            for (const pair<uint32_t, uint32_t> &cluster : kind == 0 ? summary.largestComponents : summary.largestCommunities)
+            {
+                out << " " << nameOf(cluster.first) << " (" << cluster.second << ")";
+            }
+            out << endl;
+        }
+        if (path.empty())
+        {
+            return true;
+        }
+
+        ofstream file(path);
+        if (!file.is_open())
+        {
+            out << "Unable to write " << path << endl;
+            return false;
+        }
+        SharedLock table(tableLock);
+        lock_guard<mutex> lock(clusterLock);
+        for (uint32_t id = 0; id < clusters->component.size(); id++)
+        {
+            if (clusters->component[id] != ClusterReport::NONE && findUserById(id) != nullptr)
+            {
+                file << directory.nameOf(id) << ',' << directory.nameOf(clusters->component[id]) << ','
+                     << directory.nameOf(clusters->community[id]) << '\n';
+            }
+        }
+        return true;
+    }
+
+    void showRecommendations(uint32_t id)
+    {
+        vector<Recommendation> suggestions = recommendFriends(id, 10);
+        if (suggestions.empty())
+        {
+            cout << "\t\tNo suggestions yet. Add some friends first." << endl;
+            return;
+        }
+        cout << "\t\tPeople you may know:" << endl;
+        for (const Recommendation &suggestion : suggestions)
+        {
+            cout << "\t\t- " << nameOf(suggestion.id) << " (" << suggestion.mutualFriends
+                 << (suggestion.mutualFriends == 1 ? " mutual friend)" : " mutual friends)") << endl;
+        }
+    }
+
+    void deleteUser(const string &username)
+    {
+        if (deleteAccount(username) == OpStatus::Ok)
+        {
+            cout << "\t\tUser Removed Successfully." << endl;
+            return;
+        }
+        cout << "\t\tUser Not Found." << endl;
+    }
+
+    void sendFriendRequest(const string &sender, const string &receiver)
+    {
+        OpStatus status = requestFriendship(sender, receiver);
+        if (status == OpStatus::Ok)
+        {
+            cout << "\t\tFriend Request Sent Successfully." << endl;
+        }
+        else if (status == OpStatus::AlreadyFriends)
+        {
+            cout << "\t\tYou are already friends." << endl;
+        }
+        else if (status == OpStatus::DuplicateRequest)
+        {
+            cout << "\t\tFriend Request Already Sent." << endl;
+        }
+        else
+        {
+            cout << "\t\tInvalid Usernames. Please Try Again." << endl;
+        }
+    }
+
+    void acceptFriendRequest(const string &username, const string &friendUsername)
+    {
+        OpStatus status = acceptFriendship(username, friendUsername);
+        if (status == OpStatus::Ok)
+        {
+            cout << "\t\tFriend Request Accepted Successfully." << endl;
+        }
+        else if (status == OpStatus::NoRequest)
+        {
+            cout << "\t\tNo pending request from that particular user." << endl;
+        }
+        else
+        {
+            cout << "\t\tInvalid Usernames. Please Try Again." << endl;
+        }
+    }
+
+    void declineFriendRequest(const string &username, const string &senderUsername)
+    {
+        OpStatus status = declineFriendship(username, senderUsername);
+        if (status == OpStatus::Ok)
+        {
+            cout << "\t\tFriend Request Declined." << endl;
+        }
+        else if (status == OpStatus::NoRequest)
+        {
+            cout << "\t\tNo pending request from that particular user." << endl;
+        }
+        else
+        {
+            cout << "\t\tInvalid Usernames. Please Try Again." << endl;
+        }
+    }
+
+    void manageFriendRequests(const Session &session)
+    {
+        int option;
+        char choice;
+
+        do
+        {
+            system("cls");
+            cout << "\n\n\t\t--- Friend Requests Menu ---" << endl;
+            cout << "\t\t1. Show Pending Requests" << endl;
+            cout << "\t\t2. Accept Friend Request" << endl;
+            cout << "\t\t3. Decline Friend Request" << endl;
+            cout << "\t\t4. Accept All Requests" << endl;
+            cout << "\t\t5. Go Back" << endl;
+            cout << "\t\tEnter Your Choice: ";
+            cin >> option;
+
+            switch (option)
+            {
+            case 1:
+            {
+                showPendingRequests(session.userId);
+                break;
+            }
+            case 2:
+            {
+                string friendUsername;
+                cout << "\t\tEnter Friend's Username: ";
+                cin >> friendUsername;
+                acceptFriendRequest(session.username, friendUsername);
+                break;
+            }
+            case 3:
+            {
+                string senderUsername;
+                cout << "\t\tEnter Sender's Username: ";
+                cin >> senderUsername;
+                declineFriendRequest(session.username, senderUsername);
+                break;
+            }
+            case 4:
+            {
+                size_t answered;
+                respondToRequests(session.username, vector<string>(), true, answered);
+                cout << "\t\tAccepted " << answered << (answered == 1 ? " Friend Request." : " Friend Requests.") << endl;
+                break;
+            }
+            case 5:
+                return;
+            default:
+                cout << "\t\tInvalid Option. Please Try Again." << endl;
+                break;
+            }
+
+            cout << "\t\tDo You Want to Continue [Yes/No]? ";
+            cin >> choice;
+        } while (choice == 'y' || choice == 'Y');
+    }
+
+    void profileMenu(Session &session)
+    {
+        int option;
+        char choice;
+
+        do
+        {
+            system("cls");
+            cout << "\t\tThis is " << session.username << "'s profile." << endl;
+            cout << "\n\n\t\t--- Profile Menu ---" << endl;
+            cout << "\t\t1. Manage Friend Requests" << endl;
+            cout << "\t\t2. Send Friend Request" << endl;
+            cout << "\t\t3. View Friend List" << endl;
+            cout << "\t\t4. Add Post" << endl;
+            cout << "\t\t5. Delete Post" << endl;
+            cout << "\t\t6. Show Posts" << endl;
+            cout << "\t\t7. Like Post" << endl;
+            cout << "\t\t8. Show Posts of your friends" << endl;
+            cout << "\t\t9. Like Posts of your friends" << endl;
+            cout << "\t\t10. People you may know" << endl;
+            cout << "\t\t11. Search Posts" << endl;
+            cout << "\t\t12. How Are We Connected" << endl;
+            cout << "\t\t13. Trending Posts" << endl;
+            cout << "\t\t14. Logout" << endl;
+            cout << "\t\tEnter Your Choice: ";
+            cin >> option;
+
+            switch (option)
+            {
+            case 1:
+            {
+                manageFriendRequests(session);
+                break;
+            }
+            case 2:
+            {
+                string friendUsername;
+                cout << "\t\tEnter Friend's Username: ";
+                cin >> friendUsername;
+                sendFriendRequest(session.username, friendUsername);
+                break;
+            }
+            case 3:
+            {
+                showFriendList(session.userId);
+                break;
+            }
+            case 4:
+            {
+                string post;
+                cout << "\t\tEnter your post: ";
+                cin.ignore();
+                getline(cin, post);
+                addPost(session.userId, post);
+                cout << "\t\tPost added successfully!" << endl;
+                break;
+            }
+            case 5:
+            {
+                if (showPosts(session.userId) == 0)
+                {
+                    cout << "\t\tNo posts available to delete." << endl;
+                    break;
+                }
+                uint64_t postId;
+                cout << "\t\tEnter the ID of the post you want to delete: ";
+                cin >> postId;
+                deletePost(session.userId, postId);
+                cout << "\t\tPost deleted successfully!" << endl;
+                break;
+            }
+            case 6:
+            {
+                showPosts(session.userId);
+                break;
+            }
+            case 7:
+            {
+                if (showPosts(session.userId) == 0)
+                {
+                    cout << "\t\tNo posts available to like." << endl;
+                    break;
+                }
+                uint64_t postId;
+                cout << "\t\tEnter the ID of the post you want to like: ";
+                cin >> postId;
+                likePost(session.userId, postId);
+                cout << "\t\tPost liked successfully!" << endl;
+                break;
+            }
+            case 8:
+            {
+                showPostsOfFriends(session.userId);
+                break;
+            }
+            case 9:
+            {
+                vector<uint32_t> friendList = friendsOf(session.userId);
+                if (friendList.empty())
+                {
+                    cout << "\t\tYou have no friends to like their posts." << endl;
+                    break;
+                }
+                int friendIndex;
+                cout << "\t\tEnter the index of the friend whose posts you want to like: ";
+                cin >> friendIndex;
+                likePostsOfFriend(session, friendList, friendIndex);
+                break;
+            }
+            case 10:
+            {
+                showRecommendations(session.userId);
+                break;
+            }
+            case 11:
+            {
+                string query;
+                cout << "\t\tSearch for (\"phrase\", a OR b, -word): ";
+                cin.ignore();
+                getline(cin, query);
+                showSearchResults(session.userId, query);
+                break;
+            }
+            case 12:
+            {
+                string otherUsername;
+                cout << "\t\tEnter Username: ";
+                cin >> otherUsername;
+                showConnection(session.username, otherUsername);
+                break;
+            }
+            case 13:
+            {
+                showTrending(session.userId);
+                break;
+            }
+            case 14:
+            {
+                cout << "\t\tLogging out..." << endl;
+                return;
+            }
+            default:
+                cout << "\t\tInvalid Option. Please Try Again." << endl;
+                break;
+            }
+
+            cout << "\t\tDo You Want to Continue [Yes/No]? ";
+            cin >> choice;
+        } while (choice == 'y' || choice == 'Y');
+    }
+
+    void showPostsOfFriends(uint32_t viewerId)
+    {
+        if (friendsOf(viewerId).empty())
+        {
+            cout << "\t\tYou have no friends to see their posts." << endl;
+            return;
+        }
+
+        cout << "\t\t--- Posts of your friends ---" << endl;
+        uint64_t cursor = 0;
+        char more = 'n';
+        do
+        {
+            vector<FeedEntry> page = readFeed(viewerId, 10, cursor, cursor);
+            if (page.empty())
+            {
+                cout << "\t\tNo posts available." << endl;
+                break;
+            }
+            vector<bool> liked = likedBy(viewerId, page);
+            for (size_t i = 0; i < page.size(); i++)
+            {
+                const FeedEntry &entry = page[i];
+                cout << "\t\t- " << nameOf(entry.author) << " [" << entry.sequence << "] " << entry.text
+                     << " (Likes: " << entry.likes << (liked[i] ? ", liked by you" : "") << ")" << endl;
+            }
+            if (cursor == 0)
+            {
+                break;
+            }
+            cout << "\t\tShow older posts [Yes/No]? ";
+            cin >> more;
+        } while (more == 'y' || more == 'Y');
+    }
+
+    void likePostsOfFriend(const Session &session, const vector<uint32_t> &friendList, int friendIndex)
+    {
+        if (friendIndex >= 0 && friendIndex < (int)friendList.size())
+        {
+            uint32_t friendId = friendList[friendIndex];
+            if (areFriends(friendId, session.userId))
+            {
+                if (showPosts(friendId) == 0)
+                {
+                    cout << "\t\tNo posts available to like." << endl;
+                }
+                else
+                {
+                    uint64_t postId;
+                    cout << "\t\tEnter the ID of the post you want to like: ";
+                    cin >> postId;
+                    if (likeFriendPost(session.userId, nameOf(friendId), postId) == OpStatus::Ok)
+                    {
+                        cout << "\t\tPost liked successfully!" << endl;
+                    }
+                    else
+                    {
+                        cout << "\t\tUnable to like that post." << endl;
+                    }
+                }
+            }
+            else
+            {
+                cout << "\t\tYou are not allowed to like posts of that friend." << endl;
+            }
+        }
+        else
+        {
+            cout << "\t\tInvalid friend index." << endl;
+        }
+    }
+
+    void start()
+    {
+        int option;
+        char choice;
+
+        do
+        {
+            system("cls");
+            cout << "\n\n\t\t--- Welcome to social network connecter app ---" << endl;
+            cout << "\t\t1. Register new User" << endl;
+            cout << "\t\t2. Login existing User" << endl;
+            cout << "\t\t3. Search User" << endl;
+            cout << "\t\t4. Show All Users" << endl;
+            cout << "\t\t5. Delete User" << endl;
+            cout << "\t\t6. Exit" << endl;
+            cout << "\t\tEnter Your Choice: ";
+            cin >> option;
+
+            switch (option)
+            {
+            case 1:
+                registerUser();
+                break;
+            case 2:
+            {
+                string username, password;
+                cout << "\t\tEnter User Name: ";
+                cin >> username;
+                cout << "\t\tEnter Password: ";
+                cin >> password;
+                loginUser(username, password);
+                break;
+            }
+            case 3:
+            {
+                string username;
+                cout << "\t\tEnter User Name to Search: ";
+                cin >> username;
+                searchUser(username);
+                break;
+            }
+            case 4:
+                showUsers();
+                break;
+            case 5:
+            {
+                string username;
+                cout << "\t\tEnter User Name to Delete: ";
+                cin >> username;
+                deleteUser(username);
+                break;
+            }
+            case 6:
+                cout << "\t\tExiting..." << endl;
+                return;
+            default:
+                cout << "\t\tInvalid Option. Please Try Again." << endl;
+                break;
+            }
+
+            cout << "\t\tDo You Want to Continue [Yes/No]? ";
+            cin >> choice;
+        } while (choice == 'y' || choice == 'Y');
+    }
+};
+
+static void appendJsonString(string &out, const string &value)
+{
+    out.push_back('"');
+    for (unsigned char c : value)
+    {
+        switch (c)
+        {
+        case '"':
+            out.append("\\\"");
+            break;
+        case '\\':
+            out.append("\\\\");
+            break;
+        case '\n':
+            out.append("\\n");
+            break;
+        case '\r':
+            out.append("\\r");
+            break;
+        case '\t':
+            out.append("\\t");
+            break;
+        default:
+            if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out.append(escaped);
+            }
+            else
+            {
+                out.push_back(static_cast<char>(c));
+            }
+        }
+    }
+    out.push_back('"');
+}
+
+// Parses a single-level JSON object whose values are strings, numbers, booleans or null.
+static bool parseFlatJson(const string &line, vector<pair<string, string>> &fields)
+{
+    size_t i = 0;
+    auto skipSpace = [&]()
+    {
+        while (i < line.size() && isspace(static_cast<unsigned char>(line[i])))
+        {
+            i++;
+        }
+    };
+    auto parseString = [&](string &value) -> bool
+    {
+        if (i >= line.size() || line[i] != '"')
+        {
+            return false;
+        }
+        value.clear();
+        for (i++; i < line.size(); i++)
+        {
+            char c = line[i];
+            if (c == '"')
+            {
+                i++;
+                return true;
+            }
+            if (c != '\\')
+            {
+                value.push_back(c);
+                continue;
+            }
+            if (++i >= line.size())
+            {
+                return false;
+            }
+            switch (line[i])
+            {
+            case 'n':
+                value.push_back('\n');
+                break;
+            case 't':
+                value.push_back('\t');
+                break;
+            case 'r':
+                value.push_back('\r');
+                break;
+            case 'b':
+                value.push_back('\b');
+                break;
+            case 'f':
+                value.push_back('\f');
+                break;
+            case 'u':
+            {
+                if (i + 4 >= line.size() || !isxdigit(static_cast<unsigned char>(line[i + 1])) || !isxdigit(static_cast<unsigned char>(line[i + 2])) ||
+                    !isxdigit(static_cast<unsigned char>(line[i + 3])) || !isxdigit(static_cast<unsigned char>(line[i + 4])))
+                {
+                    return false;
+                }
+                unsigned code = static_cast<unsigned>(strtoul(line.substr(i + 1, 4).c_str(), nullptr, 16));
+                i += 4;
+                if (code < 0x80)
+                {
+                    value.push_back(static_cast<char>(code));
+                }
+                else if (code < 0x800)
+                {
+                    value.push_back(static_cast<char>(0xC0 | (code >> 6)));
+                    value.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+                else
+                {
+                    value.push_back(static_cast<char>(0xE0 | (code >> 12)));
+                    value.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                    value.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+                break;
+            }
+            default:
+                value.push_back(line[i]);
+                break;
+            }
+        }
+        return false;
+    };
+
+    fields.clear();
+    skipSpace();
+    if (i >= line.size() || line[i++] != '{')
+    {
+        return false;
+    }
+    skipSpace();
+    if (i < line.size() && line[i] == '}')
+    {
+        return true;
+    }
+
+    while (true)
+    {
+        string key, value;
+        skipSpace();
+        if (!parseString(key))
+        {
+            return false;
+        }
+        skipSpace();
+        if (i >= line.size() || line[i++] != ':')
+        {
+            return false;
+        }
+        skipSpace();
+        if (i < line.size() && line[i] == '"')
+        {
+            if (!parseString(value))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            size_t start = i;
+            while (i < line.size() && line[i] != ',' && line[i] != '}' && !isspace(static_cast<unsigned char>(line[i])))
+            {
+                i++;
+            }
+            value = line.substr(start, i - start);
+            if (value.empty())
+            {
+                return false;
+            }
+        }
+        fields.push_back(make_pair(key, value));
+
+        skipSpace();
+        if (i < line.size() && line[i] == ',')
+        {
+            i++;
+            continue;
+        }
+        if (i < line.size() && line[i] == '}')
+        {
+            return true;
+        }
+        return false;
+    }
+}
+
+struct BatchCommand
+{
+    string op;
+    string user;
+    string password;
+    string other;
+    string text;
+    long long post;
+    long long limit;
+    long long cursor;
+    vector<string> names;
+};
+
+class BatchRunner
+{
+private:
+    UserManager &manager;
+    string output;
+    size_t executed;
+    size_t failed;
+    uint64_t createdPost;
+    vector<uint32_t> likers;
+    size_t answered;
+    vector<uint32_t> path;
+    pair<uint32_t, uint32_t> component;
+    pair<uint32_t, uint32_t> community;
+
+    static bool parseIndex(const string &value, long long &index)
+    {
+        char *end = nullptr;
+        errno = 0;
+        index = strtoll(value.c_str(), &end, 10);
+        return !value.empty() && end != nullptr && *end == '\0' && errno != ERANGE;
+    }
+
+    static bool takesPost(const string &op)
+    {
+        return op == "delete_post" || op == "like" || op == "unlike" || op == "likers";
+    }
+
+    static bool parseText(const string &line, BatchCommand &command, string &error)
+    {
+        istringstream in(line);
+        string post;
+        in >> command.op;
+        if (command.op == "register" || command.op == "login")
+        {
+            in >> command.user >> command.password;
+        }
+        else if (command.op == "send_request" || command.op == "accept" || command.op == "decline" || command.op == "path")
+        {
+            in >> command.user >> command.other;
+        }
+        else if (isPrepare(command.op))
+        {
+            in >> command.user >> command.other >> command.text;
+        }
+        else if (takesNames(command.op))
+        {
+            string name;
+            in >> command.user;
+            while (in >> name)
+            {
+                command.names.push_back(name);
+            }
+        }
+        else if (command.op == "delete_user" || command.op == "friends" || command.op == "posts" || command.op == "remote_user")
+        {
+            in >> command.user;
+        }
+        else if (command.op == "feed" || command.op == "requests" || command.op == "sent_requests")
+        {
+            string limit, cursor;
+            in >> command.user >> limit >> cursor;
+            if ((!limit.empty() && !parseIndex(limit, command.limit)) || (!cursor.empty() && !parseIndex(cursor, command.cursor)))
+            {
+                error = "bad_arguments";
+                return false;
+            }
+        }
+        else if (command.op == "search_posts")
+        {
+            in >> command.user;
+            getline(in >> ws, command.text);
+        }
+        else if (command.op == "search")
+        {
+            string limit;
+            in >> command.user >> command.text >> limit;
+            if (command.text.empty() || (!limit.empty() && !parseIndex(limit, command.limit)))
+            {
+                error = "bad_arguments";
+                return false;
+            }
+        }
+        else if (command.op == "recommend")
+        {
+            string limit;
+            in >> command.user >> limit;
+            if (!limit.empty() && !parseIndex(limit, command.limit))
+            {
+                error = "bad_arguments";
+                return false;
+            }
+        }
+        else if (command.op == "post")
+        {
+            in >> command.user;
+            getline(in >> ws, command.text);
+        }
+        else if (command.op == "post_after")
+        {
+            string floor;
+            in >> command.user >> floor;
+            getline(in >> ws, command.text);
+            if (!parseIndex(floor, command.cursor))
+            {
+                error = "bad_arguments";
+                return false;
+            }
+        }
+        else if (command.op == "delete_post")
+        {
+            in >> command.user >> post;
+        }
+        else if (command.op == "like" || command.op == "unlike" || command.op == "likers")
+        {
+            in >> command.user >> command.other >> post;
+        }
+        else if (command.op == "metrics")
+        {
+            in >> command.user;
+        }
+        else if (command.op == "sync")
+        {
+        }
+        else if (command.op == "clusters" || command.op == "trending" || command.op == "top_posts")
+        {
+            string limit;
+            in >> limit;
+            if (!limit.empty() && !parseIndex(limit, command.limit))
+            {
+                error = "bad_arguments";
+                return false;
+            }
+        }
+        else if (command.op == "cluster")
+        {
+            in >> command.user;
+        }
+        else
+        {
+            error = "unknown_op";
+            return false;
+        }
+
+        if ((command.user.empty() && needsUser(command.op)) || command.limit < 0 || command.cursor < 0 ||
+            (!post.empty() && (!parseIndex(post, command.post) || command.post < 1)) ||
+            (takesPost(command.op) && post.empty()))
+        {
+            error = "bad_arguments";
+            return false;
+        }
+        return true;
+    }
+
+    static bool parseJson(const string &line, BatchCommand &command, string &error)
+    {
+        vector<pair<string, string>> fields;
+        if (!parseFlatJson(line, fields))
+        {
+            error = "bad_json";
+            return false;
+        }
+
+        bool hasPost = false;
+        for (const pair<string, string> &field : fields)
+        {
+            if (field.first == "op")
+            {
+                command.op = field.second;
+            }
+            else if (field.first == "user")
+            {
+                command.user = field.second;
+            }
+            else if (field.first == "password")
+            {
+                command.password = field.second;
+            }
+            else if (field.first == "to" || field.first == "from" || field.first == "owner")
+            {
+                command.other = field.second;
+            }
+            else if (field.first == "text" || field.first == "remote")
+            {
+                command.text = field.second;
+            }
+            else if (field.first == "post")
+            {
+                if (!parseIndex(field.second, command.post) || command.post < 1)
+                {
+                    error = "bad_arguments";
+                    return false;
+                }
+                hasPost = true;
+            }
+            else if (field.first == "limit" || field.first == "cursor")
+            {
+                if (!parseIndex(field.second, field.first == "limit" ? command.limit : command.cursor))
+                {
+                    error = "bad_arguments";
+                    return false;
+                }
+            }
+        }
+
+        // The senders of a bulk answer come as one space-separated "from" field.
+        if (takesNames(command.op))
+        {
+            istringstream names(command.other);
+            string name;
+            while (names >> name)
+            {
+                command.names.push_back(name);
+            }
+        }
+
+        if (command.op.empty() || (command.user.empty() && needsUser(command.op)) || command.limit < 0 || command.cursor < 0 ||
+            (takesPost(command.op) && !hasPost))
+        {
+            error = "bad_arguments";
+            return false;
+        }
+        return true;
+    }
+
+    void beginResult(size_t lineNumber, const string &op)
+    {
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(",\"op\":");
+        appendJsonString(output, op);
+    }
+
+    void endResult(const char *status)
+    {
+        output.append(",\"status\":\"");
+        output.append(status);
+        output.append("\"}\n");
+        executed++;
+        if (strcmp(status, "ok") != 0)
+        {
+            failed++;
+        }
+    }
+
+    void appendUsers(const vector<uint32_t> &ids, const char *key = "users")
+    {
+        output.append(",\"");
+        output.append(key);
+        output.append("\":[");
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            if (i > 0)
+            {
+                output.push_back(',');
+            }
+            appendJsonString(output, manager.nameOf(ids[i]));
+        }
+        output.push_back(']');
+    }
+
+    void appendCluster(const char *key, const pair<uint32_t, uint32_t> &cluster)
+    {
+        output.append(",\"");
+        output.append(key);
+        output.append("\":{\"user\":");
+        appendJsonString(output, manager.nameOf(cluster.first));
+        output.append(",\"size\":");
+        output.append(to_string(cluster.second));
+        output.push_back('}');
+    }
+
+    void appendClusterList(const char *key, const vector<pair<uint32_t, uint32_t>> &clusters)
+    {
+        output.append(",\"");
+        output.append(key);
+        output.append("\":[");
+        for (size_t i = 0; i < clusters.size(); i++)
+        {
+            output.append(i == 0 ? "{\"user\":" : ",{\"user\":");
+            appendJsonString(output, manager.nameOf(clusters[i].first));
+            output.append(",\"size\":");
+            output.append(to_string(clusters[i].second));
+            output.push_back('}');
+        }
+        output.push_back(']');
+    }
+
+    void appendClusterSummary(const ClusterSummary &summary)
+    {
+        output.append(",\"components\":");
+        output.append(to_string(summary.componentCount));
+        output.append(",\"communities\":");
+        output.append(to_string(summary.communityCount));
+        output.append(",\"rounds\":");
+        output.append(to_string(summary.rounds));
+        appendClusterList("largest_components", summary.largestComponents);
+        appendClusterList("largest_communities", summary.largestCommunities);
+    }
+
+    void appendPosts(uint32_t viewerId, const vector<FeedEntry> &page)
+    {
+        vector<bool> liked = manager.likedBy(viewerId, page);
+        output.append(",\"posts\":[");
+        for (size_t i = 0; i < page.size(); i++)
+        {
+            const FeedEntry &entry = page[i];
+            output.append(i == 0 ? "{\"author\":" : ",{\"author\":");
+            appendJsonString(output, manager.nameOf(entry.author));
+            output.append(",\"post\":");
+            output.append(to_string(entry.sequence));
+            output.append(",\"likes\":");
+            output.append(to_string(entry.likes));
+            output.append(liked[i] ? ",\"liked\":true" : ",\"liked\":false");
+            output.append(",\"text\":");
+            appendJsonString(output, entry.text);
+            output.push_back('}');
+        }
+        output.push_back(']');
+    }
+
+    void appendRanked(const vector<pair<FeedEntry, uint32_t>> &posts)
+    {
+        output.append(",\"posts\":[");
+        for (size_t i = 0; i < posts.size(); i++)
+        {
+            const FeedEntry &entry = posts[i].first;
+            output.append(i == 0 ? "{\"author\":" : ",{\"author\":");
+            appendJsonString(output, manager.nameOf(entry.author));
+            output.append(",\"post\":");
+            output.append(to_string(entry.sequence));
+            output.append(",\"likes\":");
+            output.append(to_string(entry.likes));
+            output.append(",\"recent_likes\":");
+            output.append(to_string(posts[i].second));
+            output.append(",\"text\":");
+            appendJsonString(output, entry.text);
+            output.push_back('}');
+        }
+        output.push_back(']');
+    }
+
+    // Read-only commands add their results to the response once the command has succeeded.
+    void appendResults(uint32_t userId, const BatchCommand &command)
+    {
+        if (command.op == "feed")
+        {
+            uint64_t nextCursor;
+            appendPosts(userId, manager.readFeed(userId, static_cast<size_t>(command.limit), static_cast<uint64_t>(command.cursor), nextCursor));
+            output.append(",\"next_cursor\":");
+            output.append(to_string(nextCursor));
+        }
+        else if (command.op == "posts")
+        {
+            appendPosts(userId, manager.postsOf(userId));
+        }
+        else if (command.op == "friends")
+        {
+            appendUsers(manager.friendsOf(userId));
+        }
+        else if (command.op == "requests" || command.op == "sent_requests")
+        {
+            uint64_t nextCursor;
+            appendUsers(manager.requestsOf(userId, command.op == "sent_requests", static_cast<size_t>(command.limit),
+                                           static_cast<uint64_t>(command.cursor), nextCursor));
+            output.append(",\"next_cursor\":");
+            output.append(to_string(nextCursor));
+        }
+        else if (command.op == "search_posts")
+        {
+            appendPosts(userId, manager.searchPosts(userId, command.text, static_cast<size_t>(command.limit)));
+        }
+        else if (command.op == "likers")
+        {
+            appendUsers(likers);
+        }
+        else if (command.op == "search")
+        {
+            appendUsers(manager.searchUsers(command.text, static_cast<size_t>(command.limit)));
+        }
+        else if (command.op == "recommend")
+        {
+            output.append(",\"recommendations\":[");
+            bool first = true;
+            for (const Recommendation &suggestion : manager.recommendFriends(userId, static_cast<size_t>(command.limit)))
+            {
+                output.append(first ? "{\"user\":" : ",{\"user\":");
+                appendJsonString(output, manager.nameOf(suggestion.id));
+                output.append(",\"mutual_friends\":");
+                output.append(to_string(suggestion.mutualFriends));
+                output.push_back('}');
+                first = false;
+            }
+            output.push_back(']');
+        }
+    }
+
+    OpStatus execute(const BatchCommand &command, Session &session, bool &known)
+    {
+        known = true;
+        if (command.op == "register")
+        {
+            return manager.createAccount(command.user, command.password);
+        }
+        if (command.op == "login")
+        {
+            return manager.authenticate(command.user, command.password, session);
+        }
+        if (command.op == "delete_user")
+        {
+            return manager.deleteAccount(command.user);
+        }
+        if (command.op == "send_request")
+        {
+            return manager.requestFriendship(command.user, command.other);
+        }
+        if (command.op == "accept")
+        {
+            return manager.acceptFriendship(command.user, command.other);
+        }
+        if (command.op == "decline")
+        {
+            return manager.declineFriendship(command.user, command.other);
+        }
+        if (command.op == "path")
+        {
+            return manager.connectionBetween(command.user, command.other, path);
+        }
+        if (command.op == "remote_user")
+        {
+            return manager.addRemoteUser(command.user);
+        }
+        if (isPrepare(command.op))
+        {
+            FriendChange change = command.op == "prepare_request" ? FriendChange::Request : command.op == "prepare_accept" ? FriendChange::Accept
+                                                                                                                          : FriendChange::Decline;
+            return manager.checkFriendship(change, command.user, command.other, command.text);
+        }
+        if (takesNames(command.op))
+        {
+            return manager.respondToRequests(command.user, command.names, command.op == "accept_many", answered);
+        }
+        if (command.op == "metrics")
+        {
+            return OpStatus::Ok;
+        }
+        if (command.op == "clusters")
+        {
+            manager.analyzeClusters();
+            return OpStatus::Ok;
+        }
+        if (command.op == "trending" || command.op == "top_posts")
+        {
+            return OpStatus::Ok;
+        }
+        // Commands return once their records are queued; this one returns once all of them are on disk.
+        if (command.op == "sync")
+        {
+            return manager.syncJournal() ? OpStatus::Ok : OpStatus::StorageError;
+        }
+
+        if (command.op != "post" && command.op != "post_after" && command.op != "delete_post" && command.op != "like" && command.op != "unlike" &&
+            command.op != "cluster" && !isQuery(command.op))
+        {
+            known = false;
+            return OpStatus::Ok;
+        }
+        uint32_t userId = manager.findUserId(command.user);
+        if (userId == UserDirectory::INVALID_ID)
+        {
+            return OpStatus::UserNotFound;
+        }
+        if (command.op == "post")
+        {
+            return manager.addPost(userId, command.text, createdPost);
+        }
+        // A post from a router, numbered no lower than the cursor.
+        if (command.op == "post_after")
+        {
+            return manager.addPost(userId, command.text, createdPost, static_cast<uint64_t>(command.cursor));
+        }
+        if (command.op == "delete_post")
+        {
+            return manager.deletePost(userId, static_cast<uint64_t>(command.post));
+        }
+        if (command.op == "like")
+        {
+            return manager.likeFriendPost(userId, command.other, static_cast<uint64_t>(command.post));
+        }
+        if (command.op == "unlike")
+        {
+            return manager.unlikePost(userId, command.other, static_cast<uint64_t>(command.post));
+        }
+        if (command.op == "likers")
+        {
+            return manager.likersOf(userId, command.other, static_cast<uint64_t>(command.post), likers);
+        }
+        if (command.op == "cluster")
+        {
+            return manager.clusterOf(userId, component, community) ? OpStatus::Ok : OpStatus::UserNotFound;
+        }
+        return OpStatus::Ok;
+    }
+
+    static bool isQuery(const string &op)
+    {
+        return op == "feed" || op == "posts" || op == "friends" || op == "requests" || op == "sent_requests" || op == "recommend" ||
+               op == "search" || op == "search_posts" || op == "likers";
+    }
+
+public:
+    static bool takesNames(const string &op)
+    {
+        return op == "accept_many" || op == "decline_many";
+    }
+
+    // The checks a router runs on both shards before a friendship change that spans them; the text names the user
+    // homed on the other shard.
+    static bool isPrepare(const string &op)
+    {
+        return op == "prepare_request" || op == "prepare_accept" || op == "prepare_decline";
+    }
+
+    static bool needsUser(const string &op)
+    {
+        return op != "metrics" && op != "clusters" && op != "trending" && op != "top_posts" && op != "sync";
+    }
+
+    BatchRunner(UserManager &userManager) : manager(userManager)
+    {
+        executed = 0;
+        failed = 0;
+        createdPost = 0;
+        answered = 0;
+    }
+
+    void flushOutput()
+    {
+        fwrite(output.data(), 1, output.size(), stdout);
+        output.clear();
+    }
+
+    // Parses the command starting at start. With a session, commands that take a user, other than register and
+    // login, act as the logged-in user and leave out the user argument; bound tells whether this one did.
+    static bool parse(string &line, size_t start, const Session *session, BatchCommand &command, string &error, bool &bound)
+    {
+        command = BatchCommand{string(), string(), string(), string(), string(), 0, 20, 0, vector<string>()};
+        bool json = line[start] == '{';
+        bound = false;
+        if (session != nullptr && json)
+        {
+            command.user = session->username;
+        }
+        else if (session != nullptr)
+        {
+            size_t opEnd = line.find_first_of(" \t", start);
+            string op = line.substr(start, opEnd == string::npos ? string::npos : opEnd - start);
+            if (op != "register" && op != "login" && needsUser(op))
+            {
+                line.insert(opEnd == string::npos ? line.size() : opEnd, " " + session->username);
+                bound = true;
+            }
+        }
+        bool parsed = json ? parseJson(line, command, error) : parseText(line, command, error);
+        if (session != nullptr && json && command.op != "register" && command.op != "login" && needsUser(command.op))
+        {
+            command.user = session->username;
+            bound = true;
+        }
+        return parsed;
+    }
+
+    // The command as one JSON line that parses back to the same command, with the user spelled out.
+    static string toJson(const BatchCommand &command)
+    {
+        string line = "{\"op\":";
+        appendJsonString(line, command.op);
+        line.append(",\"user\":");
+        appendJsonString(line, command.user);
+        if (!command.password.empty())
+        {
+            line.append(",\"password\":");
+            appendJsonString(line, command.password);
+        }
+        string other = command.other;
+        for (const string &name : command.names)
+        {
+            other.append(other.empty() ? name : " " + name);
+        }
+        if (!other.empty())
+        {
+            line.append(",\"to\":");
+            appendJsonString(line, other);
+        }
+        if (!command.text.empty())
+        {
+            line.append(",\"text\":");
+            appendJsonString(line, command.text);
+        }
+        if (takesPost(command.op))
+        {
+            line.append(",\"post\":" + to_string(command.post));
+        }
+        line.append(",\"limit\":" + to_string(command.limit) + ",\"cursor\":" + to_string(command.cursor) + "}");
+        return line;
+    }
+
+    // Runs one command and appends its result to the pending output. With a session, commands that take a user,
+    // other than register and login, act as the logged-in user and leave out the user argument.
+    void runLine(string line, size_t lineNumber, Session *session)
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+        {
+            return;
+        }
+
+        BatchCommand command;
+        string error;
+        bool bound;
+        bool parsed = parse(line, start, session, command, error, bound);
+        beginResult(lineNumber, command.op);
+        if (bound && session->username.empty())
+        {
+            endResult("not_logged_in");
+            return;
+        }
+        if (!parsed)
+        {
+            endResult(error.c_str());
+            return;
+        }
+
+        Session local;
+        bool known;
+        OpStatus status = execute(command, session != nullptr ? *session : local, known);
+        if (!known)
+        {
+            endResult("unknown_op");
+            return;
+        }
+        if (status == OpStatus::Ok && manager.changeUnsaved())
+        {
+            status = OpStatus::StorageError;
+        }
+        if (status == OpStatus::Ok && isQuery(command.op))
+        {
+            appendResults(manager.findUserId(command.user), command);
+        }
+        else if (status == OpStatus::Ok && (command.op == "post" || command.op == "post_after"))
+        {
+            output.append(",\"post\":");
+            output.append(to_string(createdPost));
+        }
+        else if (status == OpStatus::Ok && command.op == "path")
+        {
+            output.append(",\"degree\":");
+            output.append(to_string(path.size() - 1));
+            appendUsers(path, "path");
+        }
+        else if (status == OpStatus::Ok && takesNames(command.op))
+        {
+            output.append(",\"answered\":");
+            output.append(to_string(answered));
+        }
+        else if (status == OpStatus::Ok && command.op == "clusters")
+        {
+            appendClusterSummary(manager.clusterSummary(static_cast<size_t>(command.limit)));
+        }
+        else if (status == OpStatus::Ok && (command.op == "trending" || command.op == "top_posts"))
+        {
+            appendRanked(manager.trendingPosts(UserDirectory::INVALID_ID, command.op == "top_posts", static_cast<size_t>(command.limit)));
+        }
+        else if (status == OpStatus::Ok && command.op == "cluster")
+        {
+            appendCluster("component", component);
+            appendCluster("community", community);
+        }
+        else if (status == OpStatus::Ok && command.op == "metrics")
+        {
+            output.append(",\"metrics\":");
+            output.append(manager.metricsJson());
+        }
+        endResult(statusName(status));
+    }
+
+    string takeOutput()
+    {
+        string result;
+        result.swap(output);
+        return result;
+    }
+
+    void run(istream &in)
+    {
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        manager.setDurability(4096, 200, false);
+
+        string line;
+        size_t lineNumber = 0;
+        while (getline(in, line))
+        {
+            runLine(line, ++lineNumber, nullptr);
+            if (output.size() >= (1 << 20))
+            {
+                flushOutput();
+            }
+        }
+
+        manager.syncJournal();
+        flushOutput();
+        fflush(stdout);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cerr << "Executed " << executed << " commands (" << failed << " failed) in "
+             << static_cast<long long>(seconds * 1000) << " ms, "
+             << static_cast<long long>(seconds > 0 ? executed / seconds : executed) << " ops/sec" << endl;
+    }
+};
+
+struct ServerEndpoint
+{
+    string host;
+    int port;
+    string socketPath;
+
+    string describe() const
+    {
+        return socketPath.empty() ? host + ":" + to_string(port) : socketPath;
+    }
+};
+
+#ifdef __linux__
+static volatile sig_atomic_t serverStopRequested = 0;
+static volatile sig_atomic_t serverMetricsRequested = 0;
+
+static void requestServerStop(int)
+{
+    serverStopRequested = 1;
+}
+
+static void requestServerMetrics(int)
+{
+    serverMetricsRequested = 1;
+}
+
+static bool fillAddress(const ServerEndpoint &endpoint, sockaddr_storage &address, socklen_t &length)
+{
+    memset(&address, 0, sizeof(address));
+    if (!endpoint.socketPath.empty())
+    {
+        sockaddr_un *local = reinterpret_cast<sockaddr_un *>(&address);
+        if (endpoint.socketPath.size() >= sizeof(local->sun_path))
+        {
+            return false;
+        }
+        local->sun_family = AF_UNIX;
+        memcpy(local->sun_path, endpoint.socketPath.c_str(), endpoint.socketPath.size() + 1);
+        length = sizeof(sockaddr_un);
+        return true;
+    }
+
+    sockaddr_in *inet = reinterpret_cast<sockaddr_in *>(&address);
+    inet->sin_family = AF_INET;
+    inet->sin_port = htons(static_cast<uint16_t>(endpoint.port));
+    length = sizeof(sockaddr_in);
+    return inet_pton(AF_INET, endpoint.host.c_str(), &inet->sin_addr) == 1;
+}
+
+static void tuneSocket(int fd, bool local)
+{
+    if (!local)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+// Opens a blocking connection, or returns -1.
+static int connectTo(const ServerEndpoint &endpoint)
+{
+    sockaddr_storage address;
+    socklen_t length;
+    if (!fillAddress(endpoint, address, length))
+    {
+        return -1;
+    }
+    int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), length) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    tuneSocket(fd, !endpoint.socketPath.empty());
+    return fd;
+}
+
+static bool sendAll(int fd, const string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t written = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0 && !(written < 0 && errno == EINTR))
+        {
+            return false;
+        }
+        sent += written > 0 ? static_cast<size_t>(written) : 0;
+    }
+    return true;
+}
+
+// The shards of a partitioned deployment. Each user lives on the shard picked by a hash of the username, since
+// numeric ids are only meaningful inside one shard. The stripes serialize changes to the same users across all
+// workers of one router.
+class ShardMap
+{
+private:
+    vector<ServerEndpoint> endpoints;
+    LockStripes stripes;
+    // The highest post ID any shard has handed out through a router.
+    mutable atomic<uint64_t> newestPost;
+
+public:
+    explicit ShardMap(const vector<ServerEndpoint> &shardEndpoints)
+        : endpoints(shardEndpoints)
+    {
+        newestPost = 0;
+    }
+
+    static uint32_t hashOf(const string &username)
+    {
+        return UserDirectory::hashName(username.data(), username.size());
+    }
+
+    size_t size() const
+    {
+        return endpoints.size();
+    }
+
+    const ServerEndpoint &endpoint(size_t shard) const
+    {
+        return endpoints[shard];
+    }
+
+    size_t homeOf(const string &username) const
+    {
+        return hashOf(username) % endpoints.size();
+    }
+
+    const LockStripes &locks() const
+    {
+        return stripes;
+    }
+
+    // Each shard numbers its own posts. Asking every new post for an ID above the newest one seen anywhere keeps
+    // the IDs of all shards close to posting order, so that feeds can be merged by ID.
+    uint64_t postFloor() const
+    {
+        return newestPost.load() + 1;
+    }
+
+    void sawPost(uint64_t id) const
+    {
+        uint64_t newest = newestPost.load();
+        while (id > newest && !newestPost.compare_exchange_weak(newest, id))
+        {
+        }
+    }
+
+    // Orders posts across shards by ID and then by shard. The router's feed cursors are such keys.
+    uint64_t postKey(uint64_t id, size_t shard) const
+    {
+        return id * endpoints.size() + shard;
+    }
+
+    // The cursor for a shard's own feed that continues below a router cursor, or 0 if none of its posts are below.
+    uint64_t shardCursor(uint64_t cursor, size_t shard) const
+    {
+        return cursor > shard ? (cursor - shard + endpoints.size() - 1) / endpoints.size() : 0;
+    }
+};
+
+// Speaks the batch command language to clients and forwards each command to the shard that owns it, over one
+// connection per shard. Commands that touch one shard are pipelined and their responses read back in order.
+// A friendship change between users on different shards runs in two phases: both shards first check that it
+// can be applied, and only then apply it, each keeping a passwordless copy of the user from the other shard.
+// Friends homed on another shard post there, where the copy of the user sees them, so feeds and post searches are
+// merged from every shard. Paths and analytics only see the shard the user lives on.
+class ShardRouter
+{
+private:
+    struct Link
+    {
+        int fd;
+        uint64_t generation;
+        string input;
+    };
+
+    // A forwarded command whose response has not been read yet. Responses to commands with no line number are
+    // read and dropped.
+    struct Pending
+    {
+        size_t shard;
+        uint64_t generation;
+        size_t lineNumber;
+        string op;
+    };
+
+    static const size_t MAX_PENDING = 256;
+
+    const ShardMap &shards;
+    vector<Link> links;
+    deque<Pending> pending;
+    string output;
+
+    static string statusOf(const string &reply)
+    {
+        size_t field = reply.rfind("\"status\":\"");
+        if (field == string::npos)
+        {
+            return "bad_reply";
+        }
+        field += 10;
+        return reply.substr(field, reply.find('"', field) - field);
+    }
+
+    static size_t countOf(const string &reply, const char *key)
+    {
+        size_t field = reply.find(key);
+        return field == string::npos ? 0 : strtoull(reply.c_str() + field + strlen(key), nullptr, 10);
+    }
+
+    // The objects of a "posts" array with their post IDs. The objects are flat, but their texts may hold any character.
+    static vector<pair<uint64_t, string>> postsOf(const string &reply)
+    {
+        vector<pair<uint64_t, string>> posts;
+        size_t field = reply.find("\"posts\":[");
+        if (field == string::npos)
+        {
+            return posts;
+        }
+        size_t i = field + 9;
+        while (i < reply.size() && reply[i] == '{')
+        {
+            size_t start = i;
+            bool quoted = false;
+            for (; i < reply.size() && (quoted || reply[i] != '}'); i++)
+            {
+                if (quoted && reply[i] == '\\')
+                {
+                    i++;
+                }
+                else if (reply[i] == '"')
+                {
+                    quoted = !quoted;
+                }
+            }
+            string object = reply.substr(start, i + 1 - start);
+            posts.push_back(make_pair(countOf(object, "\"post\":"), object));
+            i += reply.compare(i, 2, "},") == 0 ? 2 : 1;
+        }
+        return posts;
+    }
+
+    // The names in a "users" array; usernames never need escaping.
+    static vector<string> usersOf(const string &reply)
+    {
+        vector<string> names;
+        size_t field = reply.find("\"users\":[");
+        if (field == string::npos)
+        {
+            return names;
+        }
+        size_t end = reply.find(']', field);
+        for (size_t open = reply.find('"', field + 9); open < end; open = reply.find('"', open + 1))
+        {
+            size_t close = reply.find('"', open + 1);
+            names.push_back(reply.substr(open + 1, close - open - 1));
+            open = close;
+        }
+        return names;
+    }
+
+    void dropLink(size_t shard)
+    {
+        Link &link = links[shard];
+        if (link.fd >= 0)
+        {
+            close(link.fd);
+            link.fd = -1;
+        }
+        link.generation++;
+        link.input.clear();
+    }
+
+    // Returns the generation the command was sent on, or 0 if the shard cannot be reached.
+    uint64_t send(size_t shard, const string &line)
+    {
+        Link &link = links[shard];
+        if (link.fd < 0)
+        {
+            link.fd = connectTo(shards.endpoint(shard));
+        }
+        if (link.fd < 0 || !sendAll(link.fd, line + "\n"))
+        {
+            dropLink(shard);
+            return 0;
+        }
+        return link.generation;
+    }
+
+    bool receive(size_t shard, uint64_t generation, string &reply)
+    {
+        Link &link = links[shard];
+        if (generation == 0 || generation != link.generation)
+        {
+            return false;
+        }
+        char buffer[16384];
+        size_t newline;
+        while ((newline = link.input.find('\n')) == string::npos)
+        {
+            ssize_t count = recv(link.fd, buffer, sizeof(buffer), 0);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                dropLink(shard);
+                return false;
+            }
+            link.input.append(buffer, static_cast<size_t>(count));
+        }
+        reply = link.input.substr(0, newline);
+        link.input.erase(0, newline + 1);
+        return true;
+    }
+
+    void reply(size_t lineNumber, const string &op, const string &status)
+    {
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(",\"op\":");
+        appendJsonString(output, op);
+        output.append(",\"status\":\"");
+        output.append(status);
+        output.append("\"}\n");
+    }
+
+    // Passes a shard's response on under the client's line number.
+    void relay(size_t lineNumber, const string &response)
+    {
+        size_t comma = response.find(',');
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(response, comma == string::npos ? response.size() : comma, string::npos);
+        output.push_back('\n');
+    }
+
+    // The same under the op the client sent, for commands the router rewrote.
+    void relay(size_t lineNumber, const string &op, const string &response)
+    {
+        size_t field = response.find(",\"op\":");
+        size_t comma = field == string::npos ? string::npos : response.find(',', field + 1);
+        if (comma == string::npos)
+        {
+            relay(lineNumber, response);
+            return;
+        }
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(",\"op\":");
+        appendJsonString(output, op);
+        output.append(response, comma, string::npos);
+        output.push_back('\n');
+    }
+
+    void forward(size_t shard, const string &line, size_t lineNumber, const string &op)
+    {
+        if (pending.size() >= MAX_PENDING)
+        {
+            drain();
+        }
+        pending.push_back(Pending{shard, send(shard, line), lineNumber, op});
+    }
+
+    void drain()
+    {
+        string response;
+        while (!pending.empty())
+        {
+            Pending next = std::move(pending.front());
+            pending.pop_front();
+            bool received = receive(next.shard, next.generation, response);
+            if (received && next.op == "post")
+            {
+                shards.sawPost(countOf(response, "\"post\":"));
+            }
+            if (next.lineNumber == 0)
+            {
+                continue;
+            }
+            if (received)
+            {
+                relay(next.lineNumber, next.op, response);
+            }
+            else
+            {
+                reply(next.lineNumber, next.op, "shard_unavailable");
+            }
+        }
+    }
+
+    // Sends one command and waits for its response; the pipeline must be empty.
+    string call(size_t shard, const BatchCommand &command, string &response)
+    {
+        if (!receive(shard, send(shard, BatchRunner::toJson(command)), response))
+        {
+            return "shard_unavailable";
+        }
+        return statusOf(response);
+    }
+
+    string call(size_t shard, const BatchCommand &command)
+    {
+        string response;
+        return call(shard, command, response);
+    }
+
+    static BatchCommand commandFor(const string &op, const string &user, const string &other, const string &text)
+    {
+        return BatchCommand{op, user, string(), other, text, 0, 20, 0, vector<string>()};
+    }
+
+    // Sends, accepts or declines a request between users on different shards. The caller holds their stripes.
+    string changeFriendship(const string &op, const string &user, const string &other, string &response)
+    {
+        size_t home = shards.homeOf(user);
+        size_t away = shards.homeOf(other);
+        string prepare = op == "send_request" ? "prepare_request" : "prepare_" + op;
+        string status = call(home, commandFor(prepare, user, other, other));
+        if (status == "ok")
+        {
+            status = call(away, commandFor(prepare, user, other, user));
+        }
+        if (status != "ok")
+        {
+            return status;
+        }
+
+        string homeStatus = call(home, commandFor("remote_user", other, string(), string()));
+        if (homeStatus == "ok")
+        {
+            homeStatus = call(home, commandFor(op, user, other, string()), response);
+        }
+        string awayStatus = call(away, commandFor("remote_user", user, string(), string()));
+        if (awayStatus == "ok")
+        {
+            awayStatus = call(away, commandFor(op, user, other, string()));
+        }
+        if (homeStatus != awayStatus)
+        {
+            cerr << "Shards " << home << " and " << away << " disagree on " << op << " " << user << " " << other << ": "
+                 << homeStatus << " and " << awayStatus << endl;
+        }
+        return homeStatus;
+    }
+
+    void answerMany(const BatchCommand &command, size_t lineNumber)
+    {
+        size_t home = shards.homeOf(command.user);
+        vector<string> names = command.names;
+        string response;
+        if (names.empty())
+        {
+            BatchCommand inbox = commandFor("requests", command.user, string(), string());
+            inbox.limit = 1 << 30;
+            string status = call(home, inbox, response);
+            if (status != "ok")
+            {
+                reply(lineNumber, command.op, status);
+                return;
+            }
+            names = usersOf(response);
+        }
+
+        BatchCommand local = command;
+        local.names.clear();
+        vector<string> remote;
+        for (const string &name : names)
+        {
+            (shards.homeOf(name) == home ? local.names : remote).push_back(name);
+        }
+        size_t answered = 0;
+        if (!local.names.empty())
+        {
+            string status = call(home, local, response);
+            if (status != "ok")
+            {
+                reply(lineNumber, command.op, status);
+                return;
+            }
+            answered += countOf(response, "\"answered\":");
+        }
+        string op = command.op == "accept_many" ? "accept" : "decline";
+        for (const string &name : remote)
+        {
+            PairLock lock(shards.locks(), ShardMap::hashOf(command.user), ShardMap::hashOf(name));
+            answered += changeFriendship(op, command.user, name, response) == "ok" ? 1 : 0;
+        }
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(",\"op\":");
+        appendJsonString(output, command.op);
+        output.append(",\"answered\":");
+        output.append(to_string(answered));
+        output.append(",\"status\":\"ok\"}\n");
+    }
+
+    // Deletes the account on its shard, then the copies other shards keep for its friendships.
+    void deleteUser(const BatchCommand &command, size_t lineNumber)
+    {
+        ExclusiveLock lock(shards.locks().of(ShardMap::hashOf(command.user)));
+        size_t home = shards.homeOf(command.user);
+        string response;
+        string status = call(home, command, response);
+        if (status == "ok")
+        {
+            for (size_t shard = 0; shard < shards.size(); shard++)
+            {
+                if (shard != home)
+                {
+                    call(shard, command);
+                }
+            }
+        }
+        if (response.empty())
+        {
+            reply(lineNumber, command.op, status);
+        }
+        else
+        {
+            relay(lineNumber, response);
+        }
+    }
+
+    // Merges the newest posts every shard has for the user. A shard that keeps no copy of the user has none.
+    void mergePosts(const BatchCommand &command, size_t lineNumber)
+    {
+        size_t home = shards.homeOf(command.user);
+        uint64_t cursor = static_cast<uint64_t>(command.cursor);
+        vector<pair<uint64_t, string>> posts;
+        bool older = false;
+        for (size_t shard = 0; shard < shards.size(); shard++)
+        {
+            BatchCommand local = command;
+            local.cursor = static_cast<long long>(shards.shardCursor(cursor, shard));
+            if (cursor != 0 && local.cursor == 0)
+            {
+                continue;
+            }
+            string response;
+            string status = call(shard, local, response);
+            if (status == "user_not_found" && shard != home)
+            {
+                continue;
+            }
+            if (status != "ok")
+            {
+                reply(lineNumber, command.op, status);
+                return;
+            }
+            older |= countOf(response, "\"next_cursor\":") != 0;
+            for (pair<uint64_t, string> &post : postsOf(response))
+            {
+                posts.push_back(make_pair(shards.postKey(post.first, shard), std::move(post.second)));
+            }
+        }
+
+        sort(posts.begin(), posts.end(), [](const pair<uint64_t, string> &a, const pair<uint64_t, string> &b)
+             { return a.first > b.first; });
+        size_t limit = static_cast<size_t>(command.limit);
+        if (posts.size() > limit)
+        {
+            posts.resize(limit);
+            older = true;
+        }
+        output.append("{\"line\":");
+        output.append(to_string(lineNumber));
+        output.append(",\"op\":");
+        appendJsonString(output, command.op);
+        output.append(",\"posts\":[");
+        for (size_t i = 0; i < posts.size(); i++)
+        {
+            output.append(i == 0 ? "" : ",");
+            output.append(posts[i].second);
+        }
+        output.push_back(']');
+        if (command.op == "feed")
+        {
+            output.append(",\"next_cursor\":");
+            output.append(to_string(older && !posts.empty() ? posts.back().first : 0));
+        }
+        output.append(",\"status\":\"ok\"}\n");
+    }
+
+    void broadcast(const BatchCommand &command, size_t lineNumber)
+    {
+        string status = "ok";
+        for (size_t shard = 0; shard < shards.size(); shard++)
+        {
+            string shardStatus = call(shard, command);
+            status = status == "ok" ? shardStatus : status;
+        }
+        reply(lineNumber, command.op, status);
+    }
+
+public:
+    explicit ShardRouter(const ShardMap &shardMap)
+        : shards(shardMap), links(shardMap.size(), Link{-1, 1, string()})
+    {
+    }
+
+    ~ShardRouter()
+    {
+        for (size_t shard = 0; shard < links.size(); shard++)
+        {
+            dropLink(shard);
+        }
+    }
+
+    // Runs one command the way BatchRunner::runLine would on a single server.
+    void runLine(string line, size_t lineNumber, Session *session)
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+        {
+            return;
+        }
+
+        BatchCommand command;
+        string error;
+        bool bound;
+        bool parsed = BatchRunner::parse(line, start, session, command, error, bound);
+        if (bound && session->username.empty())
+        {
+            drain();
+            reply(lineNumber, command.op, "not_logged_in");
+            return;
+        }
+        if (!parsed || command.op == "remote_user" || command.op == "post_after" || BatchRunner::isPrepare(command.op))
+        {
+            drain();
+            reply(lineNumber, command.op, parsed ? "unknown_op" : error);
+            return;
+        }
+
+        size_t home = shards.homeOf(command.user);
+        if (command.op == "like" || command.op == "unlike" || command.op == "likers")
+        {
+            // Likes live with the post, so the liker needs a copy on the owner's shard.
+            size_t owner = shards.homeOf(command.other);
+            if (owner != home && command.op != "likers")
+            {
+                forward(owner, BatchRunner::toJson(commandFor("remote_user", command.user, string(), string())), 0, string());
+            }
+            forward(owner, BatchRunner::toJson(command), lineNumber, command.op);
+            return;
+        }
+        if (command.op == "post")
+        {
+            BatchCommand numbered = command;
+            numbered.op = "post_after";
+            numbered.cursor = static_cast<long long>(shards.postFloor());
+            forward(home, BatchRunner::toJson(numbered), lineNumber, command.op);
+            return;
+        }
+        bool pairwise = command.op == "send_request" || command.op == "accept" || command.op == "decline";
+        bool merged = command.op == "feed" || command.op == "search_posts";
+        if (BatchRunner::needsUser(command.op) && command.op != "login" && command.op != "delete_user" && !BatchRunner::takesNames(command.op) &&
+            !(pairwise && shards.homeOf(command.other) != home) && !(merged && shards.size() > 1))
+        {
+            forward(home, BatchRunner::toJson(command), lineNumber, command.op);
+            return;
+        }
+
+        drain();
+        string response;
+        if (command.op == "login")
+        {
+            string status = call(home, command, response);
+            if (status == "ok" && session != nullptr)
+            {
+                session->username = command.user;
+            }
+            relay(lineNumber, response);
+        }
+        else if (pairwise)
+        {
+            PairLock lock(shards.locks(), ShardMap::hashOf(command.user), ShardMap::hashOf(command.other));
+            string status = changeFriendship(command.op, command.user, command.other, response);
+            if (response.empty())
+            {
+                reply(lineNumber, command.op, status);
+            }
+            else
+            {
+                relay(lineNumber, response);
+            }
+        }
+        else if (BatchRunner::takesNames(command.op))
+        {
+            answerMany(command, lineNumber);
+        }
+        else if (command.op == "delete_user")
+        {
+            deleteUser(command, lineNumber);
+        }
+        else if (merged)
+        {
+            mergePosts(command, lineNumber);
+        }
+        else if (command.op == "sync")
+        {
+            broadcast(command, lineNumber);
+        }
+        else
+        {
+            reply(lineNumber, command.op, "unsupported");
+        }
+    }
+
+    string takeOutput()
+    {
+        drain();
+        string result;
+        result.swap(output);
+        return result;
+    }
+};
+
+// Serves the batch command language to many clients at once. One thread runs an epoll loop over all sockets and
+// a pool of workers executes commands. Each connection has at most one batch of commands in flight, so responses
+// come back in request order, and each connection carries its own login session. A router serves shards instead of
+// a local manager, and a shard serves commands that name their user instead of logging in.
+class CommandServer
+{
+private:
+    struct Connection
+    {
+        int fd;
+        uint64_t serial;
+        string input;
+        string output;
+        Session session;
+        size_t requests;
+        bool busy;
+        bool peerClosed;
+        uint32_t events;
+    };
+
+    struct Job
+    {
+        int fd;
+        uint64_t serial;
+        size_t firstLine;
+        vector<string> lines;
+        Session session;
+    };
+
+    struct Completion
+    {
+        int fd;
+        uint64_t serial;
+        string output;
+        Session session;
+    };
+
+    static const size_t MAX_LINE = 64 << 10;
+    static const size_t MAX_PENDING_OUTPUT = 4 << 20;
+    static const size_t LINES_PER_JOB = 64;
+
+    UserManager *manager;
+    const ShardMap *shards;
+    ServerEndpoint endpoint;
+    unsigned workerCount;
+    bool sessions;
+    int epollFd;
+    int wakeFd;
+    int listenFd;
+    vector<Connection *> connections;
+    uint64_t nextSerial;
+    size_t accepted;
+    size_t served;
+
+    mutex queueLock;
+    condition_variable queueReady;
+    deque<Job> jobs;
+    bool stopping;
+    mutex completionLock;
+    vector<Completion> completions;
+    vector<thread> workers;
+
+    template <typename Runner>
+    void serve(Runner &runner)
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                unique_lock<mutex> lock(queueLock);
+                queueReady.wait(lock, [this]()
+                                { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            for (size_t i = 0; i < job.lines.size(); i++)
+            {
+                runner.runLine(job.lines[i], job.firstLine + i, sessions ? &job.session : nullptr);
+            }
+            {
+                lock_guard<mutex> lock(completionLock);
+                completions.push_back(Completion{job.fd, job.serial, runner.takeOutput(), job.session});
+            }
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0)
+            {
+                // The counter only saturates if the loop is far behind; it will still see the earlier wake-up.
+            }
+        }
+    }
+
+    void work()
+    {
+        if (shards != nullptr)
+        {
+            ShardRouter router(*shards);
+            serve(router);
+        }
+        else
+        {
+            BatchRunner runner(*manager);
+            serve(runner);
+        }
+    }
+
+    // Stops reading once the peer has hung up, since a level-triggered hang-up would otherwise wake the loop
+    // until the last job finishes. Reading also pauses while a job is in flight or replies are piling up, so a
+    // client that pipelines without reading is held back by its own socket buffer rather than by ours.
+    void watch(Connection *connection)
+    {
+        bool reading = !connection->peerClosed && !connection->busy && connection->output.size() < MAX_PENDING_OUTPUT;
+        uint32_t wanted = (reading ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) | (connection->output.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        if (connection->events == wanted)
+        {
+            return;
+        }
+        // A socket with nothing to wait for leaves the set altogether, as hang-ups cannot be masked.
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = wanted;
+        event.data.fd = connection->fd;
+        epoll_ctl(epollFd, wanted == 0 ? EPOLL_CTL_DEL : connection->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = wanted;
+    }
+
+    void closeConnection(Connection *connection)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        close(connection->fd);
+        connections[connection->fd] = nullptr;
+        delete connection;
+    }
+
+    // Returns false once the connection has been closed.
+    bool flush(Connection *connection)
+    {
+        size_t sent = 0;
+        while (sent < connection->output.size())
+        {
+            ssize_t written = send(connection->fd, connection->output.data() + sent, connection->output.size() - sent, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            if (written <= 0)
+            {
+                closeConnection(connection);
+                return false;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        connection->output.erase(0, sent);
+        watch(connection);
+        return true;
+    }
+
+    void dispatch(Connection *connection)
+    {
+        if (connection->busy || connection->output.size() >= MAX_PENDING_OUTPUT)
+        {
+            return;
+        }
+
+        Job job{connection->fd, connection->serial, connection->requests + 1, vector<string>(), connection->session};
+        size_t consumed = 0;
+        while (job.lines.size() < LINES_PER_JOB)
+        {
+            size_t newline = connection->input.find('\n', consumed);
+            if (newline == string::npos)
+            {
                 break;
-            case 2:
+            }
+            job.lines.push_back(connection->input.substr(consumed, newline - consumed));
+            consumed = newline + 1;
+        }
+        if (job.lines.empty() && connection->peerClosed && !connection->input.empty())
+        {
+            job.lines.push_back(connection->input);
+            consumed = connection->input.size();
+        }
+        if (job.lines.empty())
+        {
+            if (connection->peerClosed && connection->output.empty())
+            {
+                closeConnection(connection);
+            }
+            return;
+        }
+
+        connection->input.erase(0, consumed);
+        connection->requests += job.lines.size();
+        connection->busy = true;
+        watch(connection);
+        {
+            lock_guard<mutex> lock(queueLock);
+            jobs.push_back(std::move(job));
+        }
+        queueReady.notify_one();
+    }
+
+    void acceptConnections()
+    {
+        for (;;)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                return;
+            }
+            tuneSocket(fd, !endpoint.socketPath.empty());
+
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+            {
+                close(fd);
+                continue;
+            }
+            if (static_cast<size_t>(fd) >= connections.size())
+            {
+                connections.resize(fd + 1, nullptr);
+            }
+            connections[fd] = new Connection{fd, ++nextSerial, string(), string(), Session{UserDirectory::INVALID_ID, string()}, 0, false, false, EPOLLIN | EPOLLRDHUP};
+            accepted++;
+        }
+    }
+
+    void readFrom(Connection *connection)
+    {
+        char buffer[16384];
+        // Whatever is left in the socket is read once the buffered lines have been served.
+        while (connection->input.size() <= MAX_LINE)
+        {
+            ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+            if (count > 0)
+            {
+                connection->input.append(buffer, static_cast<size_t>(count));
+                continue;
+            }
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count == 0)
+            {
+                connection->peerClosed = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                closeConnection(connection);
+                return;
+            }
+            break;
+        }
+
+        if (connection->input.size() > MAX_LINE && connection->input.find('\n') == string::npos)
+        {
+            closeConnection(connection);
+            return;
+        }
+        watch(connection);
+        dispatch(connection);
+    }
+
+    void finishJobs()
+    {
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) < 0)
+        {
+            return;
+        }
+
+        vector<Completion> done;
+        {
+            lock_guard<mutex> lock(completionLock);
+            done.swap(completions);
+        }
+        for (Completion &completion : done)
+        {
+            Connection *connection = static_cast<size_t>(completion.fd) < connections.size() ? connections[completion.fd] : nullptr;
+            if (connection == nullptr || connection->serial != completion.serial)
+            {
+                continue;
+            }
+            served++;
+            connection->busy = false;
+            connection->session = completion.session;
+            connection->output.append(completion.output);
+            if (flush(connection))
+            {
+                dispatch(connection);
+            }
+        }
+    }
+
+    CommandServer(UserManager *userManager, const ShardMap *shardMap, const ServerEndpoint &serverEndpoint, unsigned threads, bool loginSessions)
+        : manager(userManager), shards(shardMap), endpoint(serverEndpoint), sessions(loginSessions)
+    {
+        workerCount = max(1u, threads);
+        epollFd = -1;
+        wakeFd = -1;
+        listenFd = -1;
+        nextSerial = 0;
+        accepted = 0;
+        served = 0;
+        stopping = false;
+    }
+
+public:
+    CommandServer(UserManager &userManager, const ServerEndpoint &serverEndpoint, unsigned threads, bool loginSessions = true)
+        : CommandServer(&userManager, nullptr, serverEndpoint, threads, loginSessions)
+    {
+    }
+
+    CommandServer(const ShardMap &shardMap, const ServerEndpoint &serverEndpoint, unsigned threads)
+        : CommandServer(nullptr, &shardMap, serverEndpoint, threads, true)
+    {
+    }
+
+    ~CommandServer()
+    {
+        for (Connection *connection : connections)
+        {
+            if (connection != nullptr)
+            {
+                close(connection->fd);
+                delete connection;
+            }
+        }
+        for (int fd : {listenFd, wakeFd, epollFd})
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        if (!endpoint.socketPath.empty() && listenFd >= 0)
+        {
+            unlink(endpoint.socketPath.c_str());
+        }
+    }
+
+    bool listen()
+    {
+        sockaddr_storage address;
+        socklen_t length;
+        if (!fillAddress(endpoint, address, length))
+        {
+            cerr << "Invalid address " << endpoint.describe() << endl;
+            return false;
+        }
+
+        listenFd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd >= 0 && endpoint.socketPath.empty())
+        {
+            int one = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        else if (listenFd >= 0)
+        {
+            unlink(endpoint.socketPath.c_str());
+        }
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr *>(&address), length) != 0 || ::listen(listenFd, 4096) != 0)
+        {
+            cerr << "Unable to listen on " << endpoint.describe() << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+        return true;
+    }
+
+    void run()
+    {
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestServerStop);
+        signal(SIGTERM, requestServerStop);
+        signal(SIGUSR1, requestServerMetrics);
+        for (unsigned t = 0; t < workerCount; t++)
+        {
+            workers.push_back(thread(&CommandServer::work, this));
+        }
+        cerr << "Listening on " << endpoint.describe() << " with " << workerCount << " workers" << endl;
+
+        vector<epoll_event> events(1024);
+        while (!serverStopRequested)
+        {
+            int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 200);
+            if (serverMetricsRequested)
+            {
+                serverMetricsRequested = 0;
+                if (manager != nullptr)
+                {
+                    manager->writeMetrics(cerr);
+                }
+            }
+            for (int i = 0; i < ready; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == listenFd)
+                {
+                    acceptConnections();
+                    continue;
+                }
+                if (fd == wakeFd)
+                {
+                    finishJobs();
+                    continue;
+                }
+
+                Connection *connection = static_cast<size_t>(fd) < connections.size() ? connections[fd] : nullptr;
+                if (connection == nullptr)
+                {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                {
+                    readFrom(connection);
+                    connection = connections[fd];
+                    if (connection == nullptr || !(events[i].events & EPOLLOUT))
+                    {
+                        continue;
+                    }
+                }
+                if (flush(connection))
+                {
+                    dispatch(connection);
+                }
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+        if (manager != nullptr && !manager->syncJournal())
+        {
+            cerr << "Unable to write the journal; changes may be lost" << endl;
+        }
+        cerr << "Served " << served << " request batches on " << accepted << " connections" << endl;
+    }
+};
+
+// Drives a server with many concurrent clients on one machine. Every client registers and logs in, befriends its
+// neighbours, then keeps exactly one request outstanding until the time is up.
+class LoadGenerator
+{
+private:
+    struct Client
+    {
+        int fd;
+        string name;
+        string friendName;
+        uint64_t friendPost;
+        string input;
+        chrono::steady_clock::time_point sent;
+        mt19937_64 random;
+    };
+
+    ServerEndpoint endpoint;
+    size_t clientCount;
+    double seconds;
+
+    static bool roundTrip(Client &client, const string &request, string &reply)
+    {
+        if (!sendAll(client.fd, request + "\n"))
+        {
+            return false;
+        }
+        char buffer[4096];
+        while (client.input.find('\n') == string::npos)
+        {
+            ssize_t count = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (count <= 0)
+            {
+                return false;
+            }
+            client.input.append(buffer, static_cast<size_t>(count));
+        }
+        size_t newline = client.input.find('\n');
+        reply = client.input.substr(0, newline);
+        client.input.erase(0, newline + 1);
+        return true;
+    }
+
+    static uint64_t postIdOf(const string &reply)
+    {
+        size_t field = reply.find("\"post\":");
+        return field == string::npos ? 0 : strtoull(reply.c_str() + field + 7, nullptr, 10);
+    }
+
+    static string nextRequest(Client &client)
+    {
+        unsigned kind = static_cast<unsigned>(client.random() % 100);
+        if (kind < 50)
+        {
+            return "feed 20\n";
+        }
+        if (kind < 70)
+        {
+            return "post load test from " + client.name + "\n";
+        }
+        if (kind < 90)
+        {
+            return "like " + client.friendName + " " + to_string(client.friendPost) + "\n";
+        }
+        return "friends\n";
+    }
+
+    static double percentile(const vector<float> &sorted, double fraction)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        return sorted[min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+    }
+
+public:
+    LoadGenerator(const ServerEndpoint &serverEndpoint, size_t clients, double runSeconds)
+        : endpoint(serverEndpoint)
+    {
+        clientCount = max<size_t>(2, clients);
+        seconds = runSeconds;
+    }
+
+    int run(ostream &out)
+    {
+        vector<Client> clients(clientCount);
+        vector<uint64_t> helloPosts(clientCount);
+        string reply;
+        for (size_t i = 0; i < clientCount; i++)
+        {
+            Client &client = clients[i];
+            client.fd = connectTo(endpoint);
+            client.name = "load" + to_string(i);
+            client.friendName = "load" + to_string((i + 1) % clientCount);
+            client.random.seed(i + 1);
+            if (client.fd < 0)
+            {
+                cerr << "Unable to connect to " << endpoint.describe() << ": " << strerror(errno) << endl;
+                return 1;
+            }
+            if (!roundTrip(client, "register " + client.name + " load", reply) || !roundTrip(client, "login " + client.name + " load", reply) ||
+                !roundTrip(client, "post hello from " + client.name, reply))
+            {
+                cerr << "Connection lost while setting up " << client.name << endl;
+                return 1;
+            }
+            helloPosts[i] = postIdOf(reply);
+        }
+        for (size_t i = 0; i < clientCount; i++)
+        {
+            Client &next = clients[(i + 1) % clientCount];
+            clients[i].friendPost = helloPosts[(i + 1) % clientCount];
+            if (!roundTrip(clients[i], "send_request " + next.name, reply) || !roundTrip(next, "accept " + clients[i].name, reply))
+            {
+                cerr << "Connection lost while connecting friends" << endl;
+                return 1;
+            }
+        }
+
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        chrono::steady_clock::time_point deadline = started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+        size_t outstanding = 0;
+        for (size_t i = 0; i < clientCount; i++)
+        {
+            fcntl(clients[i].fd, F_SETFL, fcntl(clients[i].fd, F_GETFL) | O_NONBLOCK);
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[i].fd, &event);
+            clients[i].sent = chrono::steady_clock::now();
+            outstanding += sendAll(clients[i].fd, nextRequest(clients[i])) ? 1 : 0;
+        }
+
+        vector<float> latencies;
+        size_t errors = 0;
+        vector<epoll_event> events(1024);
+        char buffer[65536];
+        while (outstanding > 0)
+        {
+            int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 1000);
+            if (ready <= 0 && chrono::steady_clock::now() > deadline + chrono::seconds(5))
+            {
+                break;
+            }
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            for (int e = 0; e < ready; e++)
+            {
+                Client &client = clients[events[e].data.u64];
+                ssize_t count = recv(client.fd, buffer, sizeof(buffer), 0);
+                if (count <= 0)
+                {
+                    if (count == 0 || (errno != EAGAIN && errno != EINTR))
+                    {
+                        epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                        outstanding--;
+                        errors++;
+                    }
+                    continue;
+                }
+                client.input.append(buffer, static_cast<size_t>(count));
+                size_t newline = client.input.find('\n');
+                if (newline == string::npos)
+                {
+                    continue;
+                }
+
+                latencies.push_back(chrono::duration<float, micro>(now - client.sent).count());
+                static const string success = "\"status\":\"ok\"}";
+                if (newline < success.size() || client.input.compare(newline - success.size(), success.size(), success) != 0)
+                {
+                    errors++;
+                }
+                client.input.erase(0, newline + 1);
+                if (now < deadline)
+                {
+                    client.sent = now;
+                    if (sendAll(client.fd, nextRequest(client)))
+                    {
+                        continue;
+                    }
+                }
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                outstanding--;
+            }
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        close(epollFd);
+        for (Client &client : clients)
+        {
+            close(client.fd);
+        }
+
+        sort(latencies.begin(), latencies.end());
+        out << "{\"clients\":" << clientCount << ",\"ops\":" << latencies.size() << ",\"errors\":" << errors
+            << ",\"seconds\":" << elapsed << ",\"ops_per_sec\":" << (elapsed > 0 ? latencies.size() / elapsed : 0)
+            << ",\"p50_us\":" << percentile(latencies, 0.5) << ",\"p99_us\":" << percentile(latencies, 0.99)
+            << ",\"p999_us\":" << percentile(latencies, 0.999) << ",\"max_us\":" << (latencies.empty() ? 0 : latencies.back())
+            << "}" << endl;
+        return 0;
+    }
+};
+#endif
+
+// Reads --port/--host/--socket and the given extra numeric options from argv[first..].
+static bool parseEndpointOptions(int argc, char *argv[], int first, ServerEndpoint &endpoint,
+                                 const vector<pair<string, double *>> &numbers)
+{
+    endpoint = ServerEndpoint{"127.0.0.1", 7070, string()};
+    for (int i = first; i < argc; i += 2)
+    {
+        string name = argv[i];
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << name << endl;
+            return false;
+        }
+        string value = argv[i + 1];
+        bool known = true;
+        if (name == "--port")
+        {
+            endpoint.port = atoi(value.c_str());
+        }
+        else if (name == "--host")
+        {
+            endpoint.host = value;
+        }
+        else if (name == "--socket")
+        {
+            endpoint.socketPath = value;
+        }
+        else
+        {
+            known = false;
+            for (const pair<string, double *> &number : numbers)
+            {
+                if (name == number.first)
+                {
+                    *number.second = atof(value.c_str());
+                    known = true;
+                }
+            }
+        }
+        if (!known)
+        {
+            cout << "Unknown option " << name << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Serves with the options from argv[first] on.
+static int runServer(UserManager &userManager, int argc, char *argv[], int first)
+{
+    ServerEndpoint endpoint;
+    double workers = max(1u, thread::hardware_concurrency());
+    // Left alone unless given here, so a --profile-cache before --serve still counts.
+    double profileCache = -1;
+    if (!parseEndpointOptions(argc, argv, first, endpoint, {make_pair(string("--workers"), &workers), make_pair(string("--profile-cache"), &profileCache)}))
+    {
+        return 2;
+    }
+#ifdef __linux__
+    userManager.setDurability(1024, 50, false);
+    if (profileCache >= 0)
+    {
+        userManager.setProfileCapacity(static_cast<size_t>(profileCache));
+    }
+    CommandServer server(userManager, endpoint, static_cast<unsigned>(workers));
+    if (!server.listen())
+    {
+        return 1;
+    }
+    server.run();
+    return 0;
+#else
+    (void)userManager;
+    cout << "Server mode needs epoll and is only available on Linux." << endl;
+    return 1;
+#endif
+}
+
+// Runs a router in front of a number of shard processes, each with its own storage and a local socket in the
+// working directory.
+static int runShards(int argc, char *argv[])
+{
+    ServerEndpoint endpoint;
+    double shardCount = 2;
+    double workers = max(1u, thread::hardware_concurrency());
+    double profileCache = ProfileCache::DEFAULT_CAPACITY;
+    if (!parseEndpointOptions(argc, argv, 1, endpoint, {make_pair(string("--shards"), &shardCount), make_pair(string("--workers"), &workers),
+                                                        make_pair(string("--profile-cache"), &profileCache)}))
+    {
+        return 2;
+    }
+#ifdef __linux__
+    size_t count = max<size_t>(1, static_cast<size_t>(shardCount));
+    vector<ServerEndpoint> endpoints;
+    vector<pid_t> children;
+    for (size_t shard = 0; shard < count; shard++)
+    {
+        string name = "users.shard" + to_string(shard);
+        ServerEndpoint shardEndpoint{string(), 0, name + ".sock"};
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            UserManager shardManager(name + ".txt");
+            shardManager.setDurability(1024, 50, false);
+            shardManager.setProfileCapacity(static_cast<size_t>(profileCache / count) + 1);
+            CommandServer server(shardManager, shardEndpoint, static_cast<unsigned>(workers), false);
+            if (!server.listen())
+            {
+                return 1;
+            }
+            server.run();
+            return 0;
+        }
+        if (pid < 0)
+        {
+            cerr << "Unable to start shard " << shard << ": " << strerror(errno) << endl;
+            break;
+        }
+        children.push_back(pid);
+        endpoints.push_back(shardEndpoint);
+    }
+
+    int status = 1;
+    if (children.size() == count)
+    {
+        // Shards recover their storage before they listen.
+        for (const ServerEndpoint &shardEndpoint : endpoints)
+        {
+            int fd = -1;
+            for (int attempt = 0; attempt < 600 && (fd = connectTo(shardEndpoint)) < 0; attempt++)
             {
-                string username, password;
-                cout << "\t\tEnter User Name: ";
-                cin >> username;
-                cout << "\t\tEnter Password: ";
-                cin >> password;
-                loginUser(username, password);
-                break;
+                this_thread::sleep_for(chrono::milliseconds(50));
             }
-            case 3:
+            if (fd >= 0)
             {
-                string username;
-                cout << "\t\tEnter User Name to Search: ";
-                cin >> username;
-                searchUser(username);
-                break;
+                close(fd);
             }
-            case 4:
-                showUsers();
-                break;
-            case 5:
+        }
+        ShardMap shards(endpoints);
+        CommandServer router(shards, endpoint, static_cast<unsigned>(workers));
+        if (router.listen())
+        {
+            router.run();
+            status = 0;
+        }
+    }
+    for (pid_t child : children)
+    {
+        kill(child, SIGTERM);
+    }
+    for (pid_t child : children)
+    {
+        waitpid(child, nullptr, 0);
+    }
+    return status;
+#else
+    cout << "Sharding needs epoll and is only available on Linux." << endl;
+    return 1;
+#endif
+}
+
+static int runLoadGenerator(int argc, char *argv[])
+{
+    ServerEndpoint endpoint;
+    double clients = 64;
+    double seconds = 10;
+    if (!parseEndpointOptions(argc, argv, 2, endpoint, {make_pair(string("--clients"), &clients), make_pair(string("--seconds"), &seconds)}))
+    {
+        return 2;
+    }
+#ifdef __linux__
+    LoadGenerator generator(endpoint, static_cast<size_t>(clients), seconds);
+    return generator.run(cout);
+#else
+    cout << "The load generator needs epoll and is only available on Linux." << endl;
+    return 1;
+#endif
+}
+
+struct GeneratorOptions
+{
+    size_t users;
+    double meanDegree;
+    double degreeExponent;
+    double postsPerUser;
+    double likeSkew;
+    uint64_t seed;
+};
+
+// Chung-Lu style generator: power-law expected degrees, endpoints drawn in proportion to them.
+class SocialGraphGenerator
+{
+private:
+    GeneratorOptions options;
+    mt19937_64 random;
+    vector<double> cumulativeWeight;
+
+    double uniform()
+    {
+        return (random() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint32_t pickEndpoint()
+    {
+        double target = uniform() * cumulativeWeight.back();
+        return static_cast<uint32_t>(upper_bound(cumulativeWeight.begin(), cumulativeWeight.end(), target) - cumulativeWeight.begin());
+    }
+
+public:
+    SocialGraphGenerator(const GeneratorOptions &generatorOptions) : options(generatorOptions), random(generatorOptions.seed)
+    {
+        double alpha = max(options.degreeExponent, 2.05);
+        double minimum = options.meanDegree * (alpha - 2) / (alpha - 1);
+        double cap = static_cast<double>(options.users > 1 ? options.users - 1 : 1);
+        double total = 0;
+
+        cumulativeWeight.reserve(options.users);
+        for (size_t i = 0; i < options.users; i++)
+        {
+            total += min(cap, minimum * pow(1 - uniform(), -1 / (alpha - 1)));
+            cumulativeWeight.push_back(total);
+        }
+    }
+
+    static string userName(size_t index)
+    {
+        return "u" + to_string(index);
+    }
+
+    string userList()
+    {
+        string out;
+        out.reserve(options.users * 16);
+        for (size_t i = 0; i < options.users; i++)
+        {
+            out.append(userName(i));
+            out.append(" pw\n");
+        }
+        return out;
+    }
+
+    vector<vector<pair<uint32_t, uint32_t>>> edges(uint32_t firstId, unsigned batches)
+    {
+        size_t edgeTarget = static_cast<size_t>(options.users * options.meanDegree / 2);
+        vector<vector<pair<uint32_t, uint32_t>>> result(max(1u, batches));
+        for (size_t e = 0; e < edgeTarget && options.users > 1; e++)
+        {
+            uint32_t a = pickEndpoint();
+            uint32_t b = pickEndpoint();
+            if (a != b)
             {
-                string username;
-                cout << "\t\tEnter User Name to Delete: ";
-                cin >> username;
-                deleteUser(username);
-                break;
+                result[e % result.size()].push_back(make_pair(firstId + a, firstId + b));
             }
-            case 6:
-                cout << "\t\tExiting..." << endl;
-                return;
-            default:
-                cout << "\t\tInvalid Option. Please Try Again." << endl;
+        }
+        return result;
+    }
+
+    size_t postCount()
+    {
+        double p = 1 / (1 + options.postsPerUser);
+        double u = uniform();
+        return static_cast<size_t>(log(1 - u) / log(1 - p));
+    }
+
+    int likeCount()
+    {
+        return static_cast<int>(pow(1 - uniform(), -1 / max(options.likeSkew, 0.1))) - 1;
+    }
+
+    size_t pickUser()
+    {
+        return static_cast<size_t>(random() % options.users);
+    }
+};
+
+static volatile uintptr_t benchmarkSink;
+
+class BenchmarkSuite
+{
+private:
+    ostream &out;
+    GeneratorOptions options;
+    double secondsPerBenchmark;
+    unsigned threadCount;
+
+    void emit(const string &name, size_t users, size_t ops, double seconds, const string &extra = "")
+    {
+        out << "{\"benchmark\":\"" << name << "\",\"users\":" << users << ",\"ops\":" << ops
+            << ",\"seconds\":" << seconds << ",\"ns_per_op\":" << (ops > 0 ? seconds * 1e9 / ops : 0)
+            << ",\"ops_per_sec\":" << (seconds > 0 ? ops / seconds : 0) << extra << "}" << endl;
+    }
+
+    template <typename Operation>
+    void measure(const string &name, size_t users, size_t maxOps, Operation operation)
+    {
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        chrono::steady_clock::time_point deadline = started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(secondsPerBenchmark));
+        size_t ops = 0;
+        while (ops < maxOps)
+        {
+            operation(ops);
+            ops++;
+            if ((ops < 64 || (ops & 63) == 0) && chrono::steady_clock::now() >= deadline)
+            {
                 break;
             }
+        }
+        emit(name, users, ops, chrono::duration<double>(chrono::steady_clock::now() - started).count());
+    }
 
-            cout << "\t\tDo You Want to Continue [Yes/No]? ";
-            cin >> choice;
-        } while (choice == 'y' || choice == 'Y');
+    // Concurrent sessions on one manager: mostly feed reads and likes, with some lookups, requests and posts.
+    void measureMixed(UserManager &manager, size_t userCount, uint32_t firstId, const vector<uint64_t> &firstPosts)
+    {
+        vector<size_t> ops(threadCount, 0);
+        vector<thread> workers;
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        chrono::steady_clock::time_point deadline = started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(secondsPerBenchmark));
+        for (unsigned t = 0; t < threadCount; t++)
+        {
+            workers.push_back(thread([&, t]()
+                                     {
+                                         mt19937_64 random(options.seed + t + 1);
+                                         uniform_int_distribution<size_t> pick(0, userCount - 1);
+                                         uintptr_t sink = 0;
+                                         size_t done = 0;
+                                         do
+                                         {
+                                             size_t user = pick(random);
+                                             uint32_t id = firstId + static_cast<uint32_t>(user);
+                                             unsigned kind = static_cast<unsigned>(random() % 100);
+                                             uint64_t nextCursor;
+                                             if (kind < 50)
+                                             {
+                                                 sink += manager.readFeed(id, 20, 0, nextCursor).size();
+                                             }
+                                             else if (kind < 70)
+                                             {
+                                                 sink += static_cast<uintptr_t>(manager.likePost(id, firstPosts[user]));
+                                             }
+                                             else if (kind < 85)
+                                             {
+                                                 sink += manager.findUserId(SocialGraphGenerator::userName(user));
+                                             }
+                                             else if (kind < 95)
+                                             {
+                                                 manager.requestFriendship(SocialGraphGenerator::userName(user), SocialGraphGenerator::userName(pick(random)));
+                                             }
+                                             else
+                                             {
+                                                 manager.addPost(id, "mixed post by " + SocialGraphGenerator::userName(user));
+                                             }
+                                             done++;
+                                         } while ((done & 63) != 0 || chrono::steady_clock::now() < deadline);
+                                         ops[t] = done;
+                                         benchmarkSink += sink;
+                                     }));
+        }
+        size_t total = 0;
+        for (unsigned t = 0; t < threadCount; t++)
+        {
+            workers[t].join();
+            total += ops[t];
+        }
+        emit("mixed", userCount, total, chrono::duration<double>(chrono::steady_clock::now() - started).count(),
+             ",\"threads\":" + to_string(threadCount));
+    }
+
+    static void removeStore(const string &path)
+    {
+        for (const char *suffix : {".snap", ".wal", ".wal.old", ".snap.tmp"})
+        {
+            remove((path + suffix).c_str());
+        }
+    }
+
+    void runSize(size_t userCount)
+    {
+        string path = "bench_" + to_string(userCount) + ".txt";
+        removeStore(path);
+        GeneratorOptions sizeOptions = options;
+        sizeOptions.users = userCount;
+        SocialGraphGenerator generator(sizeOptions);
+        ostringstream importLog;
+
+        {
+            UserManager manager(path);
+            manager.setDurability(4096, 200, false);
+
+            chrono::steady_clock::time_point started = chrono::steady_clock::now();
+            string userList = generator.userList();
+            manager.importUsers(userList.data(), userList.size(), path, importLog);
+            uint32_t firstId = manager.findUserByUsername(SocialGraphGenerator::userName(0))->getId();
+            size_t edgeCount = manager.addFriendshipsInBulk(generator.edges(firstId, max(1u, thread::hardware_concurrency())));
+
+            size_t postTotal = 0;
+            vector<uint64_t> firstPosts(userCount, 0);
+            for (size_t i = 0; i < userCount; i++)
+            {
+                uint32_t id = firstId + static_cast<uint32_t>(i);
+                size_t posts = generator.postCount();
+                for (size_t p = 0; p < posts; p++)
+                {
+                    uint64_t postId;
+                    manager.addPost(id, "post " + to_string(p) + " by " + SocialGraphGenerator::userName(i), postId);
+                    // Fetched after each post, since the cache may have dropped the profile between operations.
+                    manager.findUserById(id)->getProfile()->setPostLikes(static_cast<int>(p), generator.likeCount());
+                    if (p == 0)
+                    {
+                        firstPosts[i] = postId;
+                    }
+                }
+                postTotal += posts;
+            }
+            emit("generate", userCount, userCount, chrono::duration<double>(chrono::steady_clock::now() - started).count(),
+                 ",\"edges\":" + to_string(edgeCount) + ",\"posts\":" + to_string(postTotal));
+
+            vector<string> names(4096);
+            vector<uint32_t> ids(4096);
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                size_t user = generator.pickUser();
+                names[i] = SocialGraphGenerator::userName(user);
+                ids[i] = firstId + static_cast<uint32_t>(user);
+            }
+            uintptr_t found = 0;
+            measure("find_user", userCount, 10000000, [&](size_t op)
+                    { found += reinterpret_cast<uintptr_t>(manager.findUserByUsername(names[op & 4095])); });
+            benchmarkSink = found;
+            measure("search_prefix", userCount, 1000000, [&](size_t op)
+                    { benchmarkSink += manager.usersWithPrefix(names[op & 4095].substr(0, 3), string(), 10).size(); });
+            measure("search_fuzzy", userCount, 100000, [&](size_t op)
+                    {
+                        string typo = names[op & 4095];
+                        typo[typo.size() / 2] = 'x';
+                        benchmarkSink += manager.searchUsers(typo, 10).size();
+                    });
+
+            vector<pair<string, string>> requests;
+            measure("send_friend_request", userCount, 1000000, [&](size_t)
+                    {
+                        requests.push_back(make_pair(SocialGraphGenerator::userName(generator.pickUser()), SocialGraphGenerator::userName(generator.pickUser())));
+                        manager.requestFriendship(requests.back().first, requests.back().second);
+                    });
+            measure("accept_friend_request", userCount, requests.size(), [&](size_t op)
+                    { manager.acceptFriendship(requests[op].second, requests[op].first); });
+
+            // One account collects a request from up to 20000 others, pages through its inbox and accepts it all at once.
+            string hub = SocialGraphGenerator::userName(0);
+            uint32_t hubId = manager.findUserId(hub);
+            size_t fans = min<size_t>(userCount - 1, 20000);
+            measure("request_hub", userCount, fans, [&](size_t op)
+                    { manager.requestFriendship(SocialGraphGenerator::userName(op + 1), hub); });
+            uint64_t inboxCursor = 0;
+            measure("requests_page", userCount, 1000000, [&](size_t)
+                    { benchmarkSink += manager.requestsOf(hubId, false, 20, inboxCursor, inboxCursor).size(); });
+            measure("accept_requests_bulk", userCount, 1, [&](size_t)
+                    {
+                        size_t answered;
+                        manager.respondToRequests(hub, vector<string>(), true, answered);
+                        benchmarkSink += answered;
+                    });
+
+            measure("feed", userCount, 1000000, [&](size_t op)
+                    {
+                        uint64_t nextCursor;
+                        benchmarkSink += manager.readFeed(ids[op & 4095], 20, 0, nextCursor).size();
+                    });
+            vector<vector<FeedEntry>> pages(256);
+            vector<pair<uint32_t, FeedEntry>> likes;
+            for (size_t i = 0; i < pages.size(); i++)
+            {
+                uint64_t nextCursor;
+                pages[i] = manager.readFeed(ids[i], 20, 0, nextCursor);
+                for (const FeedEntry &entry : pages[i])
+                {
+                    likes.push_back(make_pair(ids[i], entry));
+                }
+            }
+            measure("like", userCount, likes.empty() ? 0 : 1000000, [&](size_t op)
+                    {
+                        const pair<uint32_t, FeedEntry> &like = likes[op % likes.size()];
+                        benchmarkSink += static_cast<uintptr_t>(manager.likeFriendPost(like.first, manager.nameOf(like.second.author), like.second.sequence));
+                    });
+            manager.rankStoredPosts();
+            measure("trending", userCount, 100000, [&](size_t op)
+                    { benchmarkSink += manager.trendingPosts(UserDirectory::INVALID_ID, (op & 1) != 0, 20).size(); });
+            measure("liked_page", userCount, 1000000, [&](size_t op)
+                    { benchmarkSink += manager.likedBy(ids[op & 255], pages[op & 255]).size(); });
+            measure("search_posts", userCount, 1000000, [&](size_t op)
+                    { benchmarkSink += manager.searchPosts(ids[op & 4095], "post " + names[(op + 1) & 4095], 20).size(); });
+            measure("degree_of_separation", userCount, 1000, [&](size_t op)
+                    {
+                        vector<uint32_t> path;
+                        manager.connectionBetween(names[op & 4095], names[(op * 2654435761U + 1) & 4095], path);
+                        benchmarkSink += path.size();
+                    });
+            measure("clusters", userCount, 1, [&](size_t)
+                    { manager.analyzeClusters(); });
+            // Every user once, so each call misses the recommendation cache.
+            measure("recommend", userCount, userCount, [&](size_t op)
+                    { benchmarkSink += manager.recommendFriends(firstId + static_cast<uint32_t>(op), 10).size(); });
+
+            measureMixed(manager, userCount, firstId, firstPosts);
+
+            measure("save_users", userCount, 1000, [&](size_t)
+                    {
+                        manager.compact();
+                        manager.waitForCompaction();
+                    });
+
+            measure("delete_user", userCount, userCount / 2, [&](size_t op)
+                    { manager.deleteAccount(SocialGraphGenerator::userName(userCount - 1 - op)); });
+            // A thousand accounts per call, from the other end of the ID range.
+            measure("delete_users_bulk", userCount, userCount / 4000, [&](size_t op)
+                    {
+                        vector<string> batch;
+                        for (size_t i = op * 1000; i < (op + 1) * 1000; i++)
+                        {
+                            batch.push_back(SocialGraphGenerator::userName(i));
+                        }
+                        benchmarkSink += manager.deleteAccounts(batch);
+                    });
+            manager.compact();
+        }
+
+        measure("load_users", userCount, 1000, [&](size_t)
+                { UserManager reloaded(path); });
+        removeStore(path);
+    }
+
+public:
+    BenchmarkSuite(ostream &output, const GeneratorOptions &generatorOptions, double benchmarkSeconds, unsigned threads)
+        : out(output), options(generatorOptions)
+    {
+        secondsPerBenchmark = benchmarkSeconds;
+        threadCount = max(1u, threads);
+    }
+
+    void run(const vector<size_t> &sizes)
+    {
+        for (size_t users : sizes)
+        {
+            runSize(users);
+        }
     }
 };
 
-int main()
+static int runBenchmarks(int argc, char *argv[])
+{
+    GeneratorOptions options{0, 10, 2.5, 3, 1.2, 42};
+    vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    double seconds = 1;
+    unsigned threads = thread::hardware_concurrency();
+    string outputPath;
+    for (int i = 2; i < argc; i += 2)
+    {
+        string name = argv[i];
+        if (i + 1 >= argc)
+        {
+            cout << "Missing value for " << name << endl;
+            return 2;
+        }
+
+        string value = argv[i + 1];
+        if (name == "--users")
+        {
+            sizes.clear();
+            istringstream list(value);
+            string size;
+            while (getline(list, size, ','))
+            {
+                sizes.push_back(static_cast<size_t>(atof(size.c_str())));
+            }
+        }
+        else if (name == "--degree")
+        {
+            options.meanDegree = atof(value.c_str());
+        }
+        else if (name == "--degree-exponent")
+        {
+            options.degreeExponent = atof(value.c_str());
+        }
+        else if (name == "--posts")
+        {
+            options.postsPerUser = atof(value.c_str());
+        }
+        else if (name == "--like-skew")
+        {
+            options.likeSkew = atof(value.c_str());
+        }
+        else if (name == "--seed")
+        {
+            options.seed = strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (name == "--seconds")
+        {
+            seconds = atof(value.c_str());
+        }
+        else if (name == "--threads")
+        {
+            threads = static_cast<unsigned>(atoi(value.c_str()));
+        }
+        else if (name == "--out")
+        {
+            outputPath = value;
+        }
+        else
+        {
+            cout << "Unknown benchmark option " << name << endl;
+            return 2;
+        }
+    }
+
+    ofstream file;
+    if (!outputPath.empty())
+    {
+        file.open(outputPath);
+    }
+    BenchmarkSuite suite(outputPath.empty() ? cout : file, options, seconds, threads);
+    suite.run(sizes);
+    return 0;
+}
+
+static int runCommandLine(UserManager &userManager, int argc, char *argv[])
+{
+    bool imported = false;
+    string metricsFormat;
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if ((option == "--import-users" || option == "--import-edges") && i + 1 < argc)
+        {
+            string path = argv[++i];
+            if (!(option == "--import-users" ? userManager.importUsers(path) : userManager.importEdges(path)))
+            {
+                return 1;
+            }
+            imported = true;
+        }
+        else if (option == "--delete-users" && i + 1 < argc)
+        {
+            if (!userManager.deleteUsers(argv[++i]))
+            {
+                return 1;
+            }
+        }
+        else if (option == "--clusters")
+        {
+            string path;
+            if (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0)
+            {
+                path = argv[++i];
+            }
+            if (!userManager.reportClusters(cout, path))
+            {
+                return 1;
+            }
+        }
+        else if (option == "--metrics")
+        {
+            metricsFormat = "text";
+            if (i + 1 < argc && (string(argv[i + 1]) == "text" || string(argv[i + 1]) == "json"))
+            {
+                metricsFormat = argv[++i];
+            }
+        }
+        else if (option == "--profile-cache" && i + 1 < argc)
+        {
+            userManager.setProfileCapacity(static_cast<size_t>(atof(argv[++i])));
+        }
+        else if (option == "--serve")
+        {
+            // The rest of the line is the server's; imports only reach the disk with a snapshot, so take it first.
+            if (imported)
+            {
+                userManager.compact();
+            }
+            return runServer(userManager, argc, argv, i + 1);
+        }
+        else if (option == "--batch")
+        {
+            ios::sync_with_stdio(false);
+            BatchRunner runner(userManager);
+            if (i + 1 < argc)
+            {
+                ifstream input(argv[++i]);
+                if (!input.is_open())
+                {
+                    cout << "Unable to open " << argv[i] << endl;
+                    return 1;
+                }
+                runner.run(input);
+            }
+            else
+            {
+                runner.run(cin);
+            }
+        }
+        else
+        {
+            cout << "Usage: " << argv[0] << " [--profile-cache N] [--import-users FILE] [--import-edges FILE] [--delete-users FILE]" << endl
+                 << "          [--batch [FILE]] [--clusters [FILE]] [--metrics [text|json]]" << endl
+                 << "       " << argv[0] << " --serve [--port N | --socket PATH] [--host ADDR] [--workers N] [--profile-cache N]" << endl
+                 << "       " << argv[0] << " --shards N [--port N | --socket PATH] [--host ADDR] [--workers N] [--profile-cache N]" << endl
+                 << "       " << argv[0] << " --load [--port N | --socket PATH] [--host ADDR] [--clients N] [--seconds S]" << endl
+                 << "       " << argv[0] << " --bench [--users 1e3,1e4,...] [--degree D] [--degree-exponent A] [--posts P]" << endl
+                 << "          [--like-skew S] [--seed N] [--seconds S] [--threads N] [--out FILE]" << endl;
+            return 2;
+        }
+    }
+
+    if (imported)
+    {
+        userManager.compact();
+    }
+    if (metricsFormat == "json")
+    {
+        cout << userManager.metricsJson() << endl;
+    }
+    else if (!metricsFormat.empty())
+    {
+        userManager.writeMetrics(cout);
+    }
+    if (!userManager.syncJournal())
+    {
+        cerr << "Unable to write the journal; changes may be lost" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "--bench")
+    {
+        return runBenchmarks(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--load")
+    {
+        return runLoadGenerator(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--shards")
+    {
+        return runShards(argc, argv);
+    }
+
     UserManager userManager("users.txt");
+    if (argc > 1)
+    {
+        return runCommandLine(userManager, argc, argv);
+    }
     userManager.start();
+    if (!userManager.syncJournal())
+    {
+        cerr << "Unable to write the journal; changes may be lost" << endl;
+        return 1;
+    }
 
     return 0;
 }